@@ -0,0 +1,104 @@
+/** @file BackgroundBinPack3d.h
+	@brief Runs the free list maintenance of a packer on a background thread, off the critical path of Insert.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "Rect3d.h"
+#include "GuillotineBinPack3d.h"
+#include "MaxRectsBinPack.h"
+
+namespace rbp {
+
+/** BackgroundBinPack3d wraps a GuillotineBinPack3d or a MaxRectsBinPack and moves their free list maintenance,
+	Rectangle Merge and free space pruning respectively, to a worker thread. Insert only scans for a position and
+	splits the free space it lands in.
+
+	After each placement the worker copies the free list and compacts the copy without holding the lock. Boxes
+	placed in the meantime are logged, and the worker cuts them out of the compacted list before publishing it,
+	so the packer never sees a free list that misses a placement, and a steady stream of boxes does not keep the
+	compacted list from ever being published. Only a reinitialization of the bin throws a result away. */
+class BackgroundBinPack3d
+{
+public:
+	enum Backend
+	{
+		BackendGuillotine, ///< GuillotineBinPack3d, maintained with MergeRectsByKey.
+		BackendMaxRects ///< MaxRectsBinPack with the bottom-left rule, maintained with PruneFreeSpaces.
+	};
+
+	/// Initializes a bin of the given size and starts the worker thread.
+	BackgroundBinPack3d(int width, int height, int depth, Backend backend);
+
+	/// Stops and joins the worker thread.
+	~BackgroundBinPack3d();
+
+	/// (Re)initializes the packer to an empty bin. Thread-safe.
+	void Init(int width, int height, int depth);
+
+	/// Inserts a single box into the bin, possibly rotated in the XOY plane. Thread-safe.
+	/// @return The placement of the box, or a rect of zero size if it did not fit.
+	Rect3d Insert(int width, int height, int depth);
+
+	/// Blocks until the worker has published a compacted free list for the current state of the bin.
+	void WaitForMaintenance();
+
+	/// @return The number of free rectangles or spaces the next Insert scans. Thread-safe.
+	size_t NumFreeRectangles() const;
+
+	/// @return The number of compacted free lists published so far. Thread-safe.
+	unsigned long NumPublished() const;
+
+	/// @return The number of compacted free lists that had boxes placed meanwhile cut out of them. Thread-safe.
+	unsigned long NumRebased() const;
+
+	/// @return The number of compacted free lists thrown away because the bin was reinitialized meanwhile.
+	///		Thread-safe.
+	unsigned long NumDiscarded() const;
+
+	/// Computes the ratio of used volume to the total bin volume. Thread-safe.
+	float Occupancy() const;
+
+	/// Returns a copy of the list of placed boxes. Thread-safe.
+	std::vector<Rect3d> GetUsedRectangles() const;
+
+private:
+	BackgroundBinPack3d(const BackgroundBinPack3d &);
+	BackgroundBinPack3d &operator=(const BackgroundBinPack3d &);
+
+	int binWidth;
+	int binHeight;
+	int binDepth;
+
+	Backend backend;
+	GuillotineBinPack3d guillotine;
+	MaxRectsBinPack maxRects;
+
+	/// Guards the packers and the state below.
+	mutable std::mutex lock;
+	std::condition_variable maintenanceWanted;
+	std::condition_variable maintenanceDone;
+
+	/// Incremented whenever the bin is reinitialized.
+	unsigned long version;
+	/// The boxes placed while the worker compacts a copy of the free list.
+	std::vector<Rect3d> placedSinceSnapshot;
+	bool maintenanceDue;
+	bool workerBusy;
+	bool stopping;
+
+	unsigned long numPublished;
+	unsigned long numRebased;
+	unsigned long numDiscarded;
+
+	std::thread worker;
+
+	void WorkerMain();
+};
+
+}
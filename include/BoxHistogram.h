@@ -0,0 +1,70 @@
+/** @file BoxHistogram.h
+	@brief A running histogram of observed box sizes that can be sampled from.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#pragma once
+
+#include <vector>
+#include <map>
+#include <random>
+
+#include "Rect3d.h"
+
+namespace rbp {
+
+/** BoxHistogram counts how often each box size was observed, and draws sizes with the observed frequencies. It is
+	the empirical box distribution that online heuristics use to look ahead.
+
+	Add and Prepare must not run concurrently with anything else; Sample is const and may be called from several
+	threads at once, each with its own random number generator. */
+class BoxHistogram
+{
+public:
+	BoxHistogram();
+
+	/// Forgets all observations.
+	void Clear();
+
+	/// Records one observed box.
+	void Add(int width, int height, int depth);
+
+	/// Builds the sampling table. Call after adding boxes and before sampling.
+	void Prepare();
+
+	/// Draws a box size with probability proportional to its observed count. The histogram must not be empty.
+	RectSize3d Sample(std::mt19937 &rng) const;
+
+	/// @return The number of distinct box sizes observed.
+	int NumDistinct() const { return (int)sizes.size(); }
+
+	/// @return The number of boxes observed.
+	unsigned long Total() const { return total; }
+
+private:
+	struct SizeKey
+	{
+		int width;
+		int height;
+		int depth;
+
+		bool operator<(const SizeKey &rhs) const
+		{
+			if (width != rhs.width) return width < rhs.width;
+			if (height != rhs.height) return height < rhs.height;
+			return depth < rhs.depth;
+		}
+	};
+
+	/// Index into sizes and counts for each observed size.
+	std::map<SizeKey, size_t> index;
+
+	std::vector<RectSize3d> sizes;
+	std::vector<unsigned long> counts;
+
+	/// Prefix sums of counts, built by Prepare.
+	std::vector<unsigned long> cumulative;
+
+	unsigned long total;
+};
+
+}
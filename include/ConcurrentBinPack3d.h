@@ -0,0 +1,123 @@
+/** @file ConcurrentBinPack3d.h
+	@brief Lets several robot arms insert into the same bin concurrently by locking spatial regions.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <atomic>
+
+#include "Rect3d.h"
+#include "GuillotineBinPack3d.h"
+
+namespace rbp {
+
+/** ConcurrentBinPack3d partitions the footprint of the bin into a grid of regions, each running its own
+	GuillotineBinPack3d over the full bin depth and guarded by its own mutex. The free space of the bin is owned by
+	the regions, so inserts into different regions never touch the same data and proceed in parallel.
+
+	Each arm has a home region. Insert first tries the regions optimistically with try_lock, starting from the home
+	region, and skips regions that another arm is working in. Only if no free region could take the box does it
+	retry the skipped regions, this time waiting for their locks. As long as the arms mostly work in their own
+	regions, throughput scales with the number of arms.
+
+	A box that no single region can take may still fit across several. Insert then searches a copy of the free
+	space of all regions without holding any lock, locks the regions the chosen placement covers in ascending
+	order, which rules out deadlocks between arms, and validates against their live free lists that the space is
+	still free before cutting the box out of each of them. If another arm took part of the space in the meantime,
+	the search is retried, and the last retry holds all locks so that it cannot be invalidated. */
+class ConcurrentBinPack3d
+{
+public:
+	/// Initializes a bin of the given size, split into regionsX x regionsY regions in the XOY plane.
+	ConcurrentBinPack3d(int width, int height, int depth, int regionsX, int regionsY);
+
+	/// Sets the heuristics of the per-region packers. Not thread-safe, call before inserting.
+	void SetHeuristics(GuillotineBinPack3d::MergePolicy mergePolicy,
+		GuillotineBinPack3d::FreeRectChoiceHeuristic rectChoice,
+		GuillotineBinPack3d::GuillotineSplitHeuristic splitMethod);
+
+	/// Inserts a single box into the bin, possibly rotated in the XOY plane. Thread-safe.
+	/// @param arm The arm placing the box. Its home region is tried first.
+	/// @return The placement in bin coordinates, or a rect of zero size if no region could take the box.
+	Rect3d Insert(int width, int height, int depth, int arm);
+
+	/// @return The number of regions.
+	int NumRegions() const { return (int)regions.size(); }
+
+	/// @return The number of times an arm found a region locked by another arm.
+	unsigned long Contentions() const { return contentions.load(); }
+
+	/// @return The number of placements across regions that failed validation and had to be searched again.
+	unsigned long Conflicts() const { return conflicts.load(); }
+
+	/// Returns a copy of the list of placed boxes in bin coordinates. Thread-safe.
+	std::vector<Rect3d> GetUsedRectangles() const;
+
+	/// Computes the ratio of used volume to the total bin volume. Thread-safe.
+	float Occupancy() const;
+
+private:
+	struct Region
+	{
+		std::mutex lock;
+		int x;
+		int y;
+		int width;
+		int height;
+		GuillotineBinPack3d packer;
+	};
+
+	int binWidth;
+	int binHeight;
+	int binDepth;
+
+	GuillotineBinPack3d::MergePolicy mergePolicy;
+	GuillotineBinPack3d::FreeRectChoiceHeuristic rectChoice;
+	GuillotineBinPack3d::GuillotineSplitHeuristic splitMethod;
+
+	std::vector<std::unique_ptr<Region> > regions;
+
+	mutable std::mutex usedLock;
+	std::vector<Rect3d> usedRectangles;
+
+	std::atomic<unsigned long> usedVolume;
+	std::atomic<unsigned long> contentions;
+	std::atomic<unsigned long> conflicts;
+
+	/// Inserts the box into the given region, whose lock the caller holds.
+	/// @return True if the region took the box, in which case newNode receives its placement in bin coordinates.
+	bool InsertIntoRegion(Region &region, int width, int height, int depth, Rect3d &newNode);
+
+	/// Appends the free space of a region, including its quarantined rectangles, to out in bin coordinates.
+	/// The caller holds the lock of the region.
+	static void CopyFreeSpace(const Region &region, std::vector<Rect3d> &out);
+
+	/// Finds the bottom-left-most placement of the box that is covered by the given free space, which may span
+	/// several regions.
+	/// @return True if there is one, in which case newNode receives it.
+	bool FindPlacement(const std::vector<Rect3d> &freeSpace, int width, int height, int depth, Rect3d &newNode) const;
+
+	/// Cuts newNode out of every region it covers. The caller holds the locks of those regions, and newNode
+	/// must be free in them.
+	void PlaceAcrossRegions(const Rect3d &newNode);
+
+	enum CrossRegionResult
+	{
+		CrossRegionPlaced, ///< The box was placed.
+		CrossRegionNoSpace, ///< There is no room for the box. Free space only shrinks, so this is final.
+		CrossRegionConflict ///< Another arm took part of the chosen space between the search and the validation.
+	};
+
+	/// Tries to place the box across several regions.
+	/// @param lockAll If true, all regions are held for the search, so that validation cannot fail.
+	/// @param newNode [out] Receives the placement if the box was placed.
+	CrossRegionResult InsertAcrossRegions(int width, int height, int depth, bool lockAll, Rect3d &newNode);
+
+	/// Records a placed box.
+	void AddUsed(const Rect3d &newNode);
+};
+
+}
@@ -0,0 +1,86 @@
+/** @file DominanceCounter3d.h
+	@brief Counts how many pending boxes fit into a given box in polylogarithmic time.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#pragma once
+
+#include <vector>
+#include <map>
+
+#include "Rect3d.h"
+
+namespace rbp {
+
+/** DominanceCounter3d answers "how many of the remaining boxes fit into a free box of size W x H x D" for the
+	GUILLOTINE-MAXFITTING heuristic. Boxes may be rotated in the XOY plane, so each box is stored by its
+	canonical dimensions (min(width,height), max(width,height), depth), which turns the fit test into a plain
+	3D dominance test.
+
+	The point set is fixed by Build(); afterwards boxes can only be removed (and re-added). The structure is a
+	Fenwick tree over the first coordinate whose nodes hold Fenwick trees over the second coordinate, whose nodes
+	in turn hold a Fenwick tree over the compressed third coordinate. Memory is O(n log^2 n), Remove/Add and
+	CountFitting take O(log^3 n) time. */
+class DominanceCounter3d
+{
+public:
+	DominanceCounter3d();
+
+	/// Rebuilds the index over the given boxes. All boxes start out as present.
+	void Build(const std::vector<RectSize3d> &boxes);
+
+	/// Removes one instance of the given box. The box must have been part of the set passed to Build().
+	void Remove(const RectSize3d &box);
+
+	/// Adds back one instance of a box previously removed with Remove().
+	void Add(const RectSize3d &box);
+
+	/// @return The number of present boxes that fit into a free box of size width x height x depth, possibly rotated.
+	int CountFitting(int width, int height, int depth) const;
+
+	/// @return The number of present boxes that fit perfectly into a free box of size width x height x depth.
+	int CountPerfectFits(int width, int height, int depth) const;
+
+	/// @return The number of boxes currently present.
+	int Size() const { return numPresent; }
+
+private:
+	struct InnerNode
+	{
+		std::vector<int> depths; ///< Sorted unique depth values of the boxes in this node.
+		std::vector<int> tree; ///< Fenwick tree of box counts over depths.
+	};
+
+	struct OuterNode
+	{
+		std::vector<int> longSides; ///< Sorted unique long side values of the boxes in this node.
+		std::vector<InnerNode> inner; ///< Fenwick tree over longSides, 1-based.
+	};
+
+	struct CanonicalBox
+	{
+		int shortSide;
+		int longSide;
+		int depth;
+
+		bool operator<(const CanonicalBox &rhs) const
+		{
+			if (shortSide != rhs.shortSide) return shortSide < rhs.shortSide;
+			if (longSide != rhs.longSide) return longSide < rhs.longSide;
+			return depth < rhs.depth;
+		}
+	};
+
+	static CanonicalBox Canonical(int width, int height, int depth);
+
+	void Update(const CanonicalBox &box, int delta);
+
+	std::vector<int> shortSides; ///< Sorted unique short side values of all boxes.
+	std::vector<OuterNode> outer; ///< Fenwick tree over shortSides, 1-based.
+
+	/// Number of present boxes for each distinct canonical size. Answers the perfect fit queries.
+	std::map<CanonicalBox, int> exactCounts;
+
+	int numPresent;
+};
+
+}
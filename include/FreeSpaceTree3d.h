@@ -0,0 +1,88 @@
+/** @file FreeSpaceTree3d.h
+	@brief A binary space partition over disjoint free boxes with per-subtree maxima, for first-fit queries.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+#include "Rect3d.h"
+
+namespace rbp {
+
+/** FreeSpaceTree3d indexes a set of disjoint free boxes by their corners in bottom-up (z, y, x) order. Every node
+	holds one free box and cuts the space of its subtree at the corner of that box, the boxes before it going to
+	the left and the ones after it to the right, so an in-order walk visits the boxes in bottom-up order. Each node
+	also keeps the maximum width, height, depth and volume found in its subtree. A fit query descends only into
+	the subtrees whose maxima can hold the box, and returns the first box in bottom-up order the box fits into.
+
+	The tree is a treap: nodes get pseudo-random priorities, which keeps its depth logarithmic in expectation
+	whatever the order of the updates. Insert and Erase take O(log n) time, Build O(n). */
+class FreeSpaceTree3d
+{
+public:
+	FreeSpaceTree3d();
+
+	/// Replaces the contents with the given boxes, which must be disjoint and sorted bottom-up.
+	void Build(const std::vector<Rect3d> &sortedRects);
+
+	/// Adds a free box. It must be disjoint from the ones in the tree.
+	void Insert(const Rect3d &rect);
+
+	/// Removes the free box with the same corner as rect.
+	/// @return False if there is none.
+	bool Erase(const Rect3d &rect);
+
+	void Clear();
+
+	size_t Size() const { return nodes.size() - freeNodes.size(); }
+
+	/// @return The first free box in bottom-up order that a width x height x depth box fits into, upright or
+	///		rotated in the XOY plane, or null if there is none.
+	const Rect3d *FindFirstFit(int width, int height, int depth) const;
+
+	/// @return The number of heap bytes held by the tree.
+	size_t MemoryBytes() const;
+
+private:
+	struct Node
+	{
+		Rect3d rect;
+		unsigned int priority;
+		int left;
+		int right;
+		/// Maxima over the subtree.
+		int maxWidth;
+		int maxHeight;
+		int maxDepth;
+		long long maxVolume;
+	};
+
+	/// Node storage. Erased nodes are recycled through freeNodes.
+	std::vector<Node> nodes;
+	std::vector<int> freeNodes;
+	int root;
+	/// State of the priority generator, fixed so that runs are reproducible.
+	unsigned int seed;
+
+	int NewNode(const Rect3d &rect);
+	unsigned int NextPriority();
+
+	/// Recomputes the maxima of node from its box and its children.
+	void Update(int node);
+
+	/// Splits the subtree t into the boxes before rect, and the ones after it. The box at the corner of rect
+	/// itself goes left if orEqual is set, right otherwise.
+	void Split(int t, const Rect3d &rect, bool orEqual, int &left, int &right);
+
+	/// Joins two subtrees, all boxes of left coming before those of right.
+	int Merge(int left, int right);
+
+	/// @return True if the maxima of node allow a width x height x depth box somewhere in its subtree.
+	bool MayHold(int node, int width, int height, int depth, long long volume) const;
+
+	int FindFirstFit(int node, int width, int height, int depth, long long volume) const;
+};
+
+}
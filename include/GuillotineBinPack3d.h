@@ -6,8 +6,14 @@
 #pragma once
 
 #include <vector>
+#include <map>
 
 #include "Rect3d.h"
+#include "FreeSpaceTree3d.h"
+#include "DominanceCounter3d.h"
+#include "HeuristicBandit.h"
+#include "TraceRecorder.h"
+#include "ThreadPool.h"
 
 namespace rbp {
 
@@ -50,6 +56,22 @@ public:
 		SplitLongerAxis ///< -LAS
 	};
 
+	/// Specifies when the free list is defragmented with Rectangle Merge operations.
+	enum MergePolicy
+	{
+		MergeNever, ///< Never merge free rectangles.
+		MergeAlways, ///< Run MergeFreeList after every placement.
+		MergeLazy ///< Merge a few rectangles after every placement, and fully only when Fragmentation() exceeds
+		          ///< the lazy merge threshold or when no free rectangle can hold the new one.
+	};
+
+	/// Specifies how Insert and TryInsert search the free rectangles, see SetFreeSpaceBackend.
+	enum FreeSpaceBackend
+	{
+		FreeSpaceList, ///< Scan the free list level by level.
+		FreeSpaceTree ///< Descend a FreeSpaceTree3d kept next to the free list.
+	};
+
 	/// Inserts a single rectangle into the bin. The packer might rotate the rectangle, in which case the returned
 	/// struct will have the width and height values swapped.
 	/// @param merge If true, performs free Rectangle Merge procedure after packing the new rectangle. This procedure
@@ -59,6 +81,30 @@ public:
 	/// @param splitMethod The free rectangle split heuristic rule to use.
 	Rect3d Insert(int width, int height, int depth,  bool merge, FreeRectChoiceHeuristic rectChoice, GuillotineSplitHeuristic splitMethod);
 
+	/// Inserts a single rectangle into the bin, defragmenting the free list according to the given merge policy.
+	Rect3d Insert(int width, int height, int depth, MergePolicy mergePolicy, FreeRectChoiceHeuristic rectChoice, GuillotineSplitHeuristic splitMethod);
+
+	/// Inserts a single rectangle into the bin with the split heuristic picked by an online bandit. A fraction of
+	/// the inserts, see SetAdaptiveParameters, also scores one heuristic in the shadow: the recently inserted sizes
+	/// are replayed into the free rectangle the new one goes into, split by that heuristic, and the filled share
+	/// is its reward. The live heuristic is the one with the best discounted reward, so it follows a shifting
+	/// box mix. A sampled insert costs O(historySize^2) extra time.
+	/// The free rectangle choice is first fit either way, see FindPositionForNewNode.
+	Rect3d InsertAdaptive(int width, int height, int depth, MergePolicy mergePolicy);
+
+	/// Configures InsertAdaptive. The statistics are kept over Init, since the box mix outlives a single bin.
+	/// @param sampleRate The fraction of inserts that score a heuristic in the shadow, in [0, 1].
+	/// @param historySize The number of recent box sizes the shadow score is computed against.
+	/// @param discount Forgetting factor of the bandit, see HeuristicBandit::SetParameters.
+	/// @param exploration Weight of the bandit confidence bonus.
+	void SetAdaptiveParameters(float sampleRate, int historySize, float discount, float exploration);
+
+	/// @return The split heuristic InsertAdaptive uses for the next insert.
+	GuillotineSplitHeuristic GetAdaptiveSplitHeuristic() const { return (GuillotineSplitHeuristic)splitBandit.BestArm(); }
+
+	/// Returns the shadow statistics of the split heuristics, indexed by GuillotineSplitHeuristic.
+	const HeuristicBandit &GetSplitBandit() const { return splitBandit; }
+
 	/// Inserts a list of rectangles into the bin.
 	/// @param rects The list of rectangles to add. This list will be destroyed in the packing process.
 	/// @param merge If true, performs Rectangle Merge operations during the packing process.
@@ -67,25 +113,161 @@ public:
 	void Insert(std::vector<RectSize3d> &rects, bool merge, 
 		FreeRectChoiceHeuristic rectChoice, GuillotineSplitHeuristic splitMethod);
 
-// Implements GUILLOTINE-MAXFITTING, an experimental heuristic that's really cool but didn't quite work in practice.
-//	void InsertMaxFitting(std::vector<RectSize> &rects, std::vector<Rect> &dst, bool merge, 
-//		FreeRectChoiceHeuristic rectChoice, GuillotineSplitHeuristic splitMethod);
+	/// Implements GUILLOTINE-MAXFITTING, an experimental heuristic that packs the rectangle that leaves the most
+	/// choices still open. The number of pending rectangles that fit into each split candidate is answered by a
+	/// DominanceCounter3d, so each candidate costs O(log^3 |rects|) instead of O(|rects|).
+	/// @param rects The list of rectangles to add. This list will be destroyed in the packing process.
+	/// @param dst [out] This list will contain the packed rectangles.
+	/// @param merge If true, performs Rectangle Merge operations during the packing process.
+	/// The heuristic picks the free rectangle with the shortest side and the split itself, so it takes no free
+	/// rectangle choice or split heuristic.
+	void InsertMaxFitting(std::vector<RectSize3d> &rects, std::vector<Rect3d> &dst, bool merge);
+
+	/// Lists up to maxCandidates placements of a width x height x depth box, lowest first. Each one sits in the
+	/// corner of a free rectangle, upright or rotated in the XOY plane. The first one is where Insert would go.
+	void FindCandidatePositions(int width, int height, int depth, size_t maxCandidates, std::vector<Rect3d> &candidates) const;
+
+	/// Places a box at a position returned by FindCandidatePositions, and splits the free rectangle it sits in.
+	/// @return False if the position is not in the corner of a free rectangle, in which case nothing is done.
+	bool InsertAt(const Rect3d &placement, MergePolicy mergePolicy, GuillotineSplitHeuristic splitMethod);
+
+	/// Finds where Insert would put a width x height x depth box without changing the packer, so that several
+	/// bins can be asked before committing to one. The score is that of rectChoice for the free rectangle found.
+	/// Unlike Insert with MergeLazy, no merge is tried when the box does not fit.
+	/// @return A token with a placement of zero size if the box does not fit.
+	InsertToken TryInsert(int width, int height, int depth, FreeRectChoiceHeuristic rectChoice) const;
+
+	/// Runs TryInsert for each of boxes, for planners that score many candidate boxes against the bin. Tiles of
+	/// boxes are matched against blocks of the free list small enough to stay in cache, with a fit test the
+	/// compiler vectorizes, so the free list is read once per tile rather than once per box. The tiles are spread
+	/// over pool once there are enough pairs of boxes and free rectangles to pay for it. Committing any one of
+	/// the tokens makes the others stale.
+	/// @param tokens [out] tokens[i] is what TryInsert returns for boxes[i].
+	/// @param pool The threads to score on, or null to score on the calling thread. It must not run another
+	///		ParallelFor meanwhile.
+	void TryInsertBatch(const std::vector<RectSize3d> &boxes, FreeRectChoiceHeuristic rectChoice,
+		std::vector<InsertToken> &tokens, ThreadPool *pool = 0) const;
+
+	/// Places the box of a token returned by TryInsert on this packer into the free rectangle found then, so
+	/// only the split and the merge are done.
+	/// @return False if the token has no placement or the free list changed since TryInsert, in which case
+	///		nothing is done.
+	bool Commit(const InsertToken &token, MergePolicy mergePolicy, GuillotineSplitHeuristic splitMethod);
+
+	/// Marks the given region of the bin as used, e.g. because it was filled by another packer sharing the bin.
+	/// Free rectangles that intersect it are cut into up to six disjoint pieces around it.
+	/// Takes up O(|freeRectangles|) time.
+	void PlaceRect(const Rect3d &rect);
 
 	/// Computes the ratio of used/total surface area. 0.00 means no space is yet used, 1.00 means the whole bin is used.
 	float Occupancy() const;
 
 	/// Returns the internal list of disjoint rectangles that track the free area of the bin. You may alter this vector
-	/// any way desired, as long as the end result still is a list of disjoint rectangles.
+	/// any way desired, as long as the end result still is a list of disjoint rectangles. Call SortFreeList afterwards.
 	std::vector<Rect3d> &GetFreeRectangles() { return freeRectangles; }
+	const std::vector<Rect3d> &GetFreeRectangles() const { return freeRectangles; }
+
+	/// Restores the bottom-up (z, y, x) order of the free list and rebuilds its per-level bounds. Needed only after
+	/// modifying the list returned by GetFreeRectangles.
+	void SortFreeList();
 
 	/// Returns the list of packed rectangles. You may alter this vector at will, for example, you can move a Rect from
 	/// this list to the Free Rectangles list to free up space on-the-fly, but notice that this causes fragmentation.
 	std::vector<Rect3d> &GetUsedRectangles() { return usedRectangles; }
+	const std::vector<Rect3d> &GetUsedRectangles() const { return usedRectangles; }
+
+	/// Returns the heap memory held by the free and used lists, the free levels and the InsertAdaptive buffers.
+	/// The size of a free level node is estimated, since std::map does not expose it.
+	PackerMemoryUsage GetMemoryUsage() const;
+
+	/// Returns the free rectangles that are too small to hold any item, see SetMinItemSize. They are not scanned
+	/// during placement, but still take part in MergeFreeList so that they can be merged back into useful space.
+	const std::vector<Rect3d> &GetQuarantinedRectangles() const { return quarantinedRectangles; }
 
 	/// Performs a Rectangle Merge operation. This procedure looks for adjacent free rectangles and merges them if they
 	/// can be represented with a single rectangle. Takes up Theta(|freeRectangles|^2) time.
 	void MergeFreeList();
 
+	/// Calls MergeFreeList until the free list no longer changes, so that runs of three or more rectangles are
+	/// merged as well.
+	void MergeFreeListFull();
+
+	/// Performs a bounded slice of Rectangle Merge work: each step makes one pass trying to merge one free rectangle
+	/// with all the others, resuming where the previous call left off. A rectangle that grew is tried again by the
+	/// next step. Takes up O(numSteps * |freeRectangles|) time.
+	void MergeFreeListIncremental(int numSteps);
+
+	/// Performs one pass of Rectangle Merge over a list of disjoint rectangles. Touches no packer state, so it can
+	/// run on a snapshot on another thread.
+	static void MergeRects(std::vector<Rect3d> &rects);
+
+	/// Calls MergeRects until the list no longer changes.
+	static void MergeRectsFull(std::vector<Rect3d> &rects);
+
+	/// Merges a list of disjoint rectangles to a fixed point in O(n log n) time per pass. Two rectangles can only
+	/// merge along an axis if they agree on the position and size along the other two axes. So a pass along one
+	/// axis groups the rectangles by those four values, and each group is an independent 1D interval coalescing
+	/// problem over the rectangles sorted along the axis. The groups are hashed into partitions that are sorted
+	/// and coalesced in parallel on pool, if given. The passes cycle through the axes until three in a row merge
+	/// nothing. Degenerate rectangles are dropped. Touches no packer state.
+	static void MergeRectsByKey(std::vector<Rect3d> &rects, ThreadPool *pool);
+
+	/// Runs MergeRectsByKey over the free and quarantined rectangles.
+	void MergeFreeListByKey();
+
+	/// Makes MergeFreeListFull, and with it the full merges of MergeLazy, run MergeFreeListByKey instead of
+	/// MergeFreeList passes. Both reach a state where no two rectangles can merge, but since they merge in a
+	/// different order, the resulting free lists may differ.
+	/// @param pool The threads MergeRectsByKey runs on, or null to run it on the calling thread. Must outlive the
+	///		packer or the next call, and must not run another ParallelFor while the packer merges.
+	void SetKeyedMerge(bool enabled, ThreadPool *pool = 0)
+	{
+		keyedMerge = enabled;
+		mergePool = pool;
+	}
+
+	/// Copies the free and the quarantined rectangles into snapshot, for merging them off the critical path.
+	void GetMaintenanceSnapshot(std::vector<Rect3d> &snapshot) const;
+
+	/// Replaces the free and quarantined rectangles with the merged snapshot, and cuts the boxes placed since
+	/// GetMaintenanceSnapshot out of it again.
+	/// @param placedSince The boxes placed since the snapshot was taken, in any order.
+	void PublishMergedFreeList(const std::vector<Rect3d> &merged, const std::vector<Rect3d> &placedSince);
+
+	/// Returns the number of free rectangles per unit of free volume, normalized so that an empty bin returns 1.
+	/// Grows as the free space gets chopped into many small pieces.
+	float Fragmentation() const;
+
+	/// Configures MergeLazy. A full merge runs whenever Fragmentation() exceeds fragmentationThreshold after a
+	/// placement, and incrementalSteps steps of MergeFreeListIncremental run after every placement.
+	void SetLazyMergeParameters(float fragmentationThreshold, int incrementalSteps)
+	{
+		lazyMergeThreshold = fragmentationThreshold;
+		lazyMergeSteps = incrementalSteps;
+	}
+
+	/// Selects how Insert and TryInsert find the first free rectangle a box fits into. FreeSpaceTree keeps the
+	/// free rectangles in a binary space partition whose subtrees know the largest width, height, depth and
+	/// volume inside, so the search only visits the subtrees that can hold the box instead of whole levels.
+	/// Keeping the tree up to date costs O(log n) per free rectangle added or removed, and a rebuild whenever the
+	/// free list is sorted again, e.g. after every merge. Both backends find the same free rectangle, so the
+	/// packing does not change.
+	void SetFreeSpaceBackend(FreeSpaceBackend backend);
+
+	/// Makes the packer record its phases (scan, split, merge and sort) with free list sizes as arguments. Pass
+	/// null to stop tracing. The recorder must outlive the packer or the next call.
+	void SetTraceRecorder(TraceRecorder *recorder) { traceRecorder = recorder; }
+
+	/// Specifies the smallest item size the packer will ever be asked to place. Free rectangles produced by a split
+	/// that cannot hold an item of at least this size (in either XOY orientation) are moved to the quarantine
+	/// list instead of the free list. Pass zeros to disable the filtering.
+	void SetMinItemSize(int minWidth, int minHeight, int minDepth);
+
+	/// If enabled, the minimum item size is learned online from the sizes passed to Insert, overriding the value
+	/// given to SetMinItemSize. Whenever a smaller item shows up, quarantined rectangles that can hold it are
+	/// moved back to the free list.
+	void SetLearnMinItemSize(bool enabled) { learnMinItemSize = enabled; }
+
 private:
 	int binWidth;
 	int binHeight;
@@ -96,20 +278,127 @@ private:
 	std::vector<Rect3d> usedRectangles;
 
 	/// Stores a list of rectangles that represents the free area of the bin. This rectangles in this list are disjoint.
+	/// The list is kept sorted in bottom-up (z, y, x) order, so that the rectangles of each z level are contiguous.
 	std::vector<Rect3d> freeRectangles;
 
+	/// Summary of the free rectangles that start at one z level. The maxima are upper bounds: they are exact after
+	/// a rebuild or a full scan of the level, and may be stale after a rectangle was removed.
+	struct FreeLevel
+	{
+		int count;
+		int maxWidth;
+		int maxHeight;
+		int maxDepth;
+
+		void Add(const Rect3d &r)
+		{
+			++count;
+			if (r.width > maxWidth) maxWidth = r.width;
+			if (r.height > maxHeight) maxHeight = r.height;
+			if (r.depth > maxDepth) maxDepth = r.depth;
+		}
+
+		/// @return False if no rectangle of the level can hold a width x height x depth box in either orientation.
+		bool MayHold(int width, int height, int depth) const
+		{
+			return depth <= maxDepth &&
+				((width <= maxWidth && height <= maxHeight) || (height <= maxWidth && width <= maxHeight));
+		}
+	};
+
+	/// The occupied z levels of freeRectangles, lowest first.
+	std::map<int, FreeLevel> freeLevels;
+
+	/// Free rectangles that are too small for any item. Disjoint from each other and from freeRectangles.
+	std::vector<Rect3d> quarantinedRectangles;
+
+	/// The smallest item size seen or configured. Free rectangles that cannot hold it are quarantined.
+	int minItemWidth = 0;
+	int minItemHeight = 0;
+	int minItemDepth = 0;
+
+	bool learnMinItemSize = false;
+	bool seenItemSize = false;
+
+	/// Total volume of usedRectangles, tracked incrementally.
+	unsigned long usedVolume = 0;
+
+	/// Parameters of MergeLazy, see SetLazyMergeParameters.
+	float lazyMergeThreshold = 32.f;
+	int lazyMergeSteps = 4;
+
+	/// Index of the free rectangle MergeFreeListIncremental continues from.
+	size_t mergeCursor = 0;
+
+	/// True if no split happened since the last MergeFreeListFull, so that running it again is pointless.
+	bool freeListFullyMerged = true;
+
+	/// Counts the changes to the free list, so that Commit can tell stale tokens.
+	unsigned long freeListVersion = 0;
+
+	/// See SetFreeSpaceBackend. The tree holds the same rectangles as freeRectangles if the backend is
+	/// FreeSpaceTree, and nothing otherwise.
+	FreeSpaceBackend freeSpaceBackend = FreeSpaceList;
+	FreeSpaceTree3d freeSpaceTree;
+
+	/// The merge of MergeFreeListFull, see SetKeyedMerge.
+	bool keyedMerge = false;
+	ThreadPool *mergePool = 0;
+
+	/// Receives the phase timings, or null if tracing is off.
+	TraceRecorder *traceRecorder = 0;
+
+	/// The number of GuillotineSplitHeuristic values.
+	static const int numSplitHeuristics = 6;
+
+	/// State of InsertAdaptive, see SetAdaptiveParameters.
+	HeuristicBandit splitBandit = HeuristicBandit(numSplitHeuristics);
+	float adaptiveSampleRate = 0.125f;
+	float adaptiveSampleCredit = 0.f;
+
+	/// Ring buffer of the most recent box sizes passed to InsertAdaptive.
+	std::vector<RectSize3d> recentItems;
+	size_t recentItemsNext = 0;
+	size_t recentItemsCapacity = 32;
+
+	/// Scratch free list of ScoreSplitInShadow.
+	std::vector<Rect3d> shadowFreeRectangles;
+
 #ifdef _DEBUG
 	/// Used to track that the packer produces proper packings.
 	DisjointRectCollection3d disjointRects;
 #endif
 
 	/// Goes through the list of free rectangles and finds the best one to place a rectangle of given size into.
-	/// Running time is Theta(|freeRectangles|).
+	/// Running time is O(|freeRectangles|), but whole z levels that cannot hold the rectangle are skipped.
 	/// @param nodeIndex [out] The index of the free rectangle in the freeRectangles array into which the new
 	///		rect was placed.
 	/// @return A Rect structure that represents the placement of the new rect into the best free rectangle.
 	Rect3d FindPositionForNewNode(int width, int height, int depth, FreeRectChoiceHeuristic rectChoice, int *nodeIndex);
 
+	/// Tests the free rectangle at index i with the perfect fit, upright and sideways rules, in that order.
+	/// @return True if the rectangle fits, in which case bestNode receives the placement.
+	bool FindPositionInFreeRect(int width, int height, int depth, size_t i, Rect3d &bestNode) const;
+
+	/// The bottom-up order of the free list.
+	static bool FreeRectOrder(const Rect3d &a, const Rect3d &b);
+
+	/// @return The index of the first free rectangle at level z, or of the first one above it.
+	size_t LevelBegin(int z) const;
+
+	/// Finds the first free rectangle a box fits into with freeSpaceTree, and where the box goes in it.
+	/// @return False if the box fits nowhere.
+	bool FindPositionInTree(int width, int height, int depth, size_t &freeNodeIndex, Rect3d &bestNode) const;
+
+	/// Inserts a free rectangle at its place in the bottom-up order.
+	void InsertFreeRectSorted(const Rect3d &freeRect);
+
+	/// Removes the free rectangle at the given index.
+	void EraseFreeRect(size_t index);
+
+	/// Recomputes freeLevels from freeRectangles, which must be sorted already.
+	void RebuildFreeLevels();
+
 	static int ScoreByHeuristic(int width, int height, int depth, const Rect3d &freeRect, FreeRectChoiceHeuristic rectChoice);
 	// The following functions compute (penalty) score values if a rect of the given size was placed into the 
 	// given free rectangle. In these score values, smaller is better.
@@ -122,12 +411,69 @@ private:
 	static int ScoreWorstShortSideFit(int width, int height,int depth, const Rect3d &freeRect);
 	static int ScoreWorstLongSideFit(int width, int height, int depth, const Rect3d &freeRect);
 
+	/// @return True if an item of the minimum item size fits into freeRect, possibly rotated.
+	bool CanHoldMinItem(const Rect3d &freeRect) const;
+
+	/// Adds a non-degenerate free rectangle to either the free list or the quarantine list.
+	void AddFreeRect(const Rect3d &freeRect);
+
+	/// Appends the parts of freeRect not covered by usedRect to out.
+	/// @return False if the two do not intersect, in which case nothing is appended.
+	static bool SubtractRect(const Rect3d &freeRect, const Rect3d &usedRect, std::vector<Rect3d> &out);
+
+	/// Cuts the free and quarantined rectangles around the given box. This is the free list half of PlaceRect.
+	void CutFreeList(const Rect3d &rect);
+
+	/// Updates the learned minimum item size with an item about to be inserted.
+	void ObserveItemSize(int width, int height, int depth);
+
+	/// Moves the quarantined rectangles that can hold the current minimum item size back to the free list.
+	void ReleaseQuarantine();
+
+	/// Merges b into a if the union of the two is a rectangle.
+	/// @return True if merged, in which case the caller must erase b.
+	static bool TryMergeRects(Rect3d &a, const Rect3d &b);
+
+	/// Merges the free and quarantined rectangles with MergeRectsByKey if byKey is set, or else with one pass of
+	/// MergeRects, and sorts the result back into the two lists.
+	void MergeAllFreeRects(bool byKey);
+
+	/// Inserts a single rectangle. If scoreSplit is true, ScoreSplitInShadow runs on the free rectangle the new one
+	/// goes into, before the split is made.
+	Rect3d InsertWithPolicy(int width, int height, int depth, MergePolicy mergePolicy, FreeRectChoiceHeuristic rectChoice,
+		GuillotineSplitHeuristic splitMethod, bool scoreSplit);
+
+	/// Places newRect into the corner of freeRectangles[freeNodeIndex], splits the rest of that free rectangle and
+	/// merges the free list according to mergePolicy.
+	void PlaceInFreeRect(size_t freeNodeIndex, const Rect3d &newRect, MergePolicy mergePolicy,
+		GuillotineSplitHeuristic splitMethod);
+
+	/// Scores the split heuristic the bandit wants to explore on placing placedRect into freeRect, followed by the
+	/// recent box sizes, and updates the bandit with the result.
+	void ScoreSplitInShadow(const Rect3d &freeRect, const Rect3d &placedRect);
+
+	/// @return True if the given heuristic splits the L-shaped leftover of freeRect horizontally.
+	static bool ChooseSplitAxis(const Rect3d &freeRect, const Rect3d &placedRect, GuillotineSplitHeuristic method);
+
 	/// Splits the given L-shaped free rectangle into two new free rectangles after placedRect has been placed into it.
 	/// Determines the split axis by using the given heuristic.
 	void SplitFreeRectByHeuristic(const Rect3d &freeRect, const Rect3d &placedRect, GuillotineSplitHeuristic method);
 
 	/// Splits the given L-shaped free rectangle into two new free rectangles along the given fixed split axis.
 	void SplitFreeRectAlongAxis(const Rect3d &freeRect, const Rect3d &placedRect, bool splitHorizontal);
+
+	/// Computes the three free rectangles that SplitFreeRectAlongAxis would produce. Degenerate results are
+	/// returned as well and have a zero side.
+	static void ComputeSplit(const Rect3d &freeRect, const Rect3d &placedRect, bool splitHorizontal,
+		Rect3d &up, Rect3d &bottom, Rect3d &right);
+
+	/// A helper function for GUILLOTINE-MAXFITTING. Counts how many rectangles fit into the free rectangles that
+	/// result from placing a width x height x depth rectangle into freeRect and splitting along the given axis.
+	/// usedRect is the rectangle being placed and is excluded from the count.
+	/// @param score1 [out] The smallest count over the non-degenerate split results.
+	/// @param score2 [out] The largest count over the non-degenerate split results.
+	static void CountNumFitting(const Rect3d &freeRect, int width, int height, int depth, const RectSize3d &usedRect,
+		bool splitHorizontal, const DominanceCounter3d &fitCounter, int &score1, int &score2);
 };
 
 }
\ No newline at end of file
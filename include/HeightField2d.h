@@ -0,0 +1,62 @@
+/** @file HeightField2d.h
+	@brief A height field over the bin floor with logarithmic range updates and range maximum queries.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#pragma once
+
+#include <vector>
+
+namespace rbp {
+
+/** HeightField2d tracks the height of the stack over the XOY plane of a bin, rasterized to square cells.
+	Heights only ever grow, which lets both RaiseTo and MaxHeight run in O(log^2 cells) time on a segment tree
+	over x whose nodes are segment trees over y. Every node keeps two values: the maximum height anywhere in its
+	range, and the height that was set on its whole range at once.
+
+	Rasterization is conservative: a cell takes the height of any box that touches it, and a query reports the
+	height of every cell it touches. So MaxHeight never underestimates, at the cost of up to one cell of slack. */
+class HeightField2d
+{
+public:
+	HeightField2d();
+
+	/// (Re)initializes a flat height field over a width x height floor with the given cell size.
+	void Init(int width, int height, int cellSize);
+
+	/// Raises the height of the region [x0, x1) x [y0, y1) to at least h.
+	void RaiseTo(int x0, int y0, int x1, int y1, int h);
+
+	/// @return The maximum height in the region [x0, x1) x [y0, y1). The region is clipped to the floor.
+	int MaxHeight(int x0, int y0, int x1, int y1) const;
+
+	/// @return The number of heap bytes held by the segment trees.
+	size_t MemoryBytes() const;
+
+private:
+	/// A segment tree over the cells along y.
+	struct Column
+	{
+		std::vector<int> maxHeight;
+		std::vector<int> coverHeight;
+	};
+
+	int cellSize;
+	int numCellsX;
+	int numCellsY;
+
+	/// Segment tree over the cells along x. Each node holds the maximum and cover trees over y.
+	std::vector<Column> maxColumns;
+	std::vector<Column> coverColumns;
+
+	void RaiseColumn(Column &column, int node, int lo, int hi, int y0, int y1, int h);
+	int QueryColumn(const Column &column, int node, int lo, int hi, int y0, int y1) const;
+
+	void Raise(int node, int lo, int hi, int x0, int x1, int y0, int y1, int h);
+	int Query(int node, int lo, int hi, int x0, int x1, int y0, int y1) const;
+
+	/// Converts [x0, x1) in floor units to the cells it touches, clipped to the floor.
+	/// @return False if no cell is touched.
+	static bool ToCells(int x0, int x1, int cellSize, int numCells, int &c0, int &c1);
+};
+
+}
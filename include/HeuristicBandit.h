@@ -0,0 +1,61 @@
+/** @file HeuristicBandit.h
+	@brief Picks one of several packing heuristics online with a discounted UCB bandit.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#pragma once
+
+#include <vector>
+
+namespace rbp {
+
+/** HeuristicBandit keeps a discounted reward estimate for each of numArms heuristics and implements the UCB1 rule
+	on top of it. Every update scales all the statistics by the discount factor first, so observations made
+	several hundred updates ago no longer count, and the estimates follow a box mix that shifts over time.
+
+	The caller decides what a pull means. The intended use is to score a heuristic in the shadow of a live
+	placement, i.e. to compute what the heuristic would have done, without applying it. */
+class HeuristicBandit
+{
+public:
+	/// Creates a bandit over numArms heuristics with no observations.
+	explicit HeuristicBandit(int numArms = 0);
+
+	/// Forgets all observations and sets the number of heuristics.
+	void Reset(int numArms);
+
+	/// @param discount The factor all statistics are scaled by on each update, in (0, 1]. 1 disables discounting.
+	/// @param exploration The weight of the confidence bonus in SelectToExplore.
+	void SetParameters(float discount, float exploration);
+
+	/// Records the reward of one pull of the given arm. Rewards are expected to lie in [0, 1].
+	void Update(int arm, float reward);
+
+	/// @return The arm with the highest upper confidence bound. Arms never pulled come first.
+	int SelectToExplore() const;
+
+	/// @return The arm with the highest estimated reward, or 0 if no arm has been pulled yet.
+	int BestArm() const;
+
+	/// @return The discounted average reward of the given arm, or 0 if it has not been pulled.
+	float Mean(int arm) const;
+
+	/// @return The discounted number of pulls of the given arm.
+	float Pulls(int arm) const { return arms[arm].pulls; }
+
+	int NumArms() const { return (int)arms.size(); }
+
+private:
+	struct Arm
+	{
+		float pulls; ///< Discounted number of pulls.
+		float rewardSum; ///< Discounted sum of the rewards.
+	};
+
+	std::vector<Arm> arms;
+
+	float totalPulls;
+	float discount;
+	float exploration;
+};
+
+}
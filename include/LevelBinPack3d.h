@@ -0,0 +1,90 @@
+/** @file LevelBinPack3d.h
+	@brief Implements the layer/shelf/row bin packer, a very fast but wasteful baseline.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#pragma once
+
+#include <vector>
+
+#include "Rect3d.h"
+
+namespace rbp {
+
+/** LevelBinPack3d packs boxes into horizontal layers stacked along z. Each layer is cut into shelves along y, and
+	each shelf is filled with boxes along x. Only the topmost layer and its last shelf are open, and both may grow
+	while they are open, so a placement takes O(1) time and no free space list is kept. The price is density:
+	space left behind in closed shelves and layers is never reused.
+
+	Use it as the first stage of a fallback chain when a placement answer is needed within a few microseconds,
+	and consult GuillotineBinPack3d or MaxRectsBinPack only when it fails. */
+class LevelBinPack3d
+{
+public:
+	/// The initial bin size will be (0,0,0). Call Init to set the bin size.
+	LevelBinPack3d();
+
+	/// Initializes a new bin of the given size.
+	LevelBinPack3d(int width, int height, int depth, bool allowFlip = true);
+
+	/// (Re)initializes the packer to an empty bin of width x height x depth units. Call whenever
+	/// you need to restart with a new bin.
+	void Init(int width, int height, int depth, bool allowFlip = true);
+
+	/// Inserts a single box into the bin. The packer might rotate the box in the XOY plane, in which case the
+	/// returned struct will have the width and height values swapped.
+	/// @return The placement of the box, or a rect of zero size if it did not fit.
+	Rect3d Insert(int width, int height, int depth);
+
+	/// @return True if Insert would have to open a new layer for the box, closing what is left of the open one
+	///		for good. This is where the level packer wastes the most space.
+	bool NeedsNewLayer(int width, int height, int depth) const;
+
+	/// Tells the packer that the given region of the bin was filled by someone else, e.g. by another packer of a
+	/// fallback chain. The open layer is closed and packing continues above the top of the region, which is
+	/// conservative but keeps Insert O(1).
+	void MarkUsed(const Rect3d &rect);
+
+	/// Computes the ratio of used volume to the total bin volume.
+	float Occupancy() const;
+
+	/// Returns the z coordinate at which the open layer starts.
+	int GetOpenLayerZ() const { return layerZ; }
+
+	/// Returns the list of boxes placed by this packer.
+	const std::vector<Rect3d> &GetUsedRectangles() const { return usedRectangles; }
+
+private:
+	int binWidth;
+	int binHeight;
+	int binDepth;
+	bool binAllowFlip;
+
+	/// The open layer spans [layerZ, layerZ + layerDepth) along z.
+	int layerZ;
+	int layerDepth;
+
+	/// The open shelf of the open layer spans [shelfY, shelfY + shelfHeight) along y.
+	int shelfY;
+	int shelfHeight;
+
+	/// The next box of the open shelf goes to x = rowX.
+	int rowX;
+
+	unsigned long usedVolume;
+
+	std::vector<Rect3d> usedRectangles;
+
+	/// @return True if a width x height x depth box fits at the end of the open shelf.
+	bool FitsOpenShelf(int width, int height, int depth) const;
+
+	/// Places a box at the end of the open shelf, growing the shelf and layer as needed.
+	Rect3d PlaceInOpenShelf(int width, int height, int depth);
+
+	/// Closes the open shelf and opens an empty one above it in the same layer.
+	void OpenNewShelf();
+
+	/// Closes the open layer and opens an empty one starting at z.
+	void OpenNewLayer(int z);
+};
+
+}
@@ -8,10 +8,18 @@
 #pragma once
 
 #include <vector>
+#include <chrono>
 
 #include "Rect3d.h"
+#include "HeightField2d.h"
+#include "TraceRecorder.h"
+#include "ThreadPool.h"
+#include "NormalPatternLattice.h"
 #include <iostream>
-#define DEBUG_BIN_PACK
+
+// Define DEBUG_BIN_PACK to trace the free space bookkeeping of the packers to stdout. Tracing costs far more
+// than the packing itself, so it is off by default.
+//#define DEBUG_BIN_PACK
 
 namespace rbp {
 
@@ -41,18 +49,171 @@ public:
 		RectContactPointRule ///< -CP: Choosest the placement where the rectangle touches other rects as much as possible.
 	};
 
+	/// Specifies which free spaces are dropped when the free list reaches its cap, see SetFreeListCap.
+	enum EvictionPolicy
+	{
+		EvictSmallestVolume, ///< Drops the spaces of the smallest volume.
+		EvictLeastUseful ///< Drops the spaces that hold the fewest boxes of the average size inserted so far, the
+		                 ///< smallest volume first among equals. Same as EvictSmallestVolume before the first insert.
+	};
+
+	/// The space the gripper needs around a box while placing it from above. Margins extend the box footprint on
+	/// each side, and the gripper fingers reach fingerDepth down from the top of the box.
+	struct ClearanceEnvelope
+	{
+		int marginXNeg;
+		int marginXPos;
+		int marginYNeg;
+		int marginYPos;
+		int fingerDepth;
+	};
+
 	/// Inserts the given list of rectangles in an offline/batch mode, possibly rotated.
 	/// @param rects The list of rectangles to insert. This vector will be destroyed in the process.
 	/// @param dst [out] This list will contain the packed rectangles. The indices will not correspond to that of rects.
 	/// @param method The rectangle placement rule to use when packing.
 	//void Insert(std::vector<RectSize> &rects, std::vector<Rect> &dst, FreeRectChoiceHeuristic method);
 
+	typedef std::chrono::steady_clock Clock;
+
 	/// Inserts a single rectangle into the bin, possibly rotated.
+	/// Only RectBottomLeftRule is implemented, the other methods return a rect of zero size.
 	Rect3d Insert(int width, int height, int depth, FreeRectChoiceHeuristic method);
 
+	/// Inserts a single rectangle into the bin, giving up when the deadline passes. Candidates are scanned in the
+	/// order of preference, so the first valid placement found is also the best one, and running out of time
+	/// only loses the placements not reached yet. After the placement only the split is done. Pruning the free
+	/// list is not needed for correctness, so it is deferred to DoIdleWork.
+	/// @return The placement, or a rect of zero size if the box did not fit or no valid placement was found in time.
+	Rect3d InsertWithDeadline(int width, int height, int depth, FreeRectChoiceHeuristic method, Clock::time_point deadline);
+
+	/// Finds where Insert would put a width x height x depth box without changing the packer, so that several
+	/// bins can be asked before committing to one. The score is the top edge of the placement in y, which is what
+	/// the bottom-left rule minimizes. With a learned minimum item size, spaces that Insert would release from
+	/// quarantine for this box first are not considered.
+	/// @return A token with a placement of zero size if the box does not fit.
+	InsertToken TryInsert(int width, int height, int depth, FreeRectChoiceHeuristic method) const;
+
+	/// Runs TryInsert for each of boxes, for planners that score many candidate boxes against the bin. Tiles of
+	/// boxes are matched against blocks of the free list small enough to stay in cache, with a fit test the
+	/// compiler vectorizes, so the free list is read once per tile rather than once per box. The tiles are spread
+	/// over pool once there are enough pairs of boxes and free spaces to pay for it. Committing any one of the
+	/// tokens makes the others stale.
+	/// @param tokens [out] tokens[i] is what TryInsert returns for boxes[i].
+	/// @param pool The threads to score on, or null to score on the calling thread. It must not run another
+	///		ParallelFor meanwhile.
+	void TryInsertBatch(const std::vector<RectSize3d> &boxes, FreeRectChoiceHeuristic method,
+		std::vector<InsertToken> &tokens, ThreadPool *pool = 0) const;
+
+	/// Places the box of a token returned by TryInsert on this packer where it was found, so only the split and
+	/// the pruning are done.
+	/// @return False if the token has no placement or the packer changed since TryInsert, in which case nothing
+	///		is done.
+	bool Commit(const InsertToken &token);
+
+	/// Catches up on the work deferred by InsertWithDeadline until it is done or the deadline passes. Call between
+	/// boxes. Redundant free spaces left behind only slow down the scan, they never lead to invalid placements.
+	/// @return True if no deferred work is left.
+	bool DoIdleWork(Clock::time_point deadline);
+
+	/// @return True if InsertWithDeadline left work for DoIdleWork.
+	bool HasDeferredWork() const { return pruneDeferred; }
+
+	/// Removes the redundant spaces from a copy of the free list, starting at index cursor, until done or the
+	/// deadline passes. Touches no packer state, so it can run on a snapshot on another thread. The order of the
+	/// surviving spaces is kept.
+	/// @return True if the pruning is done.
+	static bool PruneFreeSpaces(std::vector<FreeRect3d> &spaces, size_t &cursor, Clock::time_point deadline);
+
+	/// Removes the redundant spaces from a list with the same result as PruneFreeSpaces run to the end: a space
+	/// goes if another one strictly contains it, or if an equal one comes later in the list. Since that only
+	/// depends on the space itself, the list is cut into chunks of consecutive spaces that are tested on pool in
+	/// parallel, and the survivors keep their order whatever the number of threads. Only the spaces starting at
+	/// or below a space in y can contain it, so each space is tested against a prefix of the list sorted by y.
+	/// @param pool The threads to test on, or null to test on the calling thread.
+	static void PruneFreeSpacesParallel(std::vector<FreeRect3d> &spaces, ThreadPool *pool);
+
+	/// Makes the full prune after each placement run PruneFreeSpacesParallel on pool once the free list holds at
+	/// least minParallelSize spaces. The packing does not change. Pass null to prune on the calling thread again.
+	/// The pool must outlive the packer or the next call, and must not run another ParallelFor meanwhile.
+	void SetPruneThreadPool(ThreadPool *pool, size_t minParallelSize = 1024)
+	{
+		prunePool = pool;
+		minParallelPruneSize = minParallelSize;
+	}
+
+	/// Replaces the free list with a pruned copy of it, and splits the spaces of the copy around the boxes placed
+	/// since it was taken.
+	/// @param placedSince The boxes placed since the copy was taken, in any order.
+	void PublishPrunedFreeList(const std::vector<FreeRect3d> &pruned, const std::vector<Rect3d> &placedSince);
+
+	/// Marks the given region of the bin as used, e.g. because it was filled by another packer sharing the bin.
+	/// This is the bookkeeping half of Insert: every free space intersecting the region is split, and the free
+	/// list is pruned.
+	void PlaceRect(const Rect3d &rect);
+
 	/// Computes the ratio of used surface area to the total bin area.
 	float Occupancy() const;
 
+	/// Enables the gripper clearance constraint. Placements whose clearance envelope collides with the packed boxes
+	/// are rejected inside the candidate scan. The check runs against a height field of the packed boxes at the
+	/// given cell size, in O(log^2 cells) time per candidate.
+	/// @param upright The envelope for boxes placed in the given orientation.
+	/// @param flipped The envelope for boxes rotated by 90 degrees in the XOY plane.
+	/// @param binHasWalls If true, the envelope must also stay inside the bin footprint.
+	void SetGripperClearance(const ClearanceEnvelope &upright, const ClearanceEnvelope &flipped,
+		int cellSize, bool binHasWalls);
+
+	/// @return True if a box placed at rect would sit below one of the packed boxes.
+	bool IsBlocked(const Rect3d &rect) const;
+
+	/// Caps the number of maximal free spaces, which can grow combinatorially in 3D. Whenever a placement leaves
+	/// more than maxFreeRectangles spaces after pruning, the policy evicts spaces down to three quarters of the
+	/// cap, so that a packer at its cap does not evict again on every insert. Evicted spaces are only lost
+	/// placement options: the remaining ones stay valid, and no box is ever placed outside of them. While a cap is
+	/// set, split products are pruned as they are added and the cap is enforced before the full prune, so the list
+	/// only exceeds the cap by the products of a single placement, and the quadratic prune never sees more.
+	/// @param maxFreeRectangles The cap, or 0 to lift it.
+	void SetFreeListCap(size_t maxFreeRectangles, EvictionPolicy policy);
+
+	/// @return The number of times the free list reached its cap. Kept over Init.
+	unsigned long NumEvictions() const { return numEvictions; }
+
+	/// @return The number of free spaces evicted in total. Kept over Init.
+	unsigned long NumEvictedRectangles() const { return numEvictedRectangles; }
+
+	/// Returns the heap memory held by the free and used lists, the free levels and the clearance height field.
+	PackerMemoryUsage GetMemoryUsage() const;
+
+	/// Returns the list of maximal free spaces.
+	const std::vector<FreeRect3d> &GetFreeRectangles() const { return freeRectangles; }
+
+	/// Returns the list of packed boxes.
+	const std::vector<Rect3d> &GetUsedRectangles() const { return usedRectangles; }
+
+	/// Makes the packer record its phases (scan, blocked, split, sort, prune and evict) with free list sizes as
+	/// arguments. Pass null to stop tracing. The recorder must outlive the packer or the next call.
+	void SetTraceRecorder(TraceRecorder *recorder) { traceRecorder = recorder; }
+
+	/// Specifies the smallest item size the packer will ever be asked to place. Free spaces produced by a split
+	/// that cannot hold an item of at least this size are discarded right away instead of being scanned, sorted
+	/// and pruned on every later insert. Pass zeros to disable the filtering.
+	void SetMinItemSize(int minWidth, int minHeight, int minDepth);
+
+	/// If enabled, the minimum item size is learned online from the sizes passed to Insert, overriding the value
+	/// given to SetMinItemSize. Since a later item may be smaller than all earlier ones, spaces that are too
+	/// small are quarantined instead of discarded, and brought back once an item they can hold shows up.
+	void SetLearnMinItemSize(bool enabled) { learnMinItemSize = enabled; }
+
+	/// Restricts the free spaces to the normal pattern lattice of the box sizes the packer will be asked to place:
+	/// their support origins, where boxes go, are moved up to the next position on each axis, their far edges
+	/// down to the last sum of sides, and the spaces left without room are dropped. Spaces that only differed off
+	/// the lattice then coincide or contain each other, and get pruned. A space on a stack whose top is off the
+	/// lattice keeps its depth, since boxes cannot float above the stack. Boxes of other sizes are still placed
+	/// validly, but may miss positions. The lattice must be built for the bin size and allowFlip of the packer,
+	/// and outlive it or the next call. Pass null to stop snapping; the spaces snapped so far stay as they are.
+	void SetNormalPatterns(const NormalPatternLattice *lattice);
+
 private:
 	int binWidth;
 	int binHeight;
@@ -62,30 +223,185 @@ private:
 	bool binAllowFlip;
 
 	std::vector<Rect3d> usedRectangles;
+	/// The maximal free spaces, kept sorted in deepest-bottom-left (y, z, x) order.
 	std::vector<FreeRect3d> freeRectangles;
 
+	/// The free spaces that share a y coordinate, freeRectangles[begin, end). The maxima are taken over the extent
+	/// a box placed at the support origin of each space can use.
+	struct FreeLevel
+	{
+		int y;
+		size_t begin;
+		size_t end;
+		int maxSpanWidth;
+		int maxSpanHeight;
+		int maxDepth;
+	};
+
+	/// The occupied levels of freeRectangles in ascending y.
+	std::vector<FreeLevel> freeLevels;
+
+	/// Free spaces that were too small for the learned minimum item size. They are not kept up to date with later
+	/// placements, and get split against usedRectangles again when they are released.
+	std::vector<FreeRect3d> quarantinedRectangles;
+
+	/// Gripper clearance constraint, see SetGripperClearance.
+	bool clearanceEnabled = false;
+	bool clearanceBinHasWalls = false;
+	int clearanceCellSize = 10;
+	ClearanceEnvelope uprightClearance;
+	ClearanceEnvelope flippedClearance;
+	HeightField2d heightField;
+
+	/// Scratch buffer for the spaces produced by a single split.
+	std::vector<FreeRect3d> splitProducts;
+
+	/// Open addressing hash set of the spaces produced by the splits of one placement, see
+	/// RemoveDuplicateProducts. Holds indices into freeRectangles plus one, 0 marks an empty slot.
+	std::vector<uint32_t> productSlots;
+
+	/// Receives the phase timings, or null if tracing is off.
+	TraceRecorder *traceRecorder = 0;
+
+	/// Counts the changes to the free list and the clearance constraint, so that Commit can tell stale tokens.
+	unsigned long freeListVersion = 0;
+
+	/// True if the free list still needs pruning, which continues at freeRectangles[pruneCursor].
+	bool pruneDeferred = false;
+	size_t pruneCursor = 0;
+
+	/// See SetPruneThreadPool.
+	ThreadPool *prunePool = 0;
+	size_t minParallelPruneSize = 1024;
+
+	/// The smallest item size seen or configured. Free spaces that cannot hold it are dropped or quarantined.
+	int minItemWidth = 0;
+	int minItemHeight = 0;
+	int minItemDepth = 0;
+
+	bool learnMinItemSize = false;
+	bool seenItemSize = false;
+
+	/// See SetNormalPatterns. Null if free spaces are not snapped.
+	const NormalPatternLattice *normalPatterns = 0;
+
+	/// The free list cap, see SetFreeListCap. 0 if there is none.
+	size_t maxFreeRectangles = 0;
+	EvictionPolicy evictionPolicy = EvictSmallestVolume;
+	unsigned long numEvictions = 0;
+	unsigned long numEvictedRectangles = 0;
+
+	/// Sums of the box sizes passed to Insert, for EvictLeastUseful. Short side first when flipping is allowed.
+	double itemWidthSum = 0.0;
+	double itemHeightSum = 0.0;
+	double itemDepthSum = 0.0;
+	unsigned long numItemsSeen = 0;
+
 	
 	/// Computes the placement score for the -CP variant.
 	int ContactPointScoreNode(int x, int y, int z, int width, int height, int depth) const;
 
-	Rect3d FindPositionForNewNodeBottomLeft(int width, int height, int depth, int &bestY, int &bestX, int& bestZ) const;
+	/// @param deadline The scan gives up and returns a rect of zero size at this time. Clock::time_point::max()
+	///		disables the check.
+	Rect3d FindPositionForNewNodeBottomLeft(int width, int height, int depth, int &bestY, int &bestX, int& bestZ,
+		Clock::time_point deadline) const;
 	// Rect FindPositionForNewNodeBestShortSideFit(int width, int height, int &bestShortSideFit, int &bestLongSideFit) const;
 	// Rect FindPositionForNewNodeBestLongSideFit(int width, int height, int &bestShortSideFit, int &bestLongSideFit) const;
 	// Rect FindPositionForNewNodeBestAreaFit(int width, int height, int &bestAreaFit, int &bestShortSideFit) const;
 	// Rect FindPositionForNewNodeContactPoint(int width, int height, int &contactScore) const;
 
+	/// Tries the placements of the bottom-left scan at the support origin of freeRectangles[i]: upright, then
+	/// flipped, skipping the ones blocked by the gripper clearance.
+	/// @return True if one of them is valid, in which case it is written to node.
+	bool PlaceAtFreeSpace(size_t i, int width, int height, int depth, Rect3d &node) const;
+
 	/// @return True if the free node was split.
 	bool SplitFreeNode(FreeRect3d freeNode, const Rect3d &usedNode);
 
+	/// Appends the spaces that remain of freeNode after usedNode has been placed to out.
+	/// @return True if the free node was split, false if the two do not intersect and nothing was appended.
+	bool SplitFreeNodeInto(const FreeRect3d &freeNode, const Rect3d &usedNode, std::vector<FreeRect3d> &out) const;
+
+	/// @return True if an item of the minimum item size fits into freeRect.
+	bool CanHoldMinItem(const FreeRect3d &freeRect) const;
+
+	/// Adds a free space to the free list if it can hold the minimum item size. Otherwise the space is quarantined
+	/// when learning the minimum item size, and dropped when it is fixed.
+	void AddFreeRect(const FreeRect3d &freeRect);
+
+	/// Snaps freeRect to the normal pattern lattice, see SetNormalPatterns.
+	/// @return False if no box on the lattice fits into what remains of it.
+	bool SnapToLattice(FreeRect3d &freeRect) const;
+
+	/// Updates the learned minimum item size with an item about to be inserted.
+	void ObserveItemSize(int width, int height, int depth);
+
+	/// Moves the quarantined spaces that can hold the current minimum item size back to the free list.
+	void ReleaseQuarantine();
+
     // sort free rectangles in deepest-bottom-left order, that is y-z-x (or x-z-y in some case)
 	void sortFreeSpace();
+
+	/// The deepest-bottom-left order of the free list.
+	static bool FreeSpaceOrder(const FreeRect3d &r1, const FreeRect3d &r2);
+
+	/// Merges the unsorted spaces appended behind the first numSorted ones into the sorted order.
+	void MergeNewFreeRects(size_t numSorted);
+
+	/// Recomputes freeLevels from freeRectangles, which must be sorted already.
+	void RebuildFreeLevels();
     
 	//check if place node is blocked by used rect
 	bool isBlocked(const Rect3d& usedRect, const Rect3d& newNode) const;
 
+	/// Runs the clearance and the blocked checks of a candidate placement.
+	/// @return True if the box cannot be placed at rect.
+	bool IsPlacementBlocked(const Rect3d &rect, const ClearanceEnvelope &envelope) const;
+
+	/// @return True if the gripper has enough room around rect to place the box there.
+	bool HasClearance(const Rect3d &rect, const ClearanceEnvelope &envelope) const;
+
 	/// Goes through the free rectangle list and removes any redundant entries.
 	void PruneFreeList();
 
+	/// Runs PruneFreeList from pruneCursor on, until done or the deadline passes. freeLevels must be rebuilt
+	/// afterwards.
+	/// @return True if the pruning is done.
+	bool PruneFreeListUntil(Clock::time_point deadline);
+
+	/// Splits every free space that intersects rect and merges the pieces into the sorted free list.
+	/// @param pruneProducts If true, pieces contained in another free space are dropped right away.
+	/// @param cursor If not null, the spaces before *cursor have been checked against all others. The pieces are
+	///		then also checked against the spaces they may contain, which requires pruneProducts, and *cursor is
+	///		moved so that it still stays behind the spaces not checked yet.
+	void SplitFreeList(const Rect3d &rect, bool pruneProducts, size_t *cursor = 0);
+
+	/// Drops the spaces from index firstNew on that equal a later one in position and size, which happens when a
+	/// placement cuts the same piece out of several overlapping spaces. Of equal spaces the pruning keeps the
+	/// last one, so this keeps it too, and the pruning result does not change. Takes O(|freeRectangles| -
+	/// firstNew) time.
+	void RemoveDuplicateProducts(size_t firstNew);
+
+	/// Removes the free spaces from index firstNew on that are contained in another free space. Takes
+	/// O((|freeRectangles| - firstNew) * |freeRectangles|) time.
+	void PruneNewFreeRects(size_t firstNew);
+
+	/// Drops the spaces before index firstNew that are contained in one from firstNew on.
+	/// @param numChecked [in, out] The number of leading spaces that have been checked against all others. Reduced
+	///		by the number of them dropped.
+	/// @return The new index of the first space that was at firstNew.
+	size_t DropSpacesInsideNewFreeRects(size_t firstNew, size_t &numChecked);
+
+	/// Evicts free spaces according to evictionPolicy if the free list is over its cap. Keeps the order of the
+	/// surviving spaces. freeLevels must be rebuilt afterwards.
+	void EnforceFreeListCap();
+
+	/// @return How many boxes of the average inserted size fit into freeRect, ignoring the support area.
+	double AverageItemsHeld(const FreeRect3d &freeRect) const;
+
+	/// Adds rect to the packed boxes.
+	void AddUsedRect(const Rect3d &rect);
+
 	//for debug purpose
 	inline void printFreeRect(const std::string& indicator, const FreeRect3d& r) const{	
 	#ifdef DEBUG_BIN_PACK
@@ -0,0 +1,83 @@
+/** @file NormalPatternLattice.h
+	@brief The coordinates along each axis of a bin that a known set of box sizes can reach (normal patterns).
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+#include "Rect3d.h"
+
+namespace rbp {
+
+/** NormalPatternLattice holds, per axis of a bin, the coordinates that are sums of box sides of a known set of
+	sizes. Any packing can be pushed towards the origin until every box rests against the bin or other boxes,
+	and then each box coordinate is such a sum, so a packer loses nothing by only placing boxes on the lattice.
+	The sums are found with a subset-sum DP on a bitset per axis, with every side usable any number of times.
+
+	The positions of an axis are the sums that leave room for the smallest side along that axis. They are
+	numbered in ascending order, so that a coordinate can be stored as its position index, which usually fits
+	in 16 bits even for large bins. */
+class NormalPatternLattice
+{
+public:
+	enum Axis
+	{
+		AxisX,
+		AxisY,
+		AxisZ
+	};
+
+	NormalPatternLattice();
+
+	/// Computes the lattice of a binWidth x binHeight x binDepth bin for boxes of the given sizes.
+	/// @param allowFlip If true, boxes may be rotated by 90 degrees in the XOY plane, so that widths and heights
+	///		count along both X and Y. Must match the allowFlip of the packer using the lattice.
+	void Build(const std::vector<RectSize3d> &sizes, int binWidth, int binHeight, int binDepth, bool allowFlip);
+
+	/// @return The size of the bin along axis, as given to Build.
+	int Size(Axis axis) const { return axes[axis].size; }
+
+	/// @return True if coordinate is a sum of sides along axis. Coordinates outside of [0, Size] are not.
+	bool IsReachable(Axis axis, int coordinate) const;
+
+	/// @return The first position at or after coordinate, or Size(axis) if no box can start there anymore.
+	int SnapUp(Axis axis, int coordinate) const;
+
+	/// @return The last sum of sides at or before coordinate, which is where the boxes placed on the lattice
+	///		can end. Coordinates past Size(axis) are clamped.
+	int SnapDown(Axis axis, int coordinate) const;
+
+	/// @return The number of positions along axis.
+	size_t NumPositions(Axis axis) const { return axes[axis].positions.size(); }
+
+	/// @return The coordinate of the position with the given index.
+	int Coordinate(Axis axis, size_t index) const { return axes[axis].positions[index]; }
+
+	/// @return The index of the position at coordinate, or -1 if coordinate is not a position.
+	int IndexOf(Axis axis, int coordinate) const;
+
+	/// @return The number of heap bytes held by the lattice.
+	size_t MemoryBytes() const;
+
+private:
+	struct AxisLattice
+	{
+		int size;
+		/// Bit c is set if c is a sum of sides, for c in [0, size].
+		std::vector<unsigned long long> reachable;
+		/// The ascending positions.
+		std::vector<int> positions;
+		/// SnapUp and SnapDown of every coordinate in [0, size].
+		std::vector<int> up;
+		std::vector<int> down;
+	};
+
+	AxisLattice axes[3];
+
+	/// Fills in lattice for a bin of the given size and the given box sides along the axis.
+	static void BuildAxis(AxisLattice &lattice, int size, std::vector<int> sides);
+};
+
+}
@@ -0,0 +1,122 @@
+/** @file RecordFile.h
+	@brief Fixed-record binary files for bulk replays: box manifests in, Rect3d placements out.
+	The files are memory mapped with POSIX calls, so RecordFile.cpp is only built on POSIX targets.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#pragma once
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#include "Rect3d.h"
+
+namespace rbp {
+
+/// The 32 byte header of a record file. All fields are in the byte order of the machine that wrote the file.
+struct RecordFileHeader
+{
+	char magic[8]; ///< Tells manifests from placement files, see RecordFileReader::manifestMagic.
+	uint32_t recordSize; ///< The size of one record in bytes.
+	int32_t binWidth;
+	int32_t binHeight;
+	int32_t binDepth;
+	uint64_t count; ///< The number of records that follow the header.
+};
+
+/// One box of a manifest. A change of order starts a new bin in a replay.
+struct ManifestRecord
+{
+	int32_t order;
+	int32_t width;
+	int32_t height;
+	int32_t depth;
+};
+
+/** RecordFileReader maps a record file into memory read-only, so that records are read in place with no
+	parsing and no allocation per record. The pages are read ahead sequentially by the OS. POSIX only. */
+class RecordFileReader
+{
+public:
+	/// The magic of a file of ManifestRecords.
+	static const char manifestMagic[8];
+	/// The magic of a file of Rect3d placements.
+	static const char placementMagic[8];
+
+	RecordFileReader();
+	~RecordFileReader();
+
+	/// Maps the file at path. Fails if it cannot be mapped, is shorter than its header says, or its record size
+	/// differs from recordSize. Pass a null magic to accept either kind of file.
+	/// @return False on failure, with the reason in GetError.
+	bool Open(const std::string &path, const char *magic, uint32_t recordSize);
+
+	/// Unmaps the file. Pointers returned by Records become invalid.
+	void Close();
+
+	const RecordFileHeader &Header() const { return header; }
+	uint64_t Count() const { return header.count; }
+
+	/// @return The first of Count() records, valid until Close.
+	template<typename Record>
+	const Record *Records() const { return (const Record *)(data + sizeof(RecordFileHeader)); }
+
+	/// @return True if the file is a manifest, false if it holds placements.
+	bool IsManifest() const;
+
+	const std::string &GetError() const { return error; }
+
+private:
+	RecordFileReader(const RecordFileReader &);
+	RecordFileReader &operator=(const RecordFileReader &);
+
+	const char *data;
+	size_t size;
+	RecordFileHeader header;
+	std::string error;
+};
+
+/** RecordFileWriter appends fixed-size records to a file through a large buffer, so that writing costs one
+	system call per megabyte instead of one per record. The count in the header is filled in by Close. */
+class RecordFileWriter
+{
+public:
+	RecordFileWriter();
+
+	/// Closes the file if still open.
+	~RecordFileWriter();
+
+	/// Creates or truncates the file at path and writes a header for records of the given kind.
+	/// @return False on failure, with the reason in GetError.
+	bool Open(const std::string &path, const char *magic, uint32_t recordSize, int binWidth, int binHeight, int binDepth);
+
+	/// Appends one record of the size passed to Open.
+	/// @return False if a write failed. The writer stays failed until closed.
+	bool Append(const void *record);
+
+	bool Append(const ManifestRecord &record) { return Append((const void *)&record); }
+	bool Append(const Rect3d &placement) { return Append((const void *)&placement); }
+
+	/// Writes out the buffer, fills in the record count and closes the file.
+	/// @return False if any write failed since Open.
+	bool Close();
+
+	const std::string &GetError() const { return error; }
+
+private:
+	RecordFileWriter(const RecordFileWriter &);
+	RecordFileWriter &operator=(const RecordFileWriter &);
+
+	int fd;
+	bool failed;
+	RecordFileHeader header;
+	std::vector<char> buffer;
+	size_t used;
+	std::string error;
+
+	bool Flush();
+	bool WriteAll(const char *bytes, size_t length);
+	void Fail(const char *what);
+};
+
+}
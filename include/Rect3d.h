@@ -26,6 +26,18 @@ struct RectSize3d
     int depth;
 };
 
+/// The heap memory held by a packer, in bytes. Counts the capacity of the containers rather than their size,
+/// since that is what the process pays for.
+struct PackerMemoryUsage
+{
+	size_t freeListBytes; ///< The free rectangles or spaces, including the quarantined ones.
+	size_t usedListBytes; ///< The packed boxes.
+	size_t indexBytes; ///< The structures built over the lists, such as the free levels and the height field.
+	size_t scratchBytes; ///< Buffers kept between inserts to save allocations.
+
+	size_t Total() const { return freeListBytes + usedListBytes + indexBytes + scratchBytes; }
+};
+
 struct Rect3d
 {
 	int x;
@@ -36,6 +48,19 @@ struct Rect3d
     int depth;
 };
 
+/// What TryInsert of a packer found for a box: where it would go and how good that is, plus what Commit needs
+/// to place it there without searching again. The token goes stale as soon as the packer changes otherwise.
+struct InsertToken
+{
+	Rect3d placement; ///< Zero size if the box does not fit.
+	int score; ///< Lower is better. Only comparable between packers of the same type and heuristic.
+
+	/// Opaque to the caller.
+	const void *packer;
+	unsigned long version;
+	size_t freeRectIndex;
+};
+
 struct FreeRect3d{
 	int x;
 	int y;
@@ -66,7 +91,14 @@ int NodeSortCmp3d(const Rect3d &a, const Rect3d &b);
 
 /// Returns true if a is contained in b.
 bool IsContainedIn3d(const Rect3d &a, const Rect3d &b);
-bool IsContainedInFree3d(const FreeRect3d &a, const FreeRect3d &b);
+/// Inline, since pruning the free list runs it on every pair of free spaces.
+inline bool IsContainedInFree3d(const FreeRect3d &a, const FreeRect3d &b)
+{
+	return a.x >= b.x && a.y >= b.y 
+		&& a.x+a.width <= b.x+b.width 
+		&& a.y+a.height <= b.y+b.height 
+		&& a.z >= b.z && a.z + a.depth >= b.z + b.depth;
+}
 
 
 class DisjointRectCollection3d
@@ -0,0 +1,99 @@
+/** @file RolloutBinPack3d.h
+	@brief Picks online placements by Monte-Carlo rollouts over the observed box distribution.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#pragma once
+
+#include <vector>
+#include <memory>
+
+#include "Rect3d.h"
+#include "GuillotineBinPack3d.h"
+#include "BoxHistogram.h"
+#include "ThreadPool.h"
+
+namespace rbp {
+
+/** RolloutBinPack3d is an online packer for arrivals whose sizes are unknown in advance but follow a stable
+	distribution. For each box it lists the lowest few candidate placements of a GuillotineBinPack3d. Each
+	candidate is scored by rollouts: the packer state is cloned, the candidate is placed, and boxes drawn from the
+	histogram of the sizes observed so far are packed greedily after it. The candidate with the highest mean
+	filled volume wins.
+
+	The rollouts run on a thread pool. Each thread clones into its own packer, which keeps its memory between
+	rollouts, so a rollout allocates nothing once the arenas have warmed up. A decision budget bounds the wall
+	clock time of a decision. Rollouts that have not started by the deadline are skipped, and candidates are
+	compared on the rollouts that finished. All candidates use the same random box sequences, which makes the
+	comparison less noisy, and the result does not depend on the number of threads unless the deadline hits. */
+class RolloutBinPack3d
+{
+public:
+	/// Initializes a bin of the given size.
+	/// @param numThreads The number of threads the rollouts run on, 0 for one per hardware thread.
+	RolloutBinPack3d(int width, int height, int depth, int numThreads = 0);
+
+	/// (Re)initializes the packer to an empty bin. The box histogram is kept, since it describes the arrivals
+	/// and not the bin.
+	void Init(int width, int height, int depth);
+
+	/// @param numCandidates The number of placements considered for each box.
+	/// @param numRollouts The number of rollouts per candidate.
+	/// @param horizon The number of sampled boxes packed in each rollout.
+	void SetRolloutParameters(int numCandidates, int numRollouts, int horizon);
+
+	/// Sets the wall clock time a decision may take, in milliseconds.
+	void SetDecisionBudget(double milliseconds) { decisionBudget = milliseconds; }
+
+	/// Sets the heuristics used for the actual placements and inside the rollouts.
+	void SetHeuristics(GuillotineBinPack3d::MergePolicy mergePolicy, GuillotineBinPack3d::GuillotineSplitHeuristic splitMethod);
+
+	/// Adds a box size to the histogram without placing it, e.g. to warm up the distribution from a log.
+	void ObserveBox(int width, int height, int depth) { histogram.Add(width, height, depth); }
+
+	/// Inserts a single box into the bin, possibly rotated in the XOY plane. The box size is added to the
+	/// histogram first.
+	/// @return The placement of the box, or a rect of zero size if it did not fit.
+	Rect3d Insert(int width, int height, int depth);
+
+	/// Computes the ratio of used volume to the total bin volume.
+	float Occupancy() const { return packer.Occupancy(); }
+
+	/// @return The number of rollouts that finished during the last decision.
+	int GetLastNumRollouts() const { return lastNumRollouts; }
+
+	const GuillotineBinPack3d &GetPacker() const { return packer; }
+
+	const BoxHistogram &GetHistogram() const { return histogram; }
+
+private:
+	GuillotineBinPack3d packer;
+	BoxHistogram histogram;
+
+	GuillotineBinPack3d::MergePolicy mergePolicy;
+	GuillotineBinPack3d::GuillotineSplitHeuristic splitMethod;
+
+	int numCandidates;
+	int numRollouts;
+	int horizon;
+	double decisionBudget;
+
+	/// Seeds the random box sequences, advanced after every decision.
+	unsigned int rolloutSeed;
+
+	int lastNumRollouts;
+
+	std::unique_ptr<ThreadPool> pool;
+
+	/// One cloned packer per thread.
+	std::vector<GuillotineBinPack3d> arenas;
+
+	/// Scratch data of Insert.
+	std::vector<Rect3d> candidates;
+	std::vector<double> rolloutFill;
+
+	/// Clones the packer into arena, places the candidate and packs horizon boxes drawn with the given seed.
+	/// @return The volume filled by the candidate and the drawn boxes.
+	double Rollout(GuillotineBinPack3d &arena, const Rect3d &candidate, unsigned int seed) const;
+};
+
+}
@@ -0,0 +1,60 @@
+/** @file ThreadPool.h
+	@brief A fixed set of worker threads for data-parallel loops.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+namespace rbp {
+
+/** ThreadPool keeps numThreads - 1 worker threads alive between calls, so that a parallel loop does not pay for
+	creating threads. The calling thread takes part in the loop as thread 0, so a pool of one thread runs
+	everything inline. Only one ParallelFor may run at a time. */
+class ThreadPool
+{
+public:
+	/// Starts the workers. Pass 0 to use one thread per hardware thread.
+	explicit ThreadPool(int numThreads = 0);
+
+	/// Stops and joins the workers.
+	~ThreadPool();
+
+	/// @return The number of threads taking part in ParallelFor, including the caller.
+	int NumThreads() const { return (int)workers.size() + 1; }
+
+	/// Calls body(index, thread) for each index in [0, count) and returns when all calls have finished. The calls
+	/// are spread over the threads dynamically. thread is in [0, NumThreads()) and identifies the calling thread,
+	/// so that the body can use per-thread scratch data without locking.
+	void ParallelFor(int count, const std::function<void(int index, int thread)> &body);
+
+private:
+	ThreadPool(const ThreadPool &);
+	ThreadPool &operator=(const ThreadPool &);
+
+	std::vector<std::thread> workers;
+
+	std::mutex lock;
+	std::condition_variable workReady;
+	std::condition_variable workDone;
+
+	/// The loop being run. Guarded by lock, except for nextIndex.
+	const std::function<void(int, int)> *body;
+	int count;
+	std::atomic<int> nextIndex;
+	int numPending; ///< Workers that have not finished the current loop yet.
+	unsigned long generation;
+	bool stopping;
+
+	void WorkerMain(int thread);
+
+	/// Runs loop iterations until none are left.
+	void RunIterations(const std::function<void(int, int)> &loopBody, int loopCount, int thread);
+};
+
+}
@@ -0,0 +1,148 @@
+/** @file TieredBinPack3d.h
+	@brief Chains the packers from cheapest to most expensive behind a single Insert.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#pragma once
+
+#include <vector>
+
+#include "Rect3d.h"
+#include "LevelBinPack3d.h"
+#include "GuillotineBinPack3d.h"
+#include "MaxRectsBinPack.h"
+
+namespace rbp {
+
+/** TieredBinPack3d places each box with the cheapest packer that can take it, and escalates to the more expensive
+	ones when the cheaper ones fail or would place the box poorly. The level tier places a box poorly when it has
+	to open a new layer for it, which abandons the rest of the open layer; such boxes go to the later tiers first,
+	and to the level tier only if none of those can take them. All tiers pack the same bin: a box placed by one
+	tier is reported to the others with MarkUsed/PlaceRect. This is O(1) for the level tier, while the other
+	tiers queue the box and catch up the next time they are consulted, so boxes served by the cheap tiers stay cheap.
+
+	Every tier has a latency budget in microseconds. A tier whose average latency exceeds its budget is skipped,
+	except for a probe every so many boxes that lets its average recover once it is fast again. Per-tier counters
+	show how often each tier was tried, how often it served the box and how much time it took, so that the
+	expensive tiers can be judged on real traffic. */
+class TieredBinPack3d
+{
+public:
+	/// The tiers, in the order they are tried.
+	enum Tier
+	{
+		TierLevel, ///< LevelBinPack3d. O(1), wasteful.
+		TierGuillotine, ///< GuillotineBinPack3d first fit, without merging.
+		TierGuillotineMerge, ///< GuillotineBinPack3d after a full merge of its free list.
+		TierMaxRects, ///< MaxRectsBinPack bottom-left.
+		NumTiers
+	};
+
+	/// Counters kept for every tier.
+	struct TierStats
+	{
+		unsigned long attempts; ///< Number of boxes the tier was asked to place.
+		unsigned long hits; ///< Number of boxes the tier placed.
+		unsigned long skipped; ///< Number of boxes for which the tier was skipped because it was over budget.
+		unsigned long escalated; ///< Number of boxes the tier passed on because it would have placed them poorly.
+		unsigned long overBudget; ///< Number of attempts that took longer than the budget.
+		double totalMicroseconds; ///< Total time spent in the tier, including catching up on queued boxes.
+		double averageMicroseconds; ///< Exponential moving average of the latency of an attempt.
+	};
+
+	/// The initial bin size will be (0,0,0). Call Init to set the bin size.
+	TieredBinPack3d();
+
+	/// Initializes a new bin of the given size.
+	TieredBinPack3d(int width, int height, int depth);
+
+	/// (Re)initializes all tiers to an empty bin of width x height x depth units. Keeps the tier configuration,
+	/// but resets the counters.
+	void Init(int width, int height, int depth);
+
+	/// Inserts a single box into the bin, possibly rotated in the XOY plane.
+	/// @param servedBy [out] If not null, receives the tier that placed the box, or NumTiers if none did.
+	/// @return The placement of the box, or a rect of zero size if no tier could place it.
+	Rect3d Insert(int width, int height, int depth, Tier *servedBy = 0);
+
+	/// Enables or disables a tier. All tiers are enabled by default.
+	void SetTierEnabled(Tier tier, bool enabled) { tiers[tier].enabled = enabled; }
+
+	/// Sets the latency budget of a tier in microseconds. A tier is skipped once the average latency of its
+	/// attempts exceeds the budget, and only probed now and then after that. Pass 0 for no budget.
+	void SetTierBudget(Tier tier, double microseconds) { tiers[tier].budgetMicroseconds = microseconds; }
+
+	/// The level tier stacks layers quickly and would close the bin early, so it is only consulted while its
+	/// open layer starts below the given height. Defaults to half the bin depth.
+	void SetLevelTierMaxZ(int z) { levelTierMaxZ = z; }
+
+	/// If set, boxes for which the level tier would open a new layer are offered to the later tiers first.
+	/// On by default.
+	void SetEscalateOnNewLayer(bool escalate) { escalateOnNewLayer = escalate; }
+
+	/// The free rectangle choice and split heuristics used by the guillotine tiers.
+	void SetGuillotineHeuristics(GuillotineBinPack3d::FreeRectChoiceHeuristic rectChoice,
+		GuillotineBinPack3d::GuillotineSplitHeuristic splitMethod)
+	{
+		guillotineRectChoice = rectChoice;
+		guillotineSplitMethod = splitMethod;
+	}
+
+	/// Returns the counters of a tier.
+	const TierStats &GetTierStats(Tier tier) const { return tiers[tier].stats; }
+
+	/// Resets the counters of all tiers.
+	void ResetStats();
+
+	/// Returns the list of placed boxes, regardless of the tier that placed them.
+	const std::vector<Rect3d> &GetUsedRectangles() const { return usedRectangles; }
+
+	/// Computes the ratio of used volume to the total bin volume.
+	float Occupancy() const;
+
+private:
+	struct TierState
+	{
+		bool enabled;
+		double budgetMicroseconds;
+		/// Number of boxes in a row for which the tier was skipped for being over budget.
+		unsigned long skipsSinceAttempt;
+		TierStats stats;
+	};
+
+	int binWidth;
+	int binHeight;
+	int binDepth;
+	int levelTierMaxZ;
+	bool escalateOnNewLayer;
+
+	GuillotineBinPack3d::FreeRectChoiceHeuristic guillotineRectChoice;
+	GuillotineBinPack3d::GuillotineSplitHeuristic guillotineSplitMethod;
+
+	LevelBinPack3d levelPacker;
+	GuillotineBinPack3d guillotinePacker;
+	MaxRectsBinPack maxRectsPacker;
+
+	TierState tiers[NumTiers];
+
+	/// Boxes placed by other tiers that the guillotine and maxrects packers have not been told about yet.
+	std::vector<Rect3d> pendingGuillotine;
+	std::vector<Rect3d> pendingMaxRects;
+
+	std::vector<Rect3d> usedRectangles;
+	unsigned long usedVolume;
+
+	/// @return True if the tier should be tried for the next box.
+	bool ShouldTry(Tier tier);
+
+	/// Runs one attempt of the given tier.
+	Rect3d TryTier(Tier tier, int width, int height, int depth);
+
+	/// Runs and times one attempt of the given tier, and commits the box if the tier placed it.
+	/// @return The placement, or a rect of zero size if the tier could not place the box.
+	Rect3d Attempt(Tier tier, int width, int height, int depth);
+
+	/// Reports a box placed by the given tier to all the other tiers.
+	void Share(Tier placedBy, const Rect3d &rect);
+};
+
+}
@@ -0,0 +1,124 @@
+/** @file TraceRecorder.h
+	@brief Records timed phases of the packers into a lock-free ring buffer and writes them as a Chrome trace.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdint.h>
+
+namespace rbp {
+
+/** TraceRecorder collects complete events ("ph":"X") with up to two integer arguments each. Recording claims a
+	slot of a fixed size ring buffer with a single atomic increment and never blocks or allocates, so any number
+	of threads may record at once. When the writers get more than the capacity ahead of Flush, the oldest events
+	are overwritten and counted as dropped.
+
+	Flush writes the events recorded since the previous Flush in the JSON Array Format of the Chrome trace event
+	format, which chrome://tracing and the Perfetto UI load directly. The closing bracket of that format is
+	optional, so a trace can be streamed to a file by calling Flush from a thread of its own, or between boxes. */
+class TraceRecorder
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	/// @param capacity The number of events the ring buffer holds. Rounded up to a power of two.
+	explicit TraceRecorder(size_t capacity = 1 << 16);
+
+	/// Records a phase that ran from start to end. name and the argument names must be string literals or
+	/// otherwise outlive the recorder. Pass null as argument name to leave an argument out. Thread-safe.
+	void Record(const char *name, Clock::time_point start, Clock::time_point end,
+		const char *argName0 = 0, int64_t arg0 = 0, const char *argName1 = 0, int64_t arg1 = 0);
+
+	/// Writes the events recorded since the previous call to out. Events whose recording has not finished yet
+	/// are left for the next call. Safe to call while other threads record.
+	/// @return The number of events written.
+	size_t Flush(std::ostream &out);
+
+	/// @return The number of events overwritten before they were flushed.
+	uint64_t NumDropped() const { return numDropped.load(); }
+
+private:
+	TraceRecorder(const TraceRecorder &);
+	TraceRecorder &operator=(const TraceRecorder &);
+
+	/// One event. The fields are atomics so that Flush can read a slot that is being overwritten; sequence tells
+	/// whether the copy it took is consistent.
+	struct Slot
+	{
+		/// Index of the event in the slot plus one, or 0 while the slot is being written.
+		std::atomic<uint64_t> sequence;
+		std::atomic<const char *> name;
+		std::atomic<int64_t> start; ///< Nanoseconds since the recorder was created.
+		std::atomic<int64_t> duration; ///< Nanoseconds.
+		std::atomic<uint32_t> thread;
+		std::atomic<const char *> argNames[2];
+		std::atomic<int64_t> args[2];
+	};
+
+	std::unique_ptr<Slot[]> slots;
+	size_t mask;
+
+	/// Index of the next event to record.
+	std::atomic<uint64_t> head;
+
+	/// Index of the next event to flush. Guarded by flushLock.
+	uint64_t tail;
+	bool wroteHeader;
+	std::mutex flushLock;
+
+	std::atomic<uint64_t> numDropped;
+
+	Clock::time_point origin;
+};
+
+/** TraceScope records the time from its construction to its destruction as one event. Does nothing if the
+	recorder is null, which costs a single branch, so the packers keep their scopes in place permanently. */
+class TraceScope
+{
+public:
+	TraceScope(TraceRecorder *recorder_, const char *name_)
+	:recorder(recorder_),
+	name(name_),
+	argName0(0),
+	argName1(0),
+	arg0(0),
+	arg1(0)
+	{
+		if (recorder)
+			start = TraceRecorder::Clock::now();
+	}
+
+	~TraceScope()
+	{
+		if (recorder)
+			recorder->Record(name, start, TraceRecorder::Clock::now(), argName0, arg0, argName1, arg1);
+	}
+
+	/// Sets the arguments of the event, e.g. free list sizes known only at the end of the phase.
+	void SetArgs(const char *name0, int64_t value0, const char *name1 = 0, int64_t value1 = 0)
+	{
+		argName0 = name0;
+		arg0 = value0;
+		argName1 = name1;
+		arg1 = value1;
+	}
+
+private:
+	TraceScope(const TraceScope &);
+	TraceScope &operator=(const TraceScope &);
+
+	TraceRecorder *recorder;
+	const char *name;
+	const char *argName0;
+	const char *argName1;
+	int64_t arg0;
+	int64_t arg1;
+	TraceRecorder::Clock::time_point start;
+};
+
+}
@@ -0,0 +1,87 @@
+/** @file ZonedBinPack3d.h
+	@brief Shards a long bin into zones along the loading axis, each with its own MAXRECTS packer.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#pragma once
+
+#include <vector>
+
+#include "Rect3d.h"
+#include "MaxRectsBinPack.h"
+
+namespace rbp {
+
+/** ZonedBinPack3d splits a long bin into zones of equal length along x, the loading axis, and runs an independent
+	MaxRectsBinPack in each. Boxes are routed to the active zone, so the cost of an insert is bounded by the size
+	of one zone's free list instead of the whole container's. The active zone moves on towards the back once it has
+	rejected a number of boxes in a row, and zones behind it are closed for good.
+
+	Since a box may not fit into any single zone even though there is room across a zone border, a seam pass pairs
+	the free spaces that touch a border from both sides on the same floor, with supports that meet at the border,
+	and forms the spaces straddling it. The pass runs only when the open zones reject a box, and not for boxes at
+	least as large as one it already failed for. A box placed into a seam space is reported to both zones. */
+class ZonedBinPack3d
+{
+public:
+	/// Initializes a bin of the given size, split into numZones zones along x. The zones should be longer than the
+	/// largest box.
+	ZonedBinPack3d(int width, int height, int depth, int numZones, bool allowFlip = true);
+
+	/// Inserts a single box into the bin, possibly rotated in the XOY plane.
+	/// @return The placement in bin coordinates, or a rect of zero size if the box did not fit.
+	Rect3d Insert(int width, int height, int depth);
+
+	/// Sets how many boxes in a row the active zone may reject before it is closed. Defaults to 4.
+	void SetCloseAfterFailures(int numFailures) { closeAfterFailures = numFailures; }
+
+	/// @return The index of the active zone.
+	int GetActiveZone() const { return activeZone; }
+
+	/// @return The number of boxes that were placed across a zone border.
+	unsigned long SeamPlacements() const { return seamPlacements; }
+
+	/// Returns the list of placed boxes in bin coordinates.
+	const std::vector<Rect3d> &GetUsedRectangles() const { return usedRectangles; }
+
+	/// Computes the ratio of used volume to the total bin volume.
+	float Occupancy() const;
+
+private:
+	struct Zone
+	{
+		int x; ///< Start of the zone along x in bin coordinates.
+		int width;
+		MaxRectsBinPack packer;
+	};
+
+	int binWidth;
+	int binHeight;
+	int binDepth;
+	bool binAllowFlip;
+
+	std::vector<Zone> zones;
+	int activeZone;
+	int closeAfterFailures;
+	int failuresInARow;
+
+	unsigned long seamPlacements;
+	unsigned long usedVolume;
+	std::vector<Rect3d> usedRectangles;
+
+	/// Sizes of boxes for which the seam pass found no space.
+	std::vector<RectSize3d> seamFailures;
+
+	/// @return True if the seam pass already failed for a box that fits into this one.
+	bool SeamPassFailedFor(int width, int height, int depth) const;
+
+	/// Tries to place the box into a free space straddling the border between zone z and zone z+1.
+	bool InsertAcrossSeam(int z, int width, int height, int depth, Rect3d &newNode);
+
+	/// Reports a box straddling the border between zone z and zone z+1 to both zones.
+	void PlaceAcrossSeam(int z, const Rect3d &newNode);
+
+	/// Records a placed box.
+	void AddUsed(const Rect3d &newNode);
+};
+
+}
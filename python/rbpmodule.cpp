@@ -0,0 +1,629 @@
+/** @file rbpmodule.cpp
+	@brief Python bindings of GuillotineBinPack3d and MaxRectsBinPack, with batch packing of NumPy arrays.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <climits>
+#include <cstring>
+#include <new>
+
+#include "../include/GuillotineBinPack3d.h"
+#include "../include/MaxRectsBinPack.h"
+
+using namespace rbp;
+
+namespace {
+
+/** A packer owned by a Python object. busy is set while a batch runs without the GIL, so that a second thread
+	using the same packer gets an exception instead of corrupting it. It is only read and written with the GIL
+	held, which makes the check race free. */
+template<typename Packer>
+struct PackerObject
+{
+	PyObject_HEAD
+	Packer *packer;
+	bool busy;
+};
+
+typedef PackerObject<GuillotineBinPack3d> GuillotineObject;
+typedef PackerObject<MaxRectsBinPack> MaxRectsObject;
+
+template<typename Packer>
+void DeallocPacker(PyObject *self)
+{
+	PyTypeObject *type = Py_TYPE(self);
+	delete ((PackerObject<Packer> *)self)->packer;
+	type->tp_free(self);
+	Py_DECREF(type);
+}
+
+/// @return False with a Python exception set if the packer is missing or a batch is running on it.
+template<typename Packer>
+bool AcquirePacker(PackerObject<Packer> *self)
+{
+	if (!self->packer)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "the packer was not initialized");
+		return false;
+	}
+	if (self->busy)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "the packer is packing a batch on another thread");
+		return false;
+	}
+	return true;
+}
+
+bool CheckBinSize(int width, int height, int depth)
+{
+	if (width > 0 && height > 0 && depth > 0)
+		return true;
+	PyErr_SetString(PyExc_ValueError, "the bin size must be positive");
+	return false;
+}
+
+bool CheckEnum(int value, int count, const char *name)
+{
+	if (value >= 0 && value < count)
+		return true;
+	PyErr_Format(PyExc_ValueError, "%s must be in [0, %d), got %d", name, count, value);
+	return false;
+}
+
+/// MaxRectsBinPack only implements the bottom-left rule so far, the other heuristics would place nothing.
+bool CheckMaxRectsMethod(int method)
+{
+	if (!CheckEnum(method, 5, "method"))
+		return false;
+	if (method == MaxRectsBinPack::RectBottomLeftRule)
+		return true;
+	PyErr_Format(PyExc_ValueError, "method %d is not implemented, only RectBottomLeftRule is", method);
+	return false;
+}
+
+PyObject *PlacementToTuple(const Rect3d &r)
+{
+	return Py_BuildValue("(iiiiii)", r.x, r.y, r.z, r.width, r.height, r.depth);
+}
+
+/// @return The size of the integers described by a buffer format string, or 0 if it is not a signed integer
+///		of 4 or 8 bytes in native byte order.
+Py_ssize_t IntegerFormatSize(const char *format, Py_ssize_t itemsize)
+{
+	if (!format)
+		return 0;
+	if (*format == '@' || *format == '=')
+		++format;
+	else if (*format == '<' || *format == '>' || *format == '!')
+	{
+		const unsigned int one = 1;
+		const bool littleEndian = *(const unsigned char *)&one == 1;
+		if ((*format == '<') != littleEndian)
+			return 0;
+		++format;
+	}
+	if (format[0] == 0 || format[1] != 0 || !strchr("ilq", format[0]))
+		return 0;
+	return (itemsize == 4 || itemsize == 8) ? itemsize : 0;
+}
+
+/** A view of the (N, 3) integer array of box sizes passed to a batch insert. The array is read in place through
+	its strides, so it is never copied, whatever its memory layout. */
+class BoxSizes
+{
+public:
+	BoxSizes() { memset(&view, 0, sizeof(view)); }
+	~BoxSizes() { if (view.obj) PyBuffer_Release(&view); }
+
+	/// @return False with a Python exception set if obj is not an (N, 3) array of positive integers.
+	bool Open(PyObject *obj)
+	{
+		if (PyObject_GetBuffer(obj, &view, PyBUF_STRIDED_RO | PyBUF_FORMAT) < 0)
+			return false;
+		if (view.ndim != 2 || view.shape[1] != 3 || IntegerFormatSize(view.format, view.itemsize) == 0)
+		{
+			PyErr_SetString(PyExc_ValueError, "sizes must be an (N, 3) array of int32 or int64 box sizes");
+			return false;
+		}
+		for(Py_ssize_t i = 0; i < Count(); ++i)
+			for(int j = 0; j < 3; ++j)
+			{
+				long long value = Read(i, j);
+				if (value <= 0 || value > INT_MAX)
+				{
+					PyErr_Format(PyExc_ValueError, "sizes[%zd, %d] = %lld is not a positive int32", i, j, value);
+					return false;
+				}
+			}
+		return true;
+	}
+
+	Py_ssize_t Count() const { return view.shape[0]; }
+
+	long long Read(Py_ssize_t i, int j) const
+	{
+		const char *p = (const char *)view.buf + i * view.strides[0] + j * view.strides[1];
+		if (view.itemsize == 4)
+		{
+			int value;
+			memcpy(&value, p, sizeof(value));
+			return value;
+		}
+		long long value;
+		memcpy(&value, p, sizeof(value));
+		return value;
+	}
+
+	int Width(Py_ssize_t i) const { return (int)Read(i, 0); }
+	int Height(Py_ssize_t i) const { return (int)Read(i, 1); }
+	int Depth(Py_ssize_t i) const { return (int)Read(i, 2); }
+
+private:
+	BoxSizes(const BoxSizes &);
+	BoxSizes &operator=(const BoxSizes &);
+
+	Py_buffer view;
+};
+
+/** The (N, 6) int32 array the placements of a batch are written to: either the out argument, or a new array
+	returned as a memoryview, which numpy.asarray wraps without a copy. */
+class Placements
+{
+public:
+	Placements() :result(0) { memset(&view, 0, sizeof(view)); }
+	~Placements()
+	{
+		if (view.obj)
+			PyBuffer_Release(&view);
+		Py_XDECREF(result);
+	}
+
+	/// @return False with a Python exception set if out is given but is not a writable C-contiguous (count, 6)
+	///		int32 array, or if memory runs out.
+	bool Open(PyObject *out, Py_ssize_t count)
+	{
+		if (out && out != Py_None)
+		{
+			Py_INCREF(out);
+			result = out;
+		}
+		else
+		{
+			PyObject *bytes = PyByteArray_FromStringAndSize(0, count * 6 * (Py_ssize_t)sizeof(int));
+			if (!bytes)
+				return false;
+			PyObject *flat = PyMemoryView_FromObject(bytes);
+			Py_DECREF(bytes);
+			if (!flat)
+				return false;
+			// memoryview cannot take a shape with a zero in it, so an empty batch gets a flat empty view.
+			if (count > 0)
+				result = PyObject_CallMethod(flat, "cast", "s(nn)", "i", count, (Py_ssize_t)6);
+			else
+				result = PyObject_CallMethod(flat, "cast", "s", "i");
+			Py_DECREF(flat);
+			if (!result)
+				return false;
+			if (count == 0)
+				return true;
+		}
+
+		if (PyObject_GetBuffer(result, &view, PyBUF_C_CONTIGUOUS | PyBUF_WRITABLE | PyBUF_FORMAT) < 0)
+			return false;
+		if (view.ndim != 2 || view.shape[0] != count || view.shape[1] != 6 ||
+			IntegerFormatSize(view.format, view.itemsize) != (Py_ssize_t)sizeof(int))
+		{
+			PyErr_SetString(PyExc_ValueError, "out must be a writable C-contiguous (N, 6) int32 array");
+			return false;
+		}
+		return true;
+	}
+
+	void Write(Py_ssize_t i, const Rect3d &r)
+	{
+		int *row = (int *)view.buf + i * 6;
+		row[0] = r.x;
+		row[1] = r.y;
+		row[2] = r.z;
+		row[3] = r.width;
+		row[4] = r.height;
+		row[5] = r.depth;
+	}
+
+	/// Hands the array over to the caller.
+	PyObject *Release()
+	{
+		PyBuffer_Release(&view);
+		PyObject *r = result;
+		result = 0;
+		return r;
+	}
+
+private:
+	Placements(const Placements &);
+	Placements &operator=(const Placements &);
+
+	PyObject *result;
+	Py_buffer view;
+};
+
+/** Runs insert(packer, i) for every box of the batch with the GIL released, so that other Python threads can
+	pack their own orders meanwhile. */
+template<typename Packer, typename InsertOne>
+PyObject *InsertBatch(PackerObject<Packer> *self, PyObject *sizesObj, PyObject *outObj, InsertOne insert)
+{
+	BoxSizes sizes;
+	if (!sizes.Open(sizesObj))
+		return 0;
+	Placements placements;
+	if (!placements.Open(outObj, sizes.Count()))
+		return 0;
+
+	self->busy = true;
+	Packer &packer = *self->packer;
+	Py_BEGIN_ALLOW_THREADS
+	for(Py_ssize_t i = 0; i < sizes.Count(); ++i)
+		placements.Write(i, insert(packer, sizes.Width(i), sizes.Height(i), sizes.Depth(i)));
+	Py_END_ALLOW_THREADS
+	self->busy = false;
+	return placements.Release();
+}
+
+template<typename Packer>
+PyObject *Occupancy(PyObject *self, PyObject *)
+{
+	PackerObject<Packer> *object = (PackerObject<Packer> *)self;
+	if (!AcquirePacker(object))
+		return 0;
+	return PyFloat_FromDouble(object->packer->Occupancy());
+}
+
+template<typename Packer>
+PyObject *NumUsedRectangles(PyObject *self, PyObject *)
+{
+	PackerObject<Packer> *object = (PackerObject<Packer> *)self;
+	if (!AcquirePacker(object))
+		return 0;
+	return PyLong_FromSize_t(object->packer->GetUsedRectangles().size());
+}
+
+template<typename Packer>
+PyObject *NumFreeRectangles(PyObject *self, PyObject *)
+{
+	PackerObject<Packer> *object = (PackerObject<Packer> *)self;
+	if (!AcquirePacker(object))
+		return 0;
+	return PyLong_FromSize_t(object->packer->GetFreeRectangles().size());
+}
+
+/// Adds the given enumerators to type as integer class attributes.
+bool AddEnum(PyObject *type, const char *const *names, int count)
+{
+	for(int i = 0; i < count; ++i)
+	{
+		PyObject *value = PyLong_FromLong(i);
+		if (!value)
+			return false;
+		int failed = PyObject_SetAttrString(type, names[i], value);
+		Py_DECREF(value);
+		if (failed)
+			return false;
+	}
+	return true;
+}
+
+// GuillotineBinPack3d
+
+const char *const guillotineRectChoiceNames[] = { "RectBestAreaFit", "RectBestShortSideFit", "RectBestLongSideFit",
+	"RectWorstAreaFit", "RectWorstShortSideFit", "RectWorstLongSideFit" };
+const char *const guillotineSplitNames[] = { "SplitShorterLeftoverAxis", "SplitLongerLeftoverAxis",
+	"SplitMinimizeArea", "SplitMaximizeArea", "SplitShorterAxis", "SplitLongerAxis" };
+const char *const guillotineMergeNames[] = { "MergeNever", "MergeAlways", "MergeLazy" };
+
+bool CheckGuillotineHeuristics(int mergePolicy, int rectChoice, int splitMethod)
+{
+	return CheckEnum(mergePolicy, 3, "merge_policy") && CheckEnum(rectChoice, 6, "rect_choice") &&
+		CheckEnum(splitMethod, 6, "split_method");
+}
+
+int GuillotineInit(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = { "width", "height", "depth", 0 };
+	int width, height, depth;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iii", (char **)keywords, &width, &height, &depth) ||
+		!CheckBinSize(width, height, depth))
+		return -1;
+
+	GuillotineObject *object = (GuillotineObject *)self;
+	if (object->busy)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "the packer is packing a batch on another thread");
+		return -1;
+	}
+	if (!object->packer)
+		object->packer = new(std::nothrow) GuillotineBinPack3d();
+	if (!object->packer)
+	{
+		PyErr_NoMemory();
+		return -1;
+	}
+	object->packer->Init(width, height, depth);
+	return 0;
+}
+
+PyObject *GuillotineReset(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	if (GuillotineInit(self, args, kwargs) < 0)
+		return 0;
+	Py_RETURN_NONE;
+}
+
+PyObject *GuillotineInsert(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = { "width", "height", "depth", "merge_policy", "rect_choice", "split_method", 0 };
+	int width, height, depth;
+	int mergePolicy = GuillotineBinPack3d::MergeLazy;
+	int rectChoice = GuillotineBinPack3d::RectBestAreaFit;
+	int splitMethod = GuillotineBinPack3d::SplitShorterLeftoverAxis;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iii|iii", (char **)keywords, &width, &height, &depth,
+		&mergePolicy, &rectChoice, &splitMethod) || !CheckGuillotineHeuristics(mergePolicy, rectChoice, splitMethod))
+		return 0;
+
+	GuillotineObject *object = (GuillotineObject *)self;
+	if (!AcquirePacker(object))
+		return 0;
+	return PlacementToTuple(object->packer->Insert(width, height, depth,
+		(GuillotineBinPack3d::MergePolicy)mergePolicy, (GuillotineBinPack3d::FreeRectChoiceHeuristic)rectChoice,
+		(GuillotineBinPack3d::GuillotineSplitHeuristic)splitMethod));
+}
+
+PyObject *GuillotineInsertBatch(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = { "sizes", "merge_policy", "rect_choice", "split_method", "out", 0 };
+	PyObject *sizes;
+	PyObject *out = 0;
+	int mergePolicy = GuillotineBinPack3d::MergeLazy;
+	int rectChoice = GuillotineBinPack3d::RectBestAreaFit;
+	int splitMethod = GuillotineBinPack3d::SplitShorterLeftoverAxis;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iiiO", (char **)keywords, &sizes,
+		&mergePolicy, &rectChoice, &splitMethod, &out) || !CheckGuillotineHeuristics(mergePolicy, rectChoice, splitMethod))
+		return 0;
+
+	GuillotineObject *object = (GuillotineObject *)self;
+	if (!AcquirePacker(object))
+		return 0;
+	const GuillotineBinPack3d::MergePolicy merge = (GuillotineBinPack3d::MergePolicy)mergePolicy;
+	const GuillotineBinPack3d::FreeRectChoiceHeuristic choice = (GuillotineBinPack3d::FreeRectChoiceHeuristic)rectChoice;
+	const GuillotineBinPack3d::GuillotineSplitHeuristic split = (GuillotineBinPack3d::GuillotineSplitHeuristic)splitMethod;
+	return InsertBatch(object, sizes, out, [=](GuillotineBinPack3d &packer, int width, int height, int depth)
+	{
+		return packer.Insert(width, height, depth, merge, choice, split);
+	});
+}
+
+PyMethodDef guillotineMethods[] =
+{
+	{ "init", (PyCFunction)(void(*)(void))GuillotineReset, METH_VARARGS | METH_KEYWORDS,
+		"init(width, height, depth)\n--\n\nRestarts with an empty bin of the given size." },
+	{ "insert", (PyCFunction)(void(*)(void))GuillotineInsert, METH_VARARGS | METH_KEYWORDS,
+		"insert(width, height, depth, merge_policy=MergeLazy, rect_choice=RectBestAreaFit, "
+		"split_method=SplitShorterLeftoverAxis)\n--\n\n"
+		"Inserts one box. Returns its placement (x, y, z, width, height, depth), all zeros if it did not fit." },
+	{ "insert_batch", (PyCFunction)(void(*)(void))GuillotineInsertBatch, METH_VARARGS | METH_KEYWORDS,
+		"insert_batch(sizes, merge_policy=MergeLazy, rect_choice=RectBestAreaFit, "
+		"split_method=SplitShorterLeftoverAxis, out=None)\n--\n\n"
+		"Inserts the boxes of an (N, 3) int32 or int64 array in order, without the GIL. Returns the placements as an\n"
+		"(N, 6) int32 memoryview, or fills and returns out if given. Rows of boxes that did not fit are all zeros." },
+	{ "occupancy", Occupancy<GuillotineBinPack3d>, METH_NOARGS,
+		"occupancy()\n--\n\nReturns the ratio of used to total bin volume." },
+	{ "num_used_rectangles", NumUsedRectangles<GuillotineBinPack3d>, METH_NOARGS,
+		"num_used_rectangles()\n--\n\nReturns the number of packed boxes." },
+	{ "num_free_rectangles", NumFreeRectangles<GuillotineBinPack3d>, METH_NOARGS,
+		"num_free_rectangles()\n--\n\nReturns the number of free rectangles." },
+	{ 0, 0, 0, 0 }
+};
+
+PyType_Slot guillotineSlots[] =
+{
+	{ Py_tp_doc, (void *)"GuillotineBinPack3d(width, height, depth)\n--\n\nThe GUILLOTINE packer. The enumerators of "
+		"FreeRectChoiceHeuristic, GuillotineSplitHeuristic and MergePolicy are class attributes." },
+	{ Py_tp_new, (void *)PyType_GenericNew },
+	{ Py_tp_init, (void *)GuillotineInit },
+	{ Py_tp_dealloc, (void *)DeallocPacker<GuillotineBinPack3d> },
+	{ Py_tp_methods, guillotineMethods },
+	{ 0, 0 }
+};
+
+PyType_Spec guillotineSpec =
+{
+	"rbp.GuillotineBinPack3d", sizeof(GuillotineObject), 0, Py_TPFLAGS_DEFAULT, guillotineSlots
+};
+
+// MaxRectsBinPack
+
+const char *const maxRectsChoiceNames[] = { "RectBestShortSideFit", "RectBestLongSideFit", "RectBestAreaFit",
+	"RectBottomLeftRule", "RectContactPointRule" };
+const char *const maxRectsEvictionNames[] = { "EvictSmallestVolume", "EvictLeastUseful" };
+
+int MaxRectsInit(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = { "width", "height", "depth", "allow_flip", 0 };
+	int width, height, depth;
+	int allowFlip = 1;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iii|p", (char **)keywords, &width, &height, &depth, &allowFlip) ||
+		!CheckBinSize(width, height, depth))
+		return -1;
+
+	MaxRectsObject *object = (MaxRectsObject *)self;
+	if (object->busy)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "the packer is packing a batch on another thread");
+		return -1;
+	}
+	if (!object->packer)
+		object->packer = new(std::nothrow) MaxRectsBinPack();
+	if (!object->packer)
+	{
+		PyErr_NoMemory();
+		return -1;
+	}
+	object->packer->Init(width, height, depth, allowFlip != 0);
+	return 0;
+}
+
+PyObject *MaxRectsReset(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	if (MaxRectsInit(self, args, kwargs) < 0)
+		return 0;
+	Py_RETURN_NONE;
+}
+
+PyObject *MaxRectsInsert(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = { "width", "height", "depth", "method", 0 };
+	int width, height, depth;
+	int method = MaxRectsBinPack::RectBottomLeftRule;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iii|i", (char **)keywords, &width, &height, &depth, &method) ||
+		!CheckMaxRectsMethod(method))
+		return 0;
+
+	MaxRectsObject *object = (MaxRectsObject *)self;
+	if (!AcquirePacker(object))
+		return 0;
+	return PlacementToTuple(object->packer->Insert(width, height, depth, (MaxRectsBinPack::FreeRectChoiceHeuristic)method));
+}
+
+PyObject *MaxRectsInsertBatch(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = { "sizes", "method", "out", 0 };
+	PyObject *sizes;
+	PyObject *out = 0;
+	int method = MaxRectsBinPack::RectBottomLeftRule;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iO", (char **)keywords, &sizes, &method, &out) ||
+		!CheckMaxRectsMethod(method))
+		return 0;
+
+	MaxRectsObject *object = (MaxRectsObject *)self;
+	if (!AcquirePacker(object))
+		return 0;
+	const MaxRectsBinPack::FreeRectChoiceHeuristic choice = (MaxRectsBinPack::FreeRectChoiceHeuristic)method;
+	return InsertBatch(object, sizes, out, [=](MaxRectsBinPack &packer, int width, int height, int depth)
+	{
+		return packer.Insert(width, height, depth, choice);
+	});
+}
+
+PyObject *MaxRectsSetFreeListCap(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = { "max_free_rectangles", "policy", 0 };
+	Py_ssize_t maxFreeRectangles;
+	int policy = MaxRectsBinPack::EvictSmallestVolume;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "n|i", (char **)keywords, &maxFreeRectangles, &policy) ||
+		!CheckEnum(policy, 2, "policy"))
+		return 0;
+	if (maxFreeRectangles < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "max_free_rectangles must not be negative");
+		return 0;
+	}
+
+	MaxRectsObject *object = (MaxRectsObject *)self;
+	if (!AcquirePacker(object))
+		return 0;
+	object->packer->SetFreeListCap((size_t)maxFreeRectangles, (MaxRectsBinPack::EvictionPolicy)policy);
+	Py_RETURN_NONE;
+}
+
+PyMethodDef maxRectsMethods[] =
+{
+	{ "init", (PyCFunction)(void(*)(void))MaxRectsReset, METH_VARARGS | METH_KEYWORDS,
+		"init(width, height, depth, allow_flip=True)\n--\n\nRestarts with an empty bin of the given size." },
+	{ "insert", (PyCFunction)(void(*)(void))MaxRectsInsert, METH_VARARGS | METH_KEYWORDS,
+		"insert(width, height, depth, method=RectBottomLeftRule)\n--\n\n"
+		"Inserts one box. Returns its placement (x, y, z, width, height, depth), all zeros if it did not fit.\n"
+		"Only RectBottomLeftRule is implemented, other methods raise ValueError." },
+	{ "insert_batch", (PyCFunction)(void(*)(void))MaxRectsInsertBatch, METH_VARARGS | METH_KEYWORDS,
+		"insert_batch(sizes, method=RectBottomLeftRule, out=None)\n--\n\n"
+		"Inserts the boxes of an (N, 3) int32 or int64 array in order, without the GIL. Returns the placements as an\n"
+		"(N, 6) int32 memoryview, or fills and returns out if given. Rows of boxes that did not fit are all zeros." },
+	{ "set_free_list_cap", (PyCFunction)(void(*)(void))MaxRectsSetFreeListCap, METH_VARARGS | METH_KEYWORDS,
+		"set_free_list_cap(max_free_rectangles, policy=EvictSmallestVolume)\n--\n\n"
+		"Caps the number of free spaces, 0 lifts the cap. See MaxRectsBinPack::SetFreeListCap." },
+	{ "occupancy", Occupancy<MaxRectsBinPack>, METH_NOARGS,
+		"occupancy()\n--\n\nReturns the ratio of used to total floor area." },
+	{ "num_used_rectangles", NumUsedRectangles<MaxRectsBinPack>, METH_NOARGS,
+		"num_used_rectangles()\n--\n\nReturns the number of packed boxes." },
+	{ "num_free_rectangles", NumFreeRectangles<MaxRectsBinPack>, METH_NOARGS,
+		"num_free_rectangles()\n--\n\nReturns the number of maximal free spaces." },
+	{ 0, 0, 0, 0 }
+};
+
+PyType_Slot maxRectsSlots[] =
+{
+	{ Py_tp_doc, (void *)"MaxRectsBinPack(width, height, depth, allow_flip=True)\n--\n\nThe MAXRECTS packer. The "
+		"enumerators of FreeRectChoiceHeuristic and EvictionPolicy are class attributes." },
+	{ Py_tp_new, (void *)PyType_GenericNew },
+	{ Py_tp_init, (void *)MaxRectsInit },
+	{ Py_tp_dealloc, (void *)DeallocPacker<MaxRectsBinPack> },
+	{ Py_tp_methods, maxRectsMethods },
+	{ 0, 0 }
+};
+
+PyType_Spec maxRectsSpec =
+{
+	"rbp.MaxRectsBinPack", sizeof(MaxRectsObject), 0, Py_TPFLAGS_DEFAULT, maxRectsSlots
+};
+
+/// Creates a packer type, gives it its enumerators and adds it to the module.
+bool AddType(PyObject *module, PyType_Spec &spec, const char *name,
+	const char *const *const *enums, const int *enumCounts, int numEnums)
+{
+	PyObject *type = PyType_FromSpec(&spec);
+	if (!type)
+		return false;
+	for(int i = 0; i < numEnums; ++i)
+		if (!AddEnum(type, enums[i], enumCounts[i]))
+		{
+			Py_DECREF(type);
+			return false;
+		}
+	if (PyModule_AddObject(module, name, type) < 0)
+	{
+		Py_DECREF(type);
+		return false;
+	}
+	return true;
+}
+
+PyModuleDef rbpModule =
+{
+	PyModuleDef_HEAD_INIT, "rbp",
+	"3D bin packers. insert_batch takes an (N, 3) array of box sizes, such as a NumPy array, and packs it in place\n"
+	"without copying or holding the GIL, so several threads can pack orders in parallel with a packer each:\n\n"
+	"    packer = rbp.GuillotineBinPack3d(1200, 1000, 1500)\n"
+	"    placements = numpy.asarray(packer.insert_batch(sizes))  # (N, 6): x, y, z, width, height, depth",
+	-1, 0, 0, 0, 0, 0
+};
+
+}
+
+PyMODINIT_FUNC PyInit_rbp()
+{
+	PyObject *module = PyModule_Create(&rbpModule);
+	if (!module)
+		return 0;
+
+	const char *const *guillotineEnums[] = { guillotineRectChoiceNames, guillotineSplitNames, guillotineMergeNames };
+	const int guillotineEnumCounts[] = { 6, 6, 3 };
+	const char *const *maxRectsEnums[] = { maxRectsChoiceNames, maxRectsEvictionNames };
+	const int maxRectsEnumCounts[] = { 5, 2 };
+	if (!AddType(module, guillotineSpec, "GuillotineBinPack3d", guillotineEnums, guillotineEnumCounts, 3) ||
+		!AddType(module, maxRectsSpec, "MaxRectsBinPack", maxRectsEnums, maxRectsEnumCounts, 2))
+	{
+		Py_DECREF(module);
+		return 0;
+	}
+	return module;
+}
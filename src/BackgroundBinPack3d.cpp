@@ -0,0 +1,183 @@
+/** @file BackgroundBinPack3d.cpp
+	@brief Runs the free list maintenance of a packer on a background thread, off the critical path of Insert.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#include <cassert>
+
+#include "../include/BackgroundBinPack3d.h"
+
+namespace rbp {
+
+using namespace std;
+
+BackgroundBinPack3d::BackgroundBinPack3d(int width, int height, int depth, Backend backend_)
+:binWidth(width),
+binHeight(height),
+binDepth(depth),
+backend(backend_),
+version(0),
+maintenanceDue(false),
+workerBusy(false),
+stopping(false),
+numPublished(0),
+numRebased(0),
+numDiscarded(0)
+{
+	guillotine.Init(width, height, depth);
+	maxRects.Init(width, height, depth);
+	worker = std::thread(&BackgroundBinPack3d::WorkerMain, this);
+}
+
+BackgroundBinPack3d::~BackgroundBinPack3d()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	maintenanceWanted.notify_all();
+	worker.join();
+}
+
+void BackgroundBinPack3d::Init(int width, int height, int depth)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	binWidth = width;
+	binHeight = height;
+	binDepth = depth;
+	guillotine.Init(width, height, depth);
+	maxRects.Init(width, height, depth);
+	++version;
+	placedSinceSnapshot.clear();
+	maintenanceDue = false;
+}
+
+Rect3d BackgroundBinPack3d::Insert(int width, int height, int depth)
+{
+	Rect3d newNode;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (backend == BackendGuillotine)
+			newNode = guillotine.Insert(width, height, depth, GuillotineBinPack3d::MergeNever,
+				GuillotineBinPack3d::RectBestShortSideFit, GuillotineBinPack3d::SplitShorterLeftoverAxis);
+		else
+			newNode = maxRects.InsertWithDeadline(width, height, depth, MaxRectsBinPack::RectBottomLeftRule,
+				MaxRectsBinPack::Clock::time_point::max());
+
+		if (newNode.height == 0)
+			return newNode;
+		if (workerBusy)
+			placedSinceSnapshot.push_back(newNode);
+		maintenanceDue = true;
+	}
+	maintenanceWanted.notify_one();
+	return newNode;
+}
+
+void BackgroundBinPack3d::WorkerMain()
+{
+	std::vector<Rect3d> rects;
+	std::vector<FreeRect3d> spaces;
+
+	std::unique_lock<std::mutex> guard(lock);
+	for(;;)
+	{
+		while(!stopping && !maintenanceDue)
+			maintenanceWanted.wait(guard);
+		if (stopping)
+			return;
+
+		// Take a snapshot under the lock, and compact it without.
+		maintenanceDue = false;
+		workerBusy = true;
+		const unsigned long snapshotVersion = version;
+		placedSinceSnapshot.clear();
+		if (backend == BackendGuillotine)
+			guillotine.GetMaintenanceSnapshot(rects);
+		else
+			spaces = maxRects.GetFreeRectangles();
+		guard.unlock();
+
+		if (backend == BackendGuillotine)
+			GuillotineBinPack3d::MergeRectsByKey(rects, 0);
+		else
+		{
+			size_t cursor = 0;
+			MaxRectsBinPack::PruneFreeSpaces(spaces, cursor, MaxRectsBinPack::Clock::time_point::max());
+		}
+
+		guard.lock();
+		workerBusy = false;
+		if (version == snapshotVersion)
+		{
+			// Boxes placed meanwhile also set maintenanceDue again, so the cuts they leave get compacted next.
+			if (backend == BackendGuillotine)
+				guillotine.PublishMergedFreeList(rects, placedSinceSnapshot);
+			else
+				maxRects.PublishPrunedFreeList(spaces, placedSinceSnapshot);
+			++numPublished;
+			if (!placedSinceSnapshot.empty())
+				++numRebased;
+		}
+		else
+			++numDiscarded;
+		placedSinceSnapshot.clear();
+		maintenanceDone.notify_all();
+	}
+}
+
+void BackgroundBinPack3d::WaitForMaintenance()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while(!stopping && (maintenanceDue || workerBusy))
+		maintenanceDone.wait(guard);
+}
+
+size_t BackgroundBinPack3d::NumFreeRectangles() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (backend == BackendGuillotine)
+		return guillotine.GetFreeRectangles().size();
+	return maxRects.GetFreeRectangles().size();
+}
+
+unsigned long BackgroundBinPack3d::NumPublished() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return numPublished;
+}
+
+unsigned long BackgroundBinPack3d::NumRebased() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return numRebased;
+}
+
+unsigned long BackgroundBinPack3d::NumDiscarded() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return numDiscarded;
+}
+
+float BackgroundBinPack3d::Occupancy() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (backend == BackendGuillotine)
+		return guillotine.Occupancy();
+
+	// MaxRectsBinPack::Occupancy measures the floor area, so compute the volume ratio here.
+	const std::vector<Rect3d> &used = maxRects.GetUsedRectangles();
+	double usedVolume = 0.0;
+	for(size_t i = 0; i < used.size(); ++i)
+		usedVolume += (double)used[i].width * used[i].height * used[i].depth;
+	return (float)(usedVolume / ((double)binWidth * binHeight * binDepth));
+}
+
+std::vector<Rect3d> BackgroundBinPack3d::GetUsedRectangles() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (backend == BackendGuillotine)
+		return guillotine.GetUsedRectangles();
+	return maxRects.GetUsedRectangles();
+}
+
+}
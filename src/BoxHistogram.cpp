@@ -0,0 +1,71 @@
+/** @file BoxHistogram.cpp
+	@brief A running histogram of observed box sizes that can be sampled from.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#include <algorithm>
+
+#include <cassert>
+
+#include "../include/BoxHistogram.h"
+
+namespace rbp {
+
+using namespace std;
+
+BoxHistogram::BoxHistogram()
+:total(0)
+{
+}
+
+void BoxHistogram::Clear()
+{
+	index.clear();
+	sizes.clear();
+	counts.clear();
+	cumulative.clear();
+	total = 0;
+}
+
+void BoxHistogram::Add(int width, int height, int depth)
+{
+	SizeKey key;
+	key.width = width;
+	key.height = height;
+	key.depth = depth;
+
+	std::map<SizeKey, size_t>::iterator iter = index.find(key);
+	if (iter == index.end())
+	{
+		RectSize3d size;
+		size.width = width;
+		size.height = height;
+		size.depth = depth;
+		index[key] = sizes.size();
+		sizes.push_back(size);
+		counts.push_back(1);
+	}
+	else
+		++counts[iter->second];
+	++total;
+}
+
+void BoxHistogram::Prepare()
+{
+	cumulative.resize(counts.size());
+	unsigned long sum = 0;
+	for(size_t i = 0; i < counts.size(); ++i)
+	{
+		sum += counts[i];
+		cumulative[i] = sum;
+	}
+}
+
+RectSize3d BoxHistogram::Sample(std::mt19937 &rng) const
+{
+	assert(!cumulative.empty() && cumulative.size() == sizes.size());
+	std::uniform_int_distribution<unsigned long> uniform(0, cumulative.back() - 1);
+	unsigned long u = uniform(rng);
+	return sizes[upper_bound(cumulative.begin(), cumulative.end(), u) - cumulative.begin()];
+}
+
+}
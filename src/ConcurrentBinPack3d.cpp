@@ -0,0 +1,291 @@
+/** @file ConcurrentBinPack3d.cpp
+	@brief Lets several robot arms insert into the same bin concurrently by locking spatial regions.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#include <algorithm>
+
+#include <cassert>
+#include <cstring>
+
+#include "../include/ConcurrentBinPack3d.h"
+
+namespace rbp {
+
+using namespace std;
+
+namespace {
+
+/// Number of times a placement across regions is searched without holding the locks, before Insert searches
+/// once more with all regions locked.
+const int optimisticAttempts = 3;
+
+/// @return The volume of the intersection of a and b.
+unsigned long long OverlapVolume(const Rect3d &a, const Rect3d &b)
+{
+	const int width = min(a.x + a.width, b.x + b.width) - max(a.x, b.x);
+	const int height = min(a.y + a.height, b.y + b.height) - max(a.y, b.y);
+	const int depth = min(a.z + a.depth, b.z + b.depth) - max(a.z, b.z);
+	if (width <= 0 || height <= 0 || depth <= 0)
+		return 0;
+	return (unsigned long long)width * height * depth;
+}
+
+/// @return True if box is covered by the union of the given free rectangles, which must be disjoint.
+bool IsCovered(const Rect3d &box, const std::vector<Rect3d> &freeSpace)
+{
+	const unsigned long long volume = (unsigned long long)box.width * box.height * box.depth;
+	unsigned long long covered = 0;
+	for(size_t i = 0; i < freeSpace.size(); ++i)
+	{
+		covered += OverlapVolume(box, freeSpace[i]);
+		if (covered >= volume)
+			return true;
+	}
+	return false;
+}
+
+/// The bottom-left order of placements: lowest z first, then lowest y, then lowest x.
+bool BottomLeftBefore(const Rect3d &a, const Rect3d &b)
+{
+	if (a.z != b.z) return a.z < b.z;
+	if (a.y != b.y) return a.y < b.y;
+	return a.x < b.x;
+}
+
+}
+
+ConcurrentBinPack3d::ConcurrentBinPack3d(int width, int height, int depth, int regionsX, int regionsY)
+:binWidth(width),
+binHeight(height),
+binDepth(depth),
+mergePolicy(GuillotineBinPack3d::MergeLazy),
+rectChoice(GuillotineBinPack3d::RectBestAreaFit),
+splitMethod(GuillotineBinPack3d::SplitShorterLeftoverAxis),
+usedVolume(0),
+contentions(0),
+conflicts(0)
+{
+	assert(regionsX > 0 && regionsY > 0);
+
+	// Spread the remainder over the first regions so that the regions tile the bin exactly.
+	int y = 0;
+	for(int j = 0; j < regionsY; ++j)
+	{
+		int regionHeight = height / regionsY + (j < height % regionsY ? 1 : 0);
+		int x = 0;
+		for(int i = 0; i < regionsX; ++i)
+		{
+			int regionWidth = width / regionsX + (i < width % regionsX ? 1 : 0);
+			std::unique_ptr<Region> region(new Region);
+			region->x = x;
+			region->y = y;
+			region->width = regionWidth;
+			region->height = regionHeight;
+			region->packer.Init(regionWidth, regionHeight, depth);
+			regions.push_back(std::move(region));
+			x += regionWidth;
+		}
+		y += regionHeight;
+	}
+}
+
+void ConcurrentBinPack3d::SetHeuristics(GuillotineBinPack3d::MergePolicy mergePolicy_,
+	GuillotineBinPack3d::FreeRectChoiceHeuristic rectChoice_,
+	GuillotineBinPack3d::GuillotineSplitHeuristic splitMethod_)
+{
+	mergePolicy = mergePolicy_;
+	rectChoice = rectChoice_;
+	splitMethod = splitMethod_;
+}
+
+bool ConcurrentBinPack3d::InsertIntoRegion(Region &region, int width, int height, int depth, Rect3d &newNode)
+{
+	newNode = region.packer.Insert(width, height, depth, mergePolicy, rectChoice, splitMethod);
+	if (newNode.height == 0)
+		return false;
+
+	newNode.x += region.x;
+	newNode.y += region.y;
+	return true;
+}
+
+void ConcurrentBinPack3d::CopyFreeSpace(const Region &region, std::vector<Rect3d> &out)
+{
+	const std::vector<Rect3d> *lists[2] = { &region.packer.GetFreeRectangles(),
+		&region.packer.GetQuarantinedRectangles() };
+	for(int l = 0; l < 2; ++l)
+		for(size_t i = 0; i < lists[l]->size(); ++i)
+		{
+			Rect3d r = (*lists[l])[i];
+			r.x += region.x;
+			r.y += region.y;
+			out.push_back(r);
+		}
+}
+
+bool ConcurrentBinPack3d::FindPlacement(const std::vector<Rect3d> &freeSpace, int width, int height, int depth,
+	Rect3d &newNode) const
+{
+	// Try the box at the corner of every free rectangle, in both orientations.
+	bool found = false;
+	for(size_t i = 0; i < freeSpace.size(); ++i)
+		for(int flip = 0; flip < 2; ++flip)
+		{
+			Rect3d box;
+			box.x = freeSpace[i].x;
+			box.y = freeSpace[i].y;
+			box.z = freeSpace[i].z;
+			box.width = flip ? height : width;
+			box.height = flip ? width : height;
+			box.depth = depth;
+			if (box.x + box.width > binWidth || box.y + box.height > binHeight || box.z + box.depth > binDepth)
+				continue;
+			if (found && !BottomLeftBefore(box, newNode))
+				continue;
+			if (!IsCovered(box, freeSpace))
+				continue;
+			newNode = box;
+			found = true;
+		}
+	return found;
+}
+
+void ConcurrentBinPack3d::PlaceAcrossRegions(const Rect3d &newNode)
+{
+	for(size_t i = 0; i < regions.size(); ++i)
+	{
+		Region &region = *regions[i];
+		const int x0 = max(newNode.x, region.x);
+		const int x1 = min(newNode.x + newNode.width, region.x + region.width);
+		const int y0 = max(newNode.y, region.y);
+		const int y1 = min(newNode.y + newNode.height, region.y + region.height);
+		if (x0 >= x1 || y0 >= y1)
+			continue;
+
+		Rect3d part = newNode;
+		part.x = x0 - region.x;
+		part.y = y0 - region.y;
+		part.width = x1 - x0;
+		part.height = y1 - y0;
+		region.packer.PlaceRect(part);
+	}
+}
+
+ConcurrentBinPack3d::CrossRegionResult ConcurrentBinPack3d::InsertAcrossRegions(int width, int height, int depth,
+	bool lockAll, Rect3d &newNode)
+{
+	std::vector<std::unique_lock<std::mutex> > held;
+	std::vector<Rect3d> freeSpace;
+	for(size_t i = 0; i < regions.size(); ++i)
+	{
+		std::unique_lock<std::mutex> guard(regions[i]->lock);
+		CopyFreeSpace(*regions[i], freeSpace);
+		if (lockAll)
+			held.push_back(std::move(guard));
+	}
+
+	if (!FindPlacement(freeSpace, width, height, depth, newNode))
+		return CrossRegionNoSpace;
+
+	if (!lockAll)
+	{
+		// Lock the covered regions in ascending order, and check that nobody took the space since the copy.
+		std::vector<Rect3d> liveSpace;
+		for(size_t i = 0; i < regions.size(); ++i)
+		{
+			Region &region = *regions[i];
+			if (newNode.x >= region.x + region.width || newNode.x + newNode.width <= region.x ||
+				newNode.y >= region.y + region.height || newNode.y + newNode.height <= region.y)
+				continue;
+			held.push_back(std::unique_lock<std::mutex>(region.lock));
+			CopyFreeSpace(region, liveSpace);
+		}
+		if (!IsCovered(newNode, liveSpace))
+		{
+			++conflicts;
+			return CrossRegionConflict;
+		}
+	}
+
+	PlaceAcrossRegions(newNode);
+	return CrossRegionPlaced;
+}
+
+void ConcurrentBinPack3d::AddUsed(const Rect3d &newNode)
+{
+	usedVolume += (unsigned long)newNode.width * newNode.height * newNode.depth;
+
+	std::lock_guard<std::mutex> guard(usedLock);
+	usedRectangles.push_back(newNode);
+}
+
+Rect3d ConcurrentBinPack3d::Insert(int width, int height, int depth, int arm)
+{
+	const size_t numRegions = regions.size();
+	const size_t home = (size_t)arm % numRegions;
+
+	Rect3d newNode;
+	memset(&newNode, 0, sizeof(Rect3d));
+
+	// Optimistic pass: only visit the regions no other arm is working in.
+	std::vector<size_t> busy;
+	for(size_t k = 0; k < numRegions; ++k)
+	{
+		Region &region = *regions[(home + k) % numRegions];
+		std::unique_lock<std::mutex> guard(region.lock, std::try_to_lock);
+		if (!guard.owns_lock())
+		{
+			++contentions;
+			busy.push_back((home + k) % numRegions);
+			continue;
+		}
+		if (InsertIntoRegion(region, width, height, depth, newNode))
+		{
+			guard.unlock();
+			AddUsed(newNode);
+			return newNode;
+		}
+	}
+
+	// Retry the regions that were busy, waiting for them this time.
+	for(size_t k = 0; k < busy.size(); ++k)
+	{
+		Region &region = *regions[busy[k]];
+		std::unique_lock<std::mutex> guard(region.lock);
+		if (InsertIntoRegion(region, width, height, depth, newNode))
+		{
+			guard.unlock();
+			AddUsed(newNode);
+			return newNode;
+		}
+	}
+
+	// No region could take the box on its own, so try to place it across regions.
+	for(int attempt = 0; attempt <= optimisticAttempts; ++attempt)
+	{
+		CrossRegionResult result = InsertAcrossRegions(width, height, depth, attempt == optimisticAttempts, newNode);
+		if (result == CrossRegionPlaced)
+		{
+			AddUsed(newNode);
+			return newNode;
+		}
+		if (result == CrossRegionNoSpace)
+			break;
+	}
+
+	memset(&newNode, 0, sizeof(Rect3d));
+	return newNode;
+}
+
+std::vector<Rect3d> ConcurrentBinPack3d::GetUsedRectangles() const
+{
+	std::lock_guard<std::mutex> guard(usedLock);
+	return usedRectangles;
+}
+
+float ConcurrentBinPack3d::Occupancy() const
+{
+	return (float)usedVolume.load() / ((unsigned long)binWidth * binHeight * binDepth);
+}
+
+}
@@ -0,0 +1,145 @@
+/** @file DominanceCounter3d.cpp
+	@brief Counts how many pending boxes fit into a given box in polylogarithmic time.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#include <algorithm>
+
+#include <cassert>
+
+#include "../include/DominanceCounter3d.h"
+
+namespace rbp {
+
+using namespace std;
+
+namespace {
+
+/// @return The number of elements in the sorted vector v that are <= value.
+int CountNotGreater(const std::vector<int> &v, int value)
+{
+	return (int)(upper_bound(v.begin(), v.end(), value) - v.begin());
+}
+
+void SortUnique(std::vector<int> &v)
+{
+	sort(v.begin(), v.end());
+	v.erase(unique(v.begin(), v.end()), v.end());
+}
+
+}
+
+DominanceCounter3d::DominanceCounter3d()
+:numPresent(0)
+{
+}
+
+DominanceCounter3d::CanonicalBox DominanceCounter3d::Canonical(int width, int height, int depth)
+{
+	CanonicalBox c;
+	c.shortSide = min(width, height);
+	c.longSide = max(width, height);
+	c.depth = depth;
+	return c;
+}
+
+void DominanceCounter3d::Build(const std::vector<RectSize3d> &boxes)
+{
+	std::vector<CanonicalBox> points;
+	points.reserve(boxes.size());
+	for(size_t i = 0; i < boxes.size(); ++i)
+		points.push_back(Canonical(boxes[i].width, boxes[i].height, boxes[i].depth));
+
+	shortSides.clear();
+	for(size_t i = 0; i < points.size(); ++i)
+		shortSides.push_back(points[i].shortSide);
+	SortUnique(shortSides);
+
+	outer.clear();
+	outer.resize(shortSides.size() + 1);
+
+	// First pass: collect the long sides that land in each outer node.
+	for(size_t p = 0; p < points.size(); ++p)
+		for(int i = CountNotGreater(shortSides, points[p].shortSide); i < (int)outer.size(); i += i & -i)
+			outer[i].longSides.push_back(points[p].longSide);
+
+	for(size_t i = 1; i < outer.size(); ++i)
+	{
+		SortUnique(outer[i].longSides);
+		outer[i].inner.resize(outer[i].longSides.size() + 1);
+	}
+
+	// Second pass: collect the depths that land in each inner node.
+	for(size_t p = 0; p < points.size(); ++p)
+		for(int i = CountNotGreater(shortSides, points[p].shortSide); i < (int)outer.size(); i += i & -i)
+		{
+			OuterNode &node = outer[i];
+			for(int j = CountNotGreater(node.longSides, points[p].longSide); j < (int)node.inner.size(); j += j & -j)
+				node.inner[j].depths.push_back(points[p].depth);
+		}
+
+	for(size_t i = 1; i < outer.size(); ++i)
+		for(size_t j = 1; j < outer[i].inner.size(); ++j)
+		{
+			InnerNode &node = outer[i].inner[j];
+			SortUnique(node.depths);
+			node.tree.assign(node.depths.size() + 1, 0);
+		}
+
+	exactCounts.clear();
+	numPresent = 0;
+	for(size_t p = 0; p < points.size(); ++p)
+		Update(points[p], 1);
+}
+
+void DominanceCounter3d::Update(const CanonicalBox &box, int delta)
+{
+	for(int i = CountNotGreater(shortSides, box.shortSide); i < (int)outer.size(); i += i & -i)
+	{
+		OuterNode &node = outer[i];
+		for(int j = CountNotGreater(node.longSides, box.longSide); j < (int)node.inner.size(); j += j & -j)
+		{
+			InnerNode &inner = node.inner[j];
+			for(int k = CountNotGreater(inner.depths, box.depth); k < (int)inner.tree.size(); k += k & -k)
+				inner.tree[k] += delta;
+		}
+	}
+	exactCounts[box] += delta;
+	numPresent += delta;
+}
+
+void DominanceCounter3d::Remove(const RectSize3d &box)
+{
+	CanonicalBox c = Canonical(box.width, box.height, box.depth);
+	debug_assert(exactCounts.count(c) && exactCounts[c] > 0);
+	Update(c, -1);
+}
+
+void DominanceCounter3d::Add(const RectSize3d &box)
+{
+	Update(Canonical(box.width, box.height, box.depth), 1);
+}
+
+int DominanceCounter3d::CountFitting(int width, int height, int depth) const
+{
+	CanonicalBox c = Canonical(width, height, depth);
+	int count = 0;
+	for(int i = CountNotGreater(shortSides, c.shortSide); i > 0; i -= i & -i)
+	{
+		const OuterNode &node = outer[i];
+		for(int j = CountNotGreater(node.longSides, c.longSide); j > 0; j -= j & -j)
+		{
+			const InnerNode &inner = node.inner[j];
+			for(int k = CountNotGreater(inner.depths, c.depth); k > 0; k -= k & -k)
+				count += inner.tree[k];
+		}
+	}
+	return count;
+}
+
+int DominanceCounter3d::CountPerfectFits(int width, int height, int depth) const
+{
+	std::map<CanonicalBox, int>::const_iterator iter = exactCounts.find(Canonical(width, height, depth));
+	return iter != exactCounts.end() ? iter->second : 0;
+}
+
+}
@@ -0,0 +1,216 @@
+/** @file FreeSpaceTree3d.cpp
+	@brief A binary space partition over disjoint free boxes with per-subtree maxima, for first-fit queries.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#include <algorithm>
+
+#include "../include/FreeSpaceTree3d.h"
+
+namespace rbp {
+
+using namespace std;
+
+namespace {
+
+/// The bottom-up order of the free boxes. Disjoint boxes never share a corner, so the order is strict.
+bool CornerBefore(const Rect3d &a, const Rect3d &b)
+{
+	if (a.z != b.z) return a.z < b.z;
+	if (a.y != b.y) return a.y < b.y;
+	return a.x < b.x;
+}
+
+bool FitsInto(const Rect3d &freeRect, int width, int height, int depth)
+{
+	if (depth > freeRect.depth)
+		return false;
+	return (width <= freeRect.width && height <= freeRect.height) ||
+		(height <= freeRect.width && width <= freeRect.height);
+}
+
+}
+
+FreeSpaceTree3d::FreeSpaceTree3d()
+:root(-1),
+seed(2463534242u)
+{
+}
+
+void FreeSpaceTree3d::Clear()
+{
+	nodes.clear();
+	freeNodes.clear();
+	root = -1;
+}
+
+unsigned int FreeSpaceTree3d::NextPriority()
+{
+	// xorshift32
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+int FreeSpaceTree3d::NewNode(const Rect3d &rect)
+{
+	Node node;
+	node.rect = rect;
+	node.priority = NextPriority();
+	node.left = -1;
+	node.right = -1;
+	node.maxWidth = rect.width;
+	node.maxHeight = rect.height;
+	node.maxDepth = rect.depth;
+	node.maxVolume = (long long)rect.width * rect.height * rect.depth;
+	if (freeNodes.empty())
+	{
+		nodes.push_back(node);
+		return (int)nodes.size() - 1;
+	}
+	int index = freeNodes.back();
+	freeNodes.pop_back();
+	nodes[index] = node;
+	return index;
+}
+
+void FreeSpaceTree3d::Update(int node)
+{
+	Node &n = nodes[node];
+	n.maxWidth = n.rect.width;
+	n.maxHeight = n.rect.height;
+	n.maxDepth = n.rect.depth;
+	n.maxVolume = (long long)n.rect.width * n.rect.height * n.rect.depth;
+	const int children[2] = { n.left, n.right };
+	for(int c = 0; c < 2; ++c)
+	{
+		if (children[c] < 0)
+			continue;
+		const Node &child = nodes[children[c]];
+		n.maxWidth = max(n.maxWidth, child.maxWidth);
+		n.maxHeight = max(n.maxHeight, child.maxHeight);
+		n.maxDepth = max(n.maxDepth, child.maxDepth);
+		n.maxVolume = max(n.maxVolume, child.maxVolume);
+	}
+}
+
+void FreeSpaceTree3d::Build(const std::vector<Rect3d> &sortedRects)
+{
+	Clear();
+	nodes.reserve(sortedRects.size());
+
+	// Builds the Cartesian tree of the priorities in one pass: the right spine of the tree built so far is kept
+	// on a stack, and each new node takes over the part of the spine with lower priorities as its left subtree.
+	std::vector<int> spine;
+	for(size_t i = 0; i < sortedRects.size(); ++i)
+	{
+		const int node = NewNode(sortedRects[i]);
+		int last = -1;
+		while(!spine.empty() && nodes[spine.back()].priority < nodes[node].priority)
+		{
+			last = spine.back();
+			spine.pop_back();
+			Update(last);
+		}
+		nodes[node].left = last;
+		if (!spine.empty())
+			nodes[spine.back()].right = node;
+		spine.push_back(node);
+	}
+	// What is left of the spine only got its right children now, update it bottom-up.
+	for(size_t i = spine.size(); i-- > 0;)
+		Update(spine[i]);
+	root = spine.empty() ? -1 : spine[0];
+}
+
+void FreeSpaceTree3d::Split(int t, const Rect3d &rect, bool orEqual, int &left, int &right)
+{
+	if (t < 0)
+	{
+		left = right = -1;
+		return;
+	}
+	const Rect3d &key = nodes[t].rect;
+	const bool goesLeft = CornerBefore(key, rect) || (orEqual && !CornerBefore(rect, key));
+	if (goesLeft)
+	{
+		Split(nodes[t].right, rect, orEqual, nodes[t].right, right);
+		left = t;
+	}
+	else
+	{
+		Split(nodes[t].left, rect, orEqual, left, nodes[t].left);
+		right = t;
+	}
+	Update(t);
+}
+
+int FreeSpaceTree3d::Merge(int left, int right)
+{
+	if (left < 0)
+		return right;
+	if (right < 0)
+		return left;
+	if (nodes[left].priority > nodes[right].priority)
+	{
+		nodes[left].right = Merge(nodes[left].right, right);
+		Update(left);
+		return left;
+	}
+	nodes[right].left = Merge(left, nodes[right].left);
+	Update(right);
+	return right;
+}
+
+void FreeSpaceTree3d::Insert(const Rect3d &rect)
+{
+	int left, right;
+	Split(root, rect, false, left, right);
+	root = Merge(Merge(left, NewNode(rect)), right);
+}
+
+bool FreeSpaceTree3d::Erase(const Rect3d &rect)
+{
+	int left, middle, right;
+	Split(root, rect, false, left, right);
+	Split(right, rect, true, middle, right);
+	root = Merge(left, right);
+	if (middle < 0)
+		return false;
+	// Corners are unique, so middle is a single node.
+	freeNodes.push_back(middle);
+	return true;
+}
+
+bool FreeSpaceTree3d::MayHold(int node, int width, int height, int depth, long long volume) const
+{
+	const Node &n = nodes[node];
+	if (depth > n.maxDepth || volume > n.maxVolume)
+		return false;
+	return (width <= n.maxWidth && height <= n.maxHeight) || (height <= n.maxWidth && width <= n.maxHeight);
+}
+
+int FreeSpaceTree3d::FindFirstFit(int node, int width, int height, int depth, long long volume) const
+{
+	if (node < 0 || !MayHold(node, width, height, depth, volume))
+		return -1;
+	int found = FindFirstFit(nodes[node].left, width, height, depth, volume);
+	if (found >= 0)
+		return found;
+	if (FitsInto(nodes[node].rect, width, height, depth))
+		return node;
+	return FindFirstFit(nodes[node].right, width, height, depth, volume);
+}
+
+const Rect3d *FreeSpaceTree3d::FindFirstFit(int width, int height, int depth) const
+{
+	const int node = FindFirstFit(root, width, height, depth, (long long)width * height * depth);
+	return node >= 0 ? &nodes[node].rect : 0;
+}
+
+size_t FreeSpaceTree3d::MemoryBytes() const
+{
+	return nodes.capacity() * sizeof(Node) + freeNodes.capacity() * sizeof(int);
+}
+
+}
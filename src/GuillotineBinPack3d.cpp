@@ -18,6 +18,133 @@ namespace rbp {
 
 using namespace std;
 
+namespace {
+
+/// The fields two rectangles must agree on to merge along an axis, and their position and size along it.
+struct MergeAxis
+{
+	int Rect3d::*key[4];
+	int Rect3d::*position;
+	int Rect3d::*size;
+};
+
+const MergeAxis mergeAxes[3] =
+{
+	{ { &Rect3d::x, &Rect3d::z, &Rect3d::width, &Rect3d::depth }, &Rect3d::y, &Rect3d::height },
+	{ { &Rect3d::y, &Rect3d::z, &Rect3d::height, &Rect3d::depth }, &Rect3d::x, &Rect3d::width },
+	{ { &Rect3d::x, &Rect3d::y, &Rect3d::width, &Rect3d::height }, &Rect3d::z, &Rect3d::depth }
+};
+
+bool SameMergeKey(const Rect3d &a, const Rect3d &b, const MergeAxis &axis)
+{
+	for(int i = 0; i < 4; ++i)
+		if (a.*axis.key[i] != b.*axis.key[i])
+			return false;
+	return true;
+}
+
+/// TryInsertBatch matches tiles of this many boxes against blocks of this many free rectangles, so that a block
+/// stays in L1 cache while all boxes of the tile are tested against it.
+const size_t batchTileBoxes = 16;
+const size_t batchBlockRects = 256;
+
+/// Below this many pairs of boxes and free rectangles, TryInsertBatch does not wake up the thread pool.
+const size_t minParallelBatchPairs = 1 << 16;
+
+/// Sets fits[k] to 1 if a width x height x depth box fits into free rectangle k in either orientation, and to 0
+/// otherwise. Branch free over flat arrays, so that the compiler vectorizes it.
+void FitBlock(const int *widths, const int *heights, const int *depths, size_t count, int width, int height,
+	int depth, unsigned char *fits)
+{
+	for(size_t k = 0; k < count; ++k)
+		fits[k] = (unsigned char)((depth <= depths[k]) & (((width <= widths[k]) & (height <= heights[k])) |
+			((height <= widths[k]) & (width <= heights[k]))));
+}
+
+/// Sorts by the merge key of an axis, then by the position along it.
+struct MergeKeyOrder
+{
+	const MergeAxis *axis;
+
+	bool operator()(const Rect3d &a, const Rect3d &b) const
+	{
+		for(int i = 0; i < 4; ++i)
+			if (a.*axis->key[i] != b.*axis->key[i])
+				return a.*axis->key[i] < b.*axis->key[i];
+		return a.*axis->position < b.*axis->position;
+	}
+};
+
+unsigned int HashMergeKey(const Rect3d &r, const MergeAxis &axis)
+{
+	unsigned int hash = 2166136261u;
+	for(int i = 0; i < 4; ++i)
+		hash = (hash ^ (unsigned int)(r.*axis.key[i])) * 16777619u;
+	return hash ^ (hash >> 15);
+}
+
+/// Sorts rects[begin, end) by merge key and coalesces the touching rectangles of each key group into the first
+/// of them. The merged-away rectangles are left behind with a zero width.
+void CoalescePartition(std::vector<Rect3d> &rects, size_t begin, size_t end, const MergeAxis &axis)
+{
+	MergeKeyOrder order = { &axis };
+	std::sort(rects.begin() + begin, rects.begin() + end, order);
+
+	size_t last = begin;
+	for(size_t i = begin + 1; i < end; ++i)
+	{
+		Rect3d &r = rects[i];
+		Rect3d &l = rects[last];
+		if (SameMergeKey(l, r, axis) && l.*axis.position + l.*axis.size == r.*axis.position)
+		{
+			l.*axis.size += r.*axis.size;
+			r.width = 0;
+		}
+		else
+			last = i;
+	}
+}
+
+/// Runs one merge pass along the given axis.
+/// @return True if anything was merged.
+bool MergePass(std::vector<Rect3d> &rects, std::vector<Rect3d> &scratch, std::vector<size_t> &partitionStart,
+	const MergeAxis &axis, ThreadPool *pool)
+{
+	const size_t numRects = rects.size();
+	const int numPartitions = (pool && pool->NumThreads() > 1 && numRects >= 256) ? pool->NumThreads() * 4 : 1;
+
+	if (numPartitions == 1)
+		CoalescePartition(rects, 0, numRects, axis);
+	else
+	{
+		// Counting sort by the partition of the key, so that every key group lands in a single partition.
+		partitionStart.assign(numPartitions + 1, 0);
+		for(size_t i = 0; i < numRects; ++i)
+			++partitionStart[HashMergeKey(rects[i], axis) % numPartitions + 1];
+		for(int p = 0; p < numPartitions; ++p)
+			partitionStart[p + 1] += partitionStart[p];
+		scratch.resize(numRects);
+		std::vector<size_t> next(partitionStart.begin(), partitionStart.end() - 1);
+		for(size_t i = 0; i < numRects; ++i)
+			scratch[next[HashMergeKey(rects[i], axis) % numPartitions]++] = rects[i];
+		rects.swap(scratch);
+
+		pool->ParallelFor(numPartitions, [&](int p, int)
+		{
+			CoalescePartition(rects, partitionStart[p], partitionStart[p + 1], axis);
+		});
+	}
+
+	size_t kept = 0;
+	for(size_t i = 0; i < numRects; ++i)
+		if (rects[i].width > 0)
+			rects[kept++] = rects[i];
+	rects.resize(kept);
+	return kept < numRects;
+}
+
+}
+
 GuillotineBinPack3d::GuillotineBinPack3d()
 :binWidth(0),
 binHeight(0),
@@ -42,6 +169,9 @@ void GuillotineBinPack3d::Init(int width, int height, int depth)
 
 	// Clear any memory of previously packed rectangles.
 	usedRectangles.clear();
+	usedVolume = 0;
+	mergeCursor = 0;
+	freeListFullyMerged = true;
 
 	// We start with a single big free rectangle that spans the whole bin.
 	Rect3d n;
@@ -54,11 +184,84 @@ void GuillotineBinPack3d::Init(int width, int height, int depth)
 
 	freeRectangles.clear();
 	freeRectangles.push_back(n);
+	quarantinedRectangles.clear();
+	RebuildFreeLevels();
+}
+
+void GuillotineBinPack3d::SetMinItemSize(int minWidth, int minHeight, int minDepth)
+{
+	minItemWidth = minWidth;
+	minItemHeight = minHeight;
+	minItemDepth = minDepth;
+	seenItemSize = false;
+
+	// The new size may be smaller than before.
+	ReleaseQuarantine();
+}
+
+bool GuillotineBinPack3d::CanHoldMinItem(const Rect3d &freeRect) const
+{
+	if (freeRect.depth < minItemDepth)
+		return false;
+	return (freeRect.width >= minItemWidth && freeRect.height >= minItemHeight) ||
+		(freeRect.width >= minItemHeight && freeRect.height >= minItemWidth);
+}
+
+void GuillotineBinPack3d::AddFreeRect(const Rect3d &freeRect)
+{
+	if (CanHoldMinItem(freeRect))
+		InsertFreeRectSorted(freeRect);
+	else
+		quarantinedRectangles.push_back(freeRect);
+}
+
+void GuillotineBinPack3d::ObserveItemSize(int width, int height, int depth)
+{
+	if (!learnMinItemSize)
+		return;
+
+	if (!seenItemSize)
+	{
+		// The first item replaces whatever was configured before.
+		seenItemSize = true;
+		minItemWidth = min(width, height);
+		minItemHeight = max(width, height);
+		minItemDepth = depth;
+		ReleaseQuarantine();
+		return;
+	}
+
+	// Items may come rotated in the XOY plane, so keep the short side in minItemWidth.
+	int shortSide = min(width, height);
+	int longSide = max(width, height);
+	if (shortSide < minItemWidth || longSide < minItemHeight || depth < minItemDepth)
+	{
+		minItemWidth = min(minItemWidth, shortSide);
+		minItemHeight = min(minItemHeight, longSide);
+		minItemDepth = min(minItemDepth, depth);
+		ReleaseQuarantine();
+	}
+}
+
+void GuillotineBinPack3d::ReleaseQuarantine()
+{
+	size_t kept = 0;
+	for(size_t i = 0; i < quarantinedRectangles.size(); ++i)
+	{
+		if (CanHoldMinItem(quarantinedRectangles[i]))
+			InsertFreeRectSorted(quarantinedRectangles[i]);
+		else
+			quarantinedRectangles[kept++] = quarantinedRectangles[i];
+	}
+	quarantinedRectangles.resize(kept);
 }
 
 void GuillotineBinPack3d::Insert(std::vector<RectSize3d> &rects, bool merge, 
 	FreeRectChoiceHeuristic rectChoice, GuillotineSplitHeuristic splitMethod)
 {
+	for(size_t i = 0; i < rects.size(); ++i)
+		ObserveItemSize(rects[i].width, rects[i].height, rects[i].depth);
+
 	// Remember variables about the best packing choice we have made so far during the iteration process.
 	int bestFreeRect = 0;
 	int bestRect = 0;
@@ -140,7 +343,7 @@ void GuillotineBinPack3d::Insert(std::vector<RectSize3d> &rects, bool merge,
 
 		// Remove the free space we lost in the bin.
 		SplitFreeRectByHeuristic(freeRectangles[bestFreeRect], newNode, splitMethod);
-		freeRectangles.erase(freeRectangles.begin() + bestFreeRect);
+		EraseFreeRect(bestFreeRect);
 
 		// Remove the rectangle we just packed from the input list.
 		rects.erase(rects.begin() + bestRect);
@@ -151,6 +354,7 @@ void GuillotineBinPack3d::Insert(std::vector<RectSize3d> &rects, bool merge,
 
 		// Remember the new used rectangle.
 		usedRectangles.push_back(newNode);
+		usedVolume += (unsigned long)newNode.width * newNode.height * newNode.depth;
 
 		// Check that we're really producing correct packings here.
 		debug_assert(disjointRects.Add(newNode) == true);
@@ -171,81 +375,84 @@ bool FitsPerfectly(const RectSize3d &r, const Rect3d &freeRect)
 		(r.height == freeRect.width && r.width == freeRect.height && r.depth == freeRect.depth);
 }
 
-/*
 // A helper function for GUILLOTINE-MAXFITTING. Counts how many rectangles fit into the given rectangle
 // after it has been split.
-void CountNumFitting(const Rect &freeRect, int width, int height, const std::vector<RectSize> &rects, 
-	int usedRectIndex, bool splitHorizontal, int &score1, int &score2)
+void GuillotineBinPack3d::CountNumFitting(const Rect3d &freeRect, int width, int height, int depth, const RectSize3d &usedRect,
+	bool splitHorizontal, const DominanceCounter3d &fitCounter, int &score1, int &score2)
 {
-	const int w = freeRect.width - width;
-	const int h = freeRect.height - height;
-	Rect bottom;
-	bottom.x = freeRect.x;
-	bottom.y = freeRect.y + height;
-	bottom.height = h;
-	Rect right;
-	right.x = freeRect.x + width;
-	right.y = freeRect.y;
-	right.width = w;
-	if (splitHorizontal)
-	{
-		bottom.width = freeRect.width;
-		right.height = height;
-	}
-	else // Split vertically
+	Rect3d placed;
+	placed.x = freeRect.x;
+	placed.y = freeRect.y;
+	placed.z = freeRect.z;
+	placed.width = width;
+	placed.height = height;
+	placed.depth = depth;
+
+	Rect3d parts[3];
+	ComputeSplit(freeRect, placed, splitHorizontal, parts[0], parts[1], parts[2]);
+
+	score1 = std::numeric_limits<int>::max();
+	score2 = 0;
+	for(int i = 0; i < 3; ++i)
 	{
-		bottom.width = width;
-		right.height = freeRect.height;
+		const Rect3d &part = parts[i];
+		if (part.width <= 0 || part.height <= 0 || part.depth <= 0)
+			continue;
+
+		// The rectangle being placed is still in the counter, so take it out of the counts by hand.
+		int fit = fitCounter.CountFitting(part.width, part.height, part.depth) - (Fits(usedRect, part) ? 1 : 0);
+		int perfect = fitCounter.CountPerfectFits(part.width, part.height, part.depth) - (FitsPerfectly(usedRect, part) ? 1 : 0);
+		if (perfect > 0)
+			fit |= 0x10000000;
+
+		score1 = min(score1, fit);
+		score2 = max(score2, fit);
 	}
-	int fitBottom = 0;
-	int fitRight = 0;
-	for(size_t i = 0; i < rects.size(); ++i)
-		if (i != usedRectIndex)
-		{
-			if (FitsPerfectly(rects[i], bottom))
-				fitBottom |= 0x10000000;
-			if (FitsPerfectly(rects[i], right))
-				fitRight |= 0x10000000;
-			if (Fits(rects[i], bottom))
-				++fitBottom;
-			if (Fits(rects[i], right))
-				++fitRight;
-		}
-	score1 = min(fitBottom, fitRight);
-	score2 = max(fitBottom, fitRight);
+	// Nothing is left over at all.
+	if (score1 == std::numeric_limits<int>::max())
+		score1 = 0;
 }
-*/
-/*
+
 // Implements GUILLOTINE-MAXFITTING, an experimental heuristic that's really cool but didn't quite work in practice.
-void GuillotineBinPack::InsertMaxFitting(std::vector<RectSize> &rects, std::vector<Rect> &dst, bool merge, 
-	FreeRectChoiceHeuristic rectChoice, GuillotineSplitHeuristic splitMethod)
+void GuillotineBinPack3d::InsertMaxFitting(std::vector<RectSize3d> &rects, std::vector<Rect3d> &dst, bool merge)
 {
 	dst.clear();
 	int bestRect = 0;
 	bool bestFlipped = false;
 	bool bestSplitHorizontal = false;
+
+	for(size_t i = 0; i < rects.size(); ++i)
+		ObserveItemSize(rects[i].width, rects[i].height, rects[i].depth);
+
+	DominanceCounter3d fitCounter;
+	fitCounter.Build(rects);
+
 	// Pick rectangles one at a time and pack the one that leaves the most choices still open.
 	while(rects.size() > 0 && freeRectangles.size() > 0)
 	{
 		int bestScore1 = -1;
 		int bestScore2 = -1;
-		///\todo Different sort predicates.
-		clb::sort::QuickSort(&freeRectangles[0], freeRectangles.size(), CompareRectShortSide);
-		Rect &freeRect = freeRectangles[0];
+		// Fill the free rectangle with the shortest side first. Finding it with a scan keeps the free list in the
+		// bottom-up order that EraseFreeRect and InsertFreeRectSorted rely on.
+		size_t freeIndex = 0;
+		for(size_t i = 1; i < freeRectangles.size(); ++i)
+			if (CompareRectShortSide3d(freeRectangles[i], freeRectangles[freeIndex]) < 0)
+				freeIndex = i;
+		const Rect3d freeRect = freeRectangles[freeIndex];
 		for(size_t j = 0; j < rects.size(); ++j)
 		{
 			int score1;
 			int score2;
-			if (rects[j].width == freeRect.width && rects[j].height == freeRect.height)
+			if (rects[j].width == freeRect.width && rects[j].height == freeRect.height && rects[j].depth == freeRect.depth)
 			{
 				bestRect = j;
 				bestFlipped = false;
 				bestScore1 = bestScore2 = std::numeric_limits<int>::max();
 				break;
 			}
-			else if (rects[j].width <= freeRect.width && rects[j].height <= freeRect.height)
+			else if (rects[j].width <= freeRect.width && rects[j].height <= freeRect.height && rects[j].depth <= freeRect.depth)
 			{
-				CountNumFitting(freeRect, rects[j].width, rects[j].height, rects, j, false, score1, score2);
+				CountNumFitting(freeRect, rects[j].width, rects[j].height, rects[j].depth, rects[j], false, fitCounter, score1, score2);
 				if (score1 > bestScore1 || (score1 == bestScore1 && score2 > bestScore2))
 				{
 					bestRect = j;
@@ -254,7 +461,7 @@ void GuillotineBinPack::InsertMaxFitting(std::vector<RectSize> &rects, std::vect
 					bestFlipped = false;
 					bestSplitHorizontal = false;
 				}
-				CountNumFitting(freeRect, rects[j].width, rects[j].height, rects, j, true, score1, score2);
+				CountNumFitting(freeRect, rects[j].width, rects[j].height, rects[j].depth, rects[j], true, fitCounter, score1, score2);
 				if (score1 > bestScore1 || (score1 == bestScore1 && score2 > bestScore2))
 				{
 					bestRect = j;
@@ -264,16 +471,16 @@ void GuillotineBinPack::InsertMaxFitting(std::vector<RectSize> &rects, std::vect
 					bestSplitHorizontal = true;
 				}
 			}
-			if (rects[j].height == freeRect.width && rects[j].width == freeRect.height)
+			if (rects[j].height == freeRect.width && rects[j].width == freeRect.height && rects[j].depth == freeRect.depth)
 			{
 				bestRect = j;
 				bestFlipped = true;
 				bestScore1 = bestScore2 = std::numeric_limits<int>::max();
 				break;
 			}
-			else if (rects[j].height <= freeRect.width && rects[j].width <= freeRect.height)
+			else if (rects[j].height <= freeRect.width && rects[j].width <= freeRect.height && rects[j].depth <= freeRect.depth)
 			{
-				CountNumFitting(freeRect, rects[j].height, rects[j].width, rects, j, false, score1, score2);
+				CountNumFitting(freeRect, rects[j].height, rects[j].width, rects[j].depth, rects[j], false, fitCounter, score1, score2);
 				if (score1 > bestScore1 || (score1 == bestScore1 && score2 > bestScore2))
 				{
 					bestRect = j;
@@ -282,7 +489,7 @@ void GuillotineBinPack::InsertMaxFitting(std::vector<RectSize> &rects, std::vect
 					bestFlipped = true;
 					bestSplitHorizontal = false;
 				}
-				CountNumFitting(freeRect, rects[j].height, rects[j].width, rects, j, true, score1, score2);
+				CountNumFitting(freeRect, rects[j].height, rects[j].width, rects[j].depth, rects[j], true, fitCounter, score1, score2);
 				if (score1 > bestScore1 || (score1 == bestScore1 && score2 > bestScore2))
 				{
 					bestRect = j;
@@ -293,56 +500,445 @@ void GuillotineBinPack::InsertMaxFitting(std::vector<RectSize> &rects, std::vect
 				}
 			}
 		}
+
+		// The free rectangle is consumed either way: split into the leftovers, or abandoned if nothing fits.
+		EraseFreeRect(freeIndex);
+
 		if (bestScore1 >= 0)
 		{
-			Rect newNode;
+			Rect3d newNode;
 			newNode.x = freeRect.x;
 			newNode.y = freeRect.y;
+			newNode.z = freeRect.z;
 			newNode.width = rects[bestRect].width;
 			newNode.height = rects[bestRect].height;
+			newNode.depth = rects[bestRect].depth;
 			if (bestFlipped)
 				std::swap(newNode.width, newNode.height);
-			assert(disjointRects.Disjoint(newNode));
+			debug_assert(disjointRects.Disjoint(newNode));
 			SplitFreeRectAlongAxis(freeRect, newNode, bestSplitHorizontal);
+			fitCounter.Remove(rects[bestRect]);
 			rects.erase(rects.begin() + bestRect);
 			if (merge)
 				MergeFreeList();
 			usedRectangles.push_back(newNode);
+			usedVolume += (unsigned long)newNode.width * newNode.height * newNode.depth;
+			dst.push_back(newNode);
 #ifdef _DEBUG
 			disjointRects.Add(newNode);
 #endif
 		}
-		freeRectangles.erase(freeRectangles.begin());
 	}
 }
-*/
 
 Rect3d GuillotineBinPack3d::Insert(int width, int height, int depth, bool merge, FreeRectChoiceHeuristic rectChoice, 
 	GuillotineSplitHeuristic splitMethod)
 {
+	return Insert(width, height, depth, merge ? MergeAlways : MergeNever, rectChoice, splitMethod);
+}
+
+Rect3d GuillotineBinPack3d::Insert(int width, int height, int depth, MergePolicy mergePolicy, FreeRectChoiceHeuristic rectChoice, 
+	GuillotineSplitHeuristic splitMethod)
+{
+	return InsertWithPolicy(width, height, depth, mergePolicy, rectChoice, splitMethod, false);
+}
+
+Rect3d GuillotineBinPack3d::InsertAdaptive(int width, int height, int depth, MergePolicy mergePolicy)
+{
+	// Sample at the configured rate without drawing random numbers, so that runs stay reproducible.
+	adaptiveSampleCredit += adaptiveSampleRate;
+	bool scoreSplit = adaptiveSampleCredit >= 1.f && !recentItems.empty();
+	if (adaptiveSampleCredit >= 1.f)
+		adaptiveSampleCredit -= 1.f;
+
+	Rect3d newRect = InsertWithPolicy(width, height, depth, mergePolicy, RectBestShortSideFit,
+		GetAdaptiveSplitHeuristic(), scoreSplit);
+
+	// Remember the size after scoring, so that the box does not score the room it is placed into.
+	RectSize3d item;
+	item.width = width;
+	item.height = height;
+	item.depth = depth;
+	if (recentItems.size() < recentItemsCapacity)
+		recentItems.push_back(item);
+	else
+		recentItems[recentItemsNext] = item;
+	recentItemsNext = (recentItemsNext + 1) % recentItemsCapacity;
+
+	return newRect;
+}
+
+void GuillotineBinPack3d::SetAdaptiveParameters(float sampleRate, int historySize, float discount, float exploration)
+{
+	assert(sampleRate >= 0.f && sampleRate <= 1.f);
+	assert(historySize > 0);
+	adaptiveSampleRate = sampleRate;
+	splitBandit.SetParameters(discount, exploration);
+
+	recentItemsCapacity = historySize;
+	recentItems.clear();
+	recentItemsNext = 0;
+}
+
+void GuillotineBinPack3d::ScoreSplitInShadow(const Rect3d &freeRect, const Rect3d &placedRect)
+{
+	const int arm = splitBandit.SelectToExplore();
+	const GuillotineSplitHeuristic method = (GuillotineSplitHeuristic)arm;
+
+	// Replay the recent boxes into what the heuristic leaves of freeRect, with first fit and the same heuristic
+	// for every later split. The reward is the share of freeRect that ends up filled.
+	std::vector<Rect3d> &shadowFree = shadowFreeRectangles;
+	shadowFree.clear();
+	unsigned long filledVolume = (unsigned long)placedRect.width * placedRect.height * placedRect.depth;
+	Rect3d parts[3];
+	ComputeSplit(freeRect, placedRect, ChooseSplitAxis(freeRect, placedRect, method), parts[0], parts[1], parts[2]);
+	for(int p = 0; p < 3; ++p)
+		if (parts[p].width > 0 && parts[p].height > 0 && parts[p].depth > 0)
+			shadowFree.push_back(parts[p]);
+
+	for(size_t i = 0; i < recentItems.size() && !shadowFree.empty(); ++i)
+	{
+		const RectSize3d &item = recentItems[i];
+		for(size_t j = 0; j < shadowFree.size(); ++j)
+		{
+			Rect3d placed = shadowFree[j];
+			if (item.depth > placed.depth)
+				continue;
+			if (item.width <= placed.width && item.height <= placed.height)
+			{
+				placed.width = item.width;
+				placed.height = item.height;
+			}
+			else if (item.height <= placed.width && item.width <= placed.height)
+			{
+				placed.width = item.height;
+				placed.height = item.width;
+			}
+			else
+				continue;
+			placed.depth = item.depth;
+
+			const Rect3d container = shadowFree[j];
+			shadowFree[j] = shadowFree.back();
+			shadowFree.pop_back();
+			ComputeSplit(container, placed, ChooseSplitAxis(container, placed, method), parts[0], parts[1], parts[2]);
+			for(int p = 0; p < 3; ++p)
+				if (parts[p].width > 0 && parts[p].height > 0 && parts[p].depth > 0)
+					shadowFree.push_back(parts[p]);
+			filledVolume += (unsigned long)placed.width * placed.height * placed.depth;
+			break;
+		}
+	}
+
+	splitBandit.Update(arm, (float)filledVolume / ((float)freeRect.width * freeRect.height * freeRect.depth));
+}
+
+Rect3d GuillotineBinPack3d::InsertWithPolicy(int width, int height, int depth, MergePolicy mergePolicy,
+	FreeRectChoiceHeuristic rectChoice, GuillotineSplitHeuristic splitMethod, bool scoreSplit)
+{
+	ObserveItemSize(width, height, depth);
+
 	// Find where to put the new rectangle.
 	int freeNodeIndex = 0;
 	Rect3d newRect = FindPositionForNewNode(width, height, depth, rectChoice, &freeNodeIndex);
 
+	// With lazy merging the free list may just be too fragmented, so defragment it fully and try again.
+	if (newRect.height == 0 && mergePolicy == MergeLazy && !freeListFullyMerged)
+	{
+		MergeFreeListFull();
+		newRect = FindPositionForNewNode(width, height, depth, rectChoice, &freeNodeIndex);
+	}
+
 	// Abort if we didn't have enough space in the bin.
 	if (newRect.height == 0)
 		return newRect;
 
-	// Remove the space that was just consumed by the new rectangle.
-	SplitFreeRectByHeuristic(freeRectangles[freeNodeIndex], newRect, splitMethod);
-	freeRectangles.erase(freeRectangles.begin() + freeNodeIndex);
+	if (scoreSplit)
+		ScoreSplitInShadow(freeRectangles[freeNodeIndex], newRect);
 
-	// Perform a Rectangle Merge step if desired.
-	if (merge)
-		MergeFreeList();
+	PlaceInFreeRect(freeNodeIndex, newRect, mergePolicy, splitMethod);
+	return newRect;
+}
+
+void GuillotineBinPack3d::FindCandidatePositions(int width, int height, int depth, size_t maxCandidates,
+	std::vector<Rect3d> &candidates) const
+{
+	candidates.clear();
+	for(std::map<int, FreeLevel>::const_iterator level = freeLevels.begin(); level != freeLevels.end(); ++level)
+	{
+		if (!level->second.MayHold(width, height, depth))
+			continue;
+
+		for(size_t i = LevelBegin(level->first); i < freeRectangles.size() && freeRectangles[i].z == level->first; ++i)
+		{
+			// The orientation Insert would pick comes first, then the other one if it fits too.
+			Rect3d node;
+			if (!FindPositionInFreeRect(width, height, depth, i, node))
+				continue;
+			if (candidates.size() >= maxCandidates)
+				return;
+			candidates.push_back(node);
+
+			std::swap(node.width, node.height);
+			if (node.width != node.height && node.width <= freeRectangles[i].width && node.height <= freeRectangles[i].height)
+			{
+				if (candidates.size() >= maxCandidates)
+					return;
+				candidates.push_back(node);
+			}
+		}
+	}
+}
+
+bool GuillotineBinPack3d::InsertAt(const Rect3d &placement, MergePolicy mergePolicy, GuillotineSplitHeuristic splitMethod)
+{
+	// Free rectangles are disjoint, so at most one of them has its corner at the placement.
+	for(size_t i = LevelBegin(placement.z); i < freeRectangles.size() && freeRectangles[i].z == placement.z; ++i)
+	{
+		const Rect3d &freeRect = freeRectangles[i];
+		if (freeRect.x != placement.x || freeRect.y != placement.y)
+			continue;
+		if (placement.width > freeRect.width || placement.height > freeRect.height || placement.depth > freeRect.depth)
+			return false;
+
+		PlaceInFreeRect(i, placement, mergePolicy, splitMethod);
+		// As in Commit, learning from the box before the split could release quarantined rectangles ahead of i.
+		ObserveItemSize(placement.width, placement.height, placement.depth);
+		return true;
+	}
+	return false;
+}
+
+InsertToken GuillotineBinPack3d::TryInsert(int width, int height, int depth, FreeRectChoiceHeuristic rectChoice) const
+{
+	InsertToken token;
+	memset(&token, 0, sizeof(InsertToken));
+	token.packer = this;
+	token.version = freeListVersion;
+	token.score = std::numeric_limits<int>::max();
+
+	if (freeSpaceBackend == FreeSpaceTree)
+	{
+		if (FindPositionInTree(width, height, depth, token.freeRectIndex, token.placement))
+			token.score = ScoreByHeuristic(token.placement.width, token.placement.height, token.placement.depth,
+				freeRectangles[token.freeRectIndex], rectChoice);
+		return token;
+	}
+
+	// The same first fit as FindPositionForNewNode, minus tightening the level bounds on the way.
+	for(std::map<int, FreeLevel>::const_iterator level = freeLevels.begin(); level != freeLevels.end(); ++level)
+	{
+		if (!level->second.MayHold(width, height, depth))
+			continue;
+		for(size_t i = LevelBegin(level->first); i < freeRectangles.size() && freeRectangles[i].z == level->first; ++i)
+			if (FindPositionInFreeRect(width, height, depth, i, token.placement))
+			{
+				token.freeRectIndex = i;
+				token.score = ScoreByHeuristic(token.placement.width, token.placement.height, token.placement.depth,
+					freeRectangles[i], rectChoice);
+				return token;
+			}
+	}
+	return token;
+}
+
+void GuillotineBinPack3d::TryInsertBatch(const std::vector<RectSize3d> &boxes, FreeRectChoiceHeuristic rectChoice,
+	std::vector<InsertToken> &tokens, ThreadPool *pool) const
+{
+	TraceScope trace(traceRecorder, "batch scan");
+	trace.SetArgs("boxes", boxes.size(), "free", freeRectangles.size());
+	InsertToken noFit;
+	memset(&noFit, 0, sizeof(InsertToken));
+	noFit.packer = this;
+	noFit.version = freeListVersion;
+	noFit.score = std::numeric_limits<int>::max();
+	tokens.assign(boxes.size(), noFit);
+
+	// The free list in struct of arrays layout for the fit test. Insert picks the first free rectangle in list
+	// order that the box fits into, so that is the one to find here too.
+	const size_t numFree = freeRectangles.size();
+	std::vector<int> widths(numFree), heights(numFree), depths(numFree);
+	for(size_t i = 0; i < numFree; ++i)
+	{
+		widths[i] = freeRectangles[i].width;
+		heights[i] = freeRectangles[i].height;
+		depths[i] = freeRectangles[i].depth;
+	}
+
+	const size_t numTiles = (boxes.size() + batchTileBoxes - 1) / batchTileBoxes;
+	auto scanTile = [&](int tile, int)
+	{
+		const size_t begin = tile * batchTileBoxes;
+		const size_t end = min(begin + batchTileBoxes, boxes.size());
+		bool found[batchTileBoxes] = {};
+		size_t numOpen = end - begin;
+		unsigned char fits[batchBlockRects];
+		for(size_t block = 0; block < numFree && numOpen > 0; block += batchBlockRects)
+		{
+			const size_t count = min(batchBlockRects, numFree - block);
+			for(size_t b = begin; b < end; ++b)
+			{
+				const RectSize3d &box = boxes[b];
+				if (found[b - begin])
+					continue;
+				FitBlock(&widths[block], &heights[block], &depths[block], count, box.width, box.height, box.depth, fits);
+				const unsigned char *hit = (const unsigned char *)memchr(fits, 1, count);
+				if (!hit)
+					continue;
+
+				const size_t i = block + (hit - fits);
+				InsertToken &token = tokens[b];
+				FindPositionInFreeRect(box.width, box.height, box.depth, i, token.placement);
+				token.freeRectIndex = i;
+				token.score = ScoreByHeuristic(token.placement.width, token.placement.height, token.placement.depth,
+					freeRectangles[i], rectChoice);
+				found[b - begin] = true;
+				--numOpen;
+			}
+		}
+	};
+	if (pool && pool->NumThreads() > 1 && numTiles > 1 && boxes.size() * numFree >= minParallelBatchPairs)
+		pool->ParallelFor((int)numTiles, scanTile);
+	else
+		for(size_t tile = 0; tile < numTiles; ++tile)
+			scanTile((int)tile, 0);
+}
+
+bool GuillotineBinPack3d::Commit(const InsertToken &token, MergePolicy mergePolicy, GuillotineSplitHeuristic splitMethod)
+{
+	if (token.packer != this || token.version != freeListVersion || token.placement.height == 0)
+		return false;
+
+	PlaceInFreeRect(token.freeRectIndex, token.placement, mergePolicy, splitMethod);
+	// Learning from the box only after placing it, since releasing quarantined rectangles would move the free
+	// rectangle the token points at. The placement stays valid, a released rectangle only adds room.
+	ObserveItemSize(token.placement.width, token.placement.height, token.placement.depth);
+	return true;
+}
+
+void GuillotineBinPack3d::PlaceInFreeRect(size_t freeNodeIndex, const Rect3d &newRect, MergePolicy mergePolicy,
+	GuillotineSplitHeuristic splitMethod)
+{
+	{
+		TraceScope trace(traceRecorder, "split");
+		// Remove the space that was just consumed by the new rectangle.
+		SplitFreeRectByHeuristic(freeRectangles[freeNodeIndex], newRect, splitMethod);
+		EraseFreeRect(freeNodeIndex);
+		trace.SetArgs("free", freeRectangles.size(), "quarantined", quarantinedRectangles.size());
+	}
 
 	// Remember the new used rectangle.
 	usedRectangles.push_back(newRect);
+	usedVolume += (unsigned long)newRect.width * newRect.height * newRect.depth;
+
+	// Perform a Rectangle Merge step if desired.
+	if (mergePolicy == MergeAlways)
+		MergeFreeList();
+	else if (mergePolicy == MergeLazy)
+	{
+		MergeFreeListIncremental(lazyMergeSteps);
+		if (Fragmentation() > lazyMergeThreshold)
+			MergeFreeListFull();
+	}
 
 	// Check that we're really producing correct packings here.
 	debug_assert(disjointRects.Add(newRect) == true);
+}
 
-	return newRect;
+bool GuillotineBinPack3d::SubtractRect(const Rect3d &freeRect, const Rect3d &usedRect, std::vector<Rect3d> &out)
+{
+	if (DisjointRectCollection3d::Disjoint(freeRect, usedRect))
+		return false;
+
+	const int x0 = max(freeRect.x, usedRect.x);
+	const int x1 = min(freeRect.x + freeRect.width, usedRect.x + usedRect.width);
+	const int y0 = max(freeRect.y, usedRect.y);
+	const int y1 = min(freeRect.y + freeRect.height, usedRect.y + usedRect.height);
+	const int z0 = max(freeRect.z, usedRect.z);
+	const int z1 = min(freeRect.z + freeRect.depth, usedRect.z + usedRect.depth);
+
+	// Slabs to the left and right of the intersection take the full y and z extent.
+	Rect3d r = freeRect;
+	if (x0 > freeRect.x)
+	{
+		r.width = x0 - freeRect.x;
+		out.push_back(r);
+	}
+	if (x1 < freeRect.x + freeRect.width)
+	{
+		r.x = x1;
+		r.width = freeRect.x + freeRect.width - x1;
+		out.push_back(r);
+	}
+
+	// In between, slabs in front of and behind the intersection take the full z extent.
+	r = freeRect;
+	r.x = x0;
+	r.width = x1 - x0;
+	if (y0 > freeRect.y)
+	{
+		r.height = y0 - freeRect.y;
+		out.push_back(r);
+	}
+	if (y1 < freeRect.y + freeRect.height)
+	{
+		r.y = y1;
+		r.height = freeRect.y + freeRect.height - y1;
+		out.push_back(r);
+	}
+
+	// What remains are the slabs below and above the intersection.
+	r.y = y0;
+	r.height = y1 - y0;
+	if (z0 > freeRect.z)
+	{
+		r.z = freeRect.z;
+		r.depth = z0 - freeRect.z;
+		out.push_back(r);
+	}
+	if (z1 < freeRect.z + freeRect.depth)
+	{
+		r.z = z1;
+		r.depth = freeRect.z + freeRect.depth - z1;
+		out.push_back(r);
+	}
+	return true;
+}
+
+void GuillotineBinPack3d::PlaceRect(const Rect3d &rect)
+{
+	CutFreeList(rect);
+
+	usedRectangles.push_back(rect);
+	usedVolume += (unsigned long)rect.width * rect.height * rect.depth;
+
+	debug_assert(disjointRects.Add(rect) == true);
+}
+
+void GuillotineBinPack3d::CutFreeList(const Rect3d &rect)
+{
+	std::vector<Rect3d> pieces;
+	size_t kept = 0;
+	for(size_t i = 0; i < freeRectangles.size(); ++i)
+		if (!SubtractRect(freeRectangles[i], rect, pieces))
+			freeRectangles[kept++] = freeRectangles[i];
+	if (kept < freeRectangles.size())
+	{
+		// Dropping rectangles keeps the rest in order, only the level bounds need refreshing.
+		freeRectangles.resize(kept);
+		RebuildFreeLevels();
+	}
+
+	kept = 0;
+	for(size_t i = 0; i < quarantinedRectangles.size(); ++i)
+		if (!SubtractRect(quarantinedRectangles[i], rect, pieces))
+			quarantinedRectangles[kept++] = quarantinedRectangles[i];
+	quarantinedRectangles.resize(kept);
+
+	for(size_t i = 0; i < pieces.size(); ++i)
+		AddFreeRect(pieces[i]);
+	if (!pieces.empty())
+		freeListFullyMerged = false;
 }
 
 /// Computes the ratio of used surface area to the total bin area.
@@ -414,26 +1010,53 @@ int GuillotineBinPack3d::ScoreWorstLongSideFit(int width, int height, int depth,
 
 Rect3d GuillotineBinPack3d::FindPositionForNewNode(int width, int height, int depth, FreeRectChoiceHeuristic rectChoice, int *nodeIndex)
 {
+	TraceScope trace(traceRecorder, "scan");
+	trace.SetArgs("free", freeRectangles.size(), "levels", freeLevels.size());
 	Rect3d bestNode;
 	memset(&bestNode, 0, sizeof(Rect3d));
 
-	int bestScore = std::numeric_limits<int>::max();
-	auto sortFreeRectsByZ=[this](const Rect3d& rect1, const Rect3d& rect2){
-		long rect1_hash_val = rect1.x + rect1.y * this->binWidth + rect1.z * this->binWidth * this->binHeight;
-		long rect2_hash_val = rect2.x + rect2.y * this->binWidth + rect2.z * this->binWidth * this->binHeight;
-		return rect1_hash_val < rect2_hash_val;
-	};
+#ifdef DEBUG_BIN_PACK
 	std::cout << "----------------------------------------------" << std::endl;
-	std::sort(std::begin(freeRectangles), std::end(freeRectangles), sortFreeRectsByZ);
-    std::cout << freeRectangles[0].x << "," << freeRectangles[0].y << "," << freeRectangles[0].z << std::endl;
-	if(freeRectangles.size() > 1){
-		std::cout << freeRectangles[1].x << "," << freeRectangles[1].y << "," << freeRectangles[1].z << std::endl;
+	for(size_t i = 0; i < freeRectangles.size() && i < 3; ++i)
+		std::cout << freeRectangles[i].x << "," << freeRectangles[i].y << "," << freeRectangles[i].z << std::endl;
+#endif
+	if (freeSpaceBackend == FreeSpaceTree)
+	{
+		size_t i = 0;
+		if (FindPositionInTree(width, height, depth, i, bestNode))
+			*nodeIndex = (int)i;
+		return bestNode;
 	}
-	if(freeRectangles.size() > 2){
-		std::cout << freeRectangles[2].x << "," << freeRectangles[2].y << "," << freeRectangles[2].z << std::endl;
+
+	// The free list is kept sorted bottom-up, so the first fit is the lowest one. Go through it level by level and
+	// skip the levels whose largest free rectangle is too small.
+	for(std::map<int, FreeLevel>::iterator level = freeLevels.begin(); level != freeLevels.end(); ++level)
+	{
+		if (!level->second.MayHold(width, height, depth))
+			continue;
+
+		FreeLevel exact;
+		memset(&exact, 0, sizeof(FreeLevel));
+		size_t i = LevelBegin(level->first);
+		for(; i < freeRectangles.size() && freeRectangles[i].z == level->first; ++i)
+		{
+			if (FindPositionInFreeRect(width, height, depth, i, bestNode))
+			{
+				*nodeIndex = i;
+				debug_assert(disjointRects.Disjoint(bestNode));
+				return bestNode;
+			}
+			exact.Add(freeRectangles[i]);
+		}
+		// Nothing fit, but now the bounds of the level are exact.
+		level->second = exact;
 	}
-	/// Try each free rectangle to find the best one for placement.
-	for(size_t i = 0; i < freeRectangles.size(); ++i)
+	return bestNode;
+}
+
+bool GuillotineBinPack3d::FindPositionInFreeRect(int width, int height, int depth, size_t i, Rect3d &bestNode) const
+{
+	int bestScore = std::numeric_limits<int>::max();
 	{
 		// If this is a perfect fit upright, choose it immediately.
 		if (width == freeRectangles[i].width && height == freeRectangles[i].height && depth == freeRectangles[i].depth)
@@ -445,9 +1068,7 @@ Rect3d GuillotineBinPack3d::FindPositionForNewNode(int width, int height, int de
 			bestNode.height = height;
             bestNode.depth = depth;
 			bestScore = std::numeric_limits<int>::min();
-			*nodeIndex = i;
-			debug_assert(disjointRects.Disjoint(bestNode));
-			break;
+			return true;
 		}
 		// If this is a perfect fit sideways, choose it.
 		else if (height == freeRectangles[i].width && width == freeRectangles[i].height && depth == freeRectangles[i].depth)
@@ -459,9 +1080,7 @@ Rect3d GuillotineBinPack3d::FindPositionForNewNode(int width, int height, int de
 			bestNode.height = width;
             bestNode.depth = depth;
 			bestScore = std::numeric_limits<int>::min();
-			*nodeIndex = i;
-			debug_assert(disjointRects.Disjoint(bestNode));
-			break;
+			return true;
 		}
 		// Does the rectangle fit upright?
 		else if (width <= freeRectangles[i].width && height <= freeRectangles[i].height && depth <= freeRectangles[i].depth)
@@ -477,9 +1096,7 @@ Rect3d GuillotineBinPack3d::FindPositionForNewNode(int width, int height, int de
 				bestNode.height = height;
                 bestNode.depth = depth;
 			//	bestScore = score;
-				*nodeIndex = i;
-				debug_assert(disjointRects.Disjoint(bestNode));
-				break;
+				return true;
 			//}
 		}
 		// Does the rectangle fit sideways?
@@ -496,16 +1113,21 @@ Rect3d GuillotineBinPack3d::FindPositionForNewNode(int width, int height, int de
 				bestNode.height = width;
                 bestNode.depth = depth;
 			//	bestScore = score;
-				*nodeIndex = i;
-				debug_assert(disjointRects.Disjoint(bestNode));
-				break;
+				return true;
 			//}
 		}
 	}
-	return bestNode;
+	(void)bestScore;
+	return false;
 }
 
 void GuillotineBinPack3d::SplitFreeRectByHeuristic(const Rect3d &freeRect, const Rect3d &placedRect, GuillotineSplitHeuristic method)
+{
+	// Perform the actual split.
+	SplitFreeRectAlongAxis(freeRect, placedRect, ChooseSplitAxis(freeRect, placedRect, method));
+}
+
+bool GuillotineBinPack3d::ChooseSplitAxis(const Rect3d &freeRect, const Rect3d &placedRect, GuillotineSplitHeuristic method)
 {
 	// Compute the lengths of the leftover area.
 	const int w = freeRect.width - placedRect.width;
@@ -552,31 +1174,25 @@ void GuillotineBinPack3d::SplitFreeRectByHeuristic(const Rect3d &freeRect, const
 		splitHorizontal = true;
 		assert(false);
 	}
-
-	// Perform the actual split.
-	SplitFreeRectAlongAxis(freeRect, placedRect, splitHorizontal);
+	return splitHorizontal;
 }
 
-/// This function will add the two generated rectangles into the freeRectangles array. The caller is expected to
-/// remove the original rectangle from the freeRectangles array after that.
-void GuillotineBinPack3d::SplitFreeRectAlongAxis(const Rect3d &freeRect, const Rect3d &placedRect, bool splitHorizontal)
+void GuillotineBinPack3d::ComputeSplit(const Rect3d &freeRect, const Rect3d &placedRect, bool splitHorizontal,
+	Rect3d &up, Rect3d &bottom, Rect3d &right)
 {
 	// Form the two new rectangles.
-	Rect3d bottom;
 	bottom.x = freeRect.x;
 	bottom.y = freeRect.y + placedRect.height;
     bottom.z = freeRect.z;
 	bottom.height = freeRect.height - placedRect.height;
     bottom.depth = freeRect.depth;
 
-	Rect3d right;
 	right.x = freeRect.x + placedRect.width;
 	right.y = freeRect.y;
     right.z = freeRect.z;
 	right.width = freeRect.width - placedRect.width;
     right.depth = freeRect.depth;
 
-    Rect3d up;
     up.x = freeRect.x;
     up.y = freeRect.y;
     up.z = freeRect.z + placedRect.depth;
@@ -594,87 +1210,361 @@ void GuillotineBinPack3d::SplitFreeRectAlongAxis(const Rect3d &freeRect, const R
 		bottom.width = placedRect.width;
 		right.height = freeRect.height;
 	}
+}
+
+/// This function will add the two generated rectangles into the freeRectangles array. The caller is expected to
+/// remove the original rectangle from the freeRectangles array after that.
+void GuillotineBinPack3d::SplitFreeRectAlongAxis(const Rect3d &freeRect, const Rect3d &placedRect, bool splitHorizontal)
+{
+	freeListFullyMerged = false;
+
+	Rect3d up;
+	Rect3d bottom;
+	Rect3d right;
+	ComputeSplit(freeRect, placedRect, splitHorizontal, up, bottom, right);
 
-	// Add the new rectangles into the free rectangle pool if they weren't degenerate.
+	// Add the new rectangles into the free rectangle pool if they weren't degenerate. Rectangles too small to
+	// hold any item go to the quarantine list instead.
     if (up.width > 0 && up.height > 0 && up.depth > 0)
-        freeRectangles.push_back(up);
+        AddFreeRect(up);
 	if (bottom.width > 0 && bottom.height > 0 && bottom.depth > 0)
-		freeRectangles.push_back(bottom);
+		AddFreeRect(bottom);
 	if (right.width > 0 && right.height > 0 && right.depth > 0)
-		freeRectangles.push_back(right);
+		AddFreeRect(right);
     
     debug_assert(disjointRects.Disjoint(up));
 	debug_assert(disjointRects.Disjoint(bottom));
 	debug_assert(disjointRects.Disjoint(right));
 }
 
+/// Merges freeRectangles[j] into freeRectangles[i] if the two can be represented with a single rectangle.
+/// The caller is expected to remove freeRectangles[j] if this returns true.
+bool GuillotineBinPack3d::TryMergeRects(Rect3d &a, const Rect3d &b)
+{
+	if (a.width == b.width && a.x == b.x && a.z == b.z && a.depth == b.depth)
+	{
+		if (a.y == b.y + b.height)
+		{
+			a.y -= b.height;
+			a.height += b.height;
+			return true;
+		}
+		else if (a.y + a.height == b.y)
+		{
+			a.height += b.height;
+			return true;
+		}
+	}
+	else if (a.height == b.height && a.y == b.y && a.z == b.z && a.depth == b.depth)
+	{
+		if (a.x == b.x + b.width)
+		{
+			a.x -= b.width;
+			a.width += b.width;
+			return true;
+		}
+		else if (a.x + a.width == b.x)
+		{
+			a.width += b.width;
+			return true;
+		}
+	}
+	else if (a.width == b.width && a.height == b.height && a.x == b.x && a.y == b.y)
+	{
+		if (a.z == b.z + b.depth)
+		{
+			a.z -= b.depth;
+			a.depth += b.depth;
+			return true;
+		}
+		else if (a.z + a.depth == b.z)
+		{
+			a.depth += b.depth;
+			return true;
+		}
+	}
+	return false;
+}
+
+void GuillotineBinPack3d::MergeRects(std::vector<Rect3d> &rects)
+{
+	// Do a Theta(n^2) loop to see if any pair of free rectangles could me merged into one.
+	// Note that we miss any opportunities to merge three rectangles into one. (should call this function again to detect that)
+	for(size_t i = 0; i < rects.size(); ++i)
+		for(size_t j = i+1; j < rects.size(); ++j)
+		{
+			if (TryMergeRects(rects[i], rects[j]))
+			{
+				rects.erase(rects.begin() + j);
+				--j;
+			}
+		}
+}
+
+void GuillotineBinPack3d::MergeRectsFull(std::vector<Rect3d> &rects)
+{
+	size_t numRects;
+	do
+	{
+		numRects = rects.size();
+		MergeRects(rects);
+	} while(rects.size() < numRects);
+}
+
+void GuillotineBinPack3d::MergeRectsByKey(std::vector<Rect3d> &rects, ThreadPool *pool)
+{
+	size_t kept = 0;
+	for(size_t i = 0; i < rects.size(); ++i)
+		if (rects[i].width > 0 && rects[i].height > 0 && rects[i].depth > 0)
+			rects[kept++] = rects[i];
+	rects.resize(kept);
+
+	std::vector<Rect3d> scratch;
+	std::vector<size_t> partitionStart;
+	int numIdlePasses = 0;
+	for(int axis = 0; numIdlePasses < 3; axis = (axis + 1) % 3)
+	{
+		if (MergePass(rects, scratch, partitionStart, mergeAxes[axis], pool))
+			numIdlePasses = 0;
+		else
+			++numIdlePasses;
+	}
+}
+
+void GuillotineBinPack3d::GetMaintenanceSnapshot(std::vector<Rect3d> &snapshot) const
+{
+	snapshot.assign(freeRectangles.begin(), freeRectangles.end());
+	snapshot.insert(snapshot.end(), quarantinedRectangles.begin(), quarantinedRectangles.end());
+}
+
+void GuillotineBinPack3d::PublishMergedFreeList(const std::vector<Rect3d> &merged,
+	const std::vector<Rect3d> &placedSince)
+{
+	freeRectangles.clear();
+	quarantinedRectangles.clear();
+	for(size_t i = 0; i < merged.size(); ++i)
+	{
+		if (CanHoldMinItem(merged[i]))
+			freeRectangles.push_back(merged[i]);
+		else
+			quarantinedRectangles.push_back(merged[i]);
+	}
+	SortFreeList();
+
+	mergeCursor = 0;
+	freeListFullyMerged = true;
+	for(size_t i = 0; i < placedSince.size(); ++i)
+		CutFreeList(placedSince[i]);
+}
+
 void GuillotineBinPack3d::MergeFreeList()
 {
+	MergeAllFreeRects(false);
+}
+
+void GuillotineBinPack3d::MergeFreeListByKey()
+{
+	MergeAllFreeRects(true);
+}
+
+void GuillotineBinPack3d::MergeAllFreeRects(bool byKey)
+{
+	TraceScope trace(traceRecorder, byKey ? "merge by key" : "merge");
+	const size_t numBefore = freeRectangles.size() + quarantinedRectangles.size();
+	// Quarantined rectangles take part in the merge, since merging them with their neighbours may produce
+	// space that is big enough to be useful again.
+	const bool hadQuarantine = !quarantinedRectangles.empty();
+	freeRectangles.insert(freeRectangles.end(), quarantinedRectangles.begin(), quarantinedRectangles.end());
+	quarantinedRectangles.clear();
+
 #ifdef _DEBUG
 	DisjointRectCollection3d test;
 	for(size_t i = 0; i < freeRectangles.size(); ++i)
 		assert(test.Add(freeRectangles[i]) == true);
 #endif
 
-	// Do a Theta(n^2) loop to see if any pair of free rectangles could me merged into one.
-	// Note that we miss any opportunities to merge three rectangles into one. (should call this function again to detect that)
+	if (byKey)
+		MergeRectsByKey(freeRectangles, mergePool);
+	else
+		MergeRects(freeRectangles);
+
+#ifdef _DEBUG
+	test.Clear();
 	for(size_t i = 0; i < freeRectangles.size(); ++i)
-		for(size_t j = i+1; j < freeRectangles.size(); ++j)
+		assert(test.Add(freeRectangles[i]) == true);
+#endif
+
+	// Split the result back into useful and quarantined rectangles. Merging only grows rectangles, so without
+	// any quarantined input every result is still useful.
+	if (hadQuarantine)
+	{
+		size_t kept = 0;
+		for(size_t i = 0; i < freeRectangles.size(); ++i)
 		{
-			if (freeRectangles[i].width == freeRectangles[j].width && freeRectangles[i].x == freeRectangles[j].x && freeRectangles[i].z == freeRectangles[j].z && freeRectangles[i].depth == freeRectangles[j].depth)
-			{
-				if (freeRectangles[i].y == freeRectangles[j].y + freeRectangles[j].height)
-				{
-					freeRectangles[i].y -= freeRectangles[j].height;
-					freeRectangles[i].height += freeRectangles[j].height;
-					freeRectangles.erase(freeRectangles.begin() + j);
-					--j;
-				}
-				else if (freeRectangles[i].y + freeRectangles[i].height == freeRectangles[j].y)
-				{
-					freeRectangles[i].height += freeRectangles[j].height;
-					freeRectangles.erase(freeRectangles.begin() + j);
-					--j;
-				}
-			}
-			else if (freeRectangles[i].height == freeRectangles[j].height && freeRectangles[i].y == freeRectangles[j].y && freeRectangles[i].z == freeRectangles[j].z && freeRectangles[i].depth == freeRectangles[j].depth)
+			if (CanHoldMinItem(freeRectangles[i]))
+				freeRectangles[kept++] = freeRectangles[i];
+			else
+				quarantinedRectangles.push_back(freeRectangles[i]);
+		}
+		freeRectangles.resize(kept);
+	}
+
+	// Merged rectangles may have moved down, restore the bottom-up order.
+	SortFreeList();
+	trace.SetArgs("before", numBefore, "after", freeRectangles.size() + quarantinedRectangles.size());
+}
+
+void GuillotineBinPack3d::MergeFreeListFull()
+{
+	if (keyedMerge)
+		MergeFreeListByKey();
+	else
+	{
+		size_t numFree;
+		do
+		{
+			numFree = freeRectangles.size() + quarantinedRectangles.size();
+			MergeFreeList();
+		} while(freeRectangles.size() + quarantinedRectangles.size() < numFree);
+	}
+
+	mergeCursor = 0;
+	freeListFullyMerged = true;
+}
+
+void GuillotineBinPack3d::MergeFreeListIncremental(int numSteps)
+{
+	TraceScope trace(traceRecorder, "merge");
+	const size_t numBefore = freeRectangles.size();
+	bool merged = false;
+	for(int step = 0; step < numSteps && freeRectangles.size() > 1; ++step)
+	{
+		if (mergeCursor >= freeRectangles.size())
+			mergeCursor = 0;
+
+		// One pass over the others, compacting the list as rectangles are absorbed. A rectangle that grew may now
+		// merge with ones already passed, so it stays under the cursor and the next step tries it again.
+		size_t cursor = mergeCursor;
+		size_t kept = 0;
+		bool grown = false;
+		for(size_t j = 0; j < freeRectangles.size(); ++j)
+		{
+			if (j != cursor && TryMergeRects(freeRectangles[cursor], freeRectangles[j]))
 			{
-				if (freeRectangles[i].x == freeRectangles[j].x + freeRectangles[j].width)
-				{
-					freeRectangles[i].x -= freeRectangles[j].width;
-					freeRectangles[i].width += freeRectangles[j].width;
-					freeRectangles.erase(freeRectangles.begin() + j);
-					--j;
-				}
-				else if (freeRectangles[i].x + freeRectangles[i].width == freeRectangles[j].x)
-				{
-					freeRectangles[i].width += freeRectangles[j].width;
-					freeRectangles.erase(freeRectangles.begin() + j);
-					--j;
-				}
+				grown = true;
+				continue;
 			}
-            else if(freeRectangles[i].width == freeRectangles[j].width && freeRectangles[i].height == freeRectangles[j].height && freeRectangles[i].x == freeRectangles[j].x && freeRectangles[i].y == freeRectangles[j].y){
-                if (freeRectangles[i].z == freeRectangles[j].z + freeRectangles[j].depth)
-				{
-					freeRectangles[i].z -= freeRectangles[j].depth;
-					freeRectangles[i].depth += freeRectangles[j].depth;
-					freeRectangles.erase(freeRectangles.begin() + j);
-					--j;
-				}
-				else if (freeRectangles[i].x + freeRectangles[i].depth == freeRectangles[i].x)
-				{
-					freeRectangles[i].depth += freeRectangles[j].depth;
-					freeRectangles.erase(freeRectangles.begin() + j);
-					--j;
-				}
-            }
+			if (j == cursor)
+				cursor = kept;
+			freeRectangles[kept++] = freeRectangles[j];
 		}
+		freeRectangles.resize(kept);
+		mergeCursor = grown ? cursor : cursor + 1;
+		merged = merged || grown;
+	}
 
-#ifdef _DEBUG
-	test.Clear();
+	if (merged)
+		SortFreeList();
+	trace.SetArgs("before", numBefore, "after", freeRectangles.size());
+}
+
+bool GuillotineBinPack3d::FreeRectOrder(const Rect3d &a, const Rect3d &b)
+{
+	if (a.z != b.z) return a.z < b.z;
+	if (a.y != b.y) return a.y < b.y;
+	return a.x < b.x;
+}
+
+size_t GuillotineBinPack3d::LevelBegin(int z) const
+{
+	Rect3d key;
+	key.x = std::numeric_limits<int>::min();
+	key.y = std::numeric_limits<int>::min();
+	key.z = z;
+	return std::lower_bound(freeRectangles.begin(), freeRectangles.end(), key, FreeRectOrder) - freeRectangles.begin();
+}
+
+void GuillotineBinPack3d::InsertFreeRectSorted(const Rect3d &freeRect)
+{
+	freeRectangles.insert(std::upper_bound(freeRectangles.begin(), freeRectangles.end(), freeRect, FreeRectOrder), freeRect);
+	freeLevels[freeRect.z].Add(freeRect);
+	if (freeSpaceBackend == FreeSpaceTree)
+		freeSpaceTree.Insert(freeRect);
+	++freeListVersion;
+}
+
+void GuillotineBinPack3d::EraseFreeRect(size_t index)
+{
+	std::map<int, FreeLevel>::iterator level = freeLevels.find(freeRectangles[index].z);
+	if (level != freeLevels.end() && --level->second.count <= 0)
+		freeLevels.erase(level);
+	if (freeSpaceBackend == FreeSpaceTree)
+		freeSpaceTree.Erase(freeRectangles[index]);
+	freeRectangles.erase(freeRectangles.begin() + index);
+	++freeListVersion;
+}
+
+void GuillotineBinPack3d::RebuildFreeLevels()
+{
+	++freeListVersion;
+	freeLevels.clear();
 	for(size_t i = 0; i < freeRectangles.size(); ++i)
-		assert(test.Add(freeRectangles[i]) == true);
-#endif
+		freeLevels[freeRectangles[i].z].Add(freeRectangles[i]);
+	if (freeSpaceBackend == FreeSpaceTree)
+		freeSpaceTree.Build(freeRectangles);
+}
+
+void GuillotineBinPack3d::SetFreeSpaceBackend(FreeSpaceBackend backend)
+{
+	freeSpaceBackend = backend;
+	if (freeSpaceBackend == FreeSpaceTree)
+		freeSpaceTree.Build(freeRectangles);
+	else
+		freeSpaceTree.Clear();
+}
+
+bool GuillotineBinPack3d::FindPositionInTree(int width, int height, int depth, size_t &freeNodeIndex,
+	Rect3d &bestNode) const
+{
+	const Rect3d *freeRect = freeSpaceTree.FindFirstFit(width, height, depth);
+	if (!freeRect)
+		return false;
+	// Free rectangles are disjoint, so no two of them share the corner the list is sorted by.
+	freeNodeIndex = std::lower_bound(freeRectangles.begin(), freeRectangles.end(), *freeRect, FreeRectOrder) -
+		freeRectangles.begin();
+	return FindPositionInFreeRect(width, height, depth, freeNodeIndex, bestNode);
+}
+
+PackerMemoryUsage GuillotineBinPack3d::GetMemoryUsage() const
+{
+	// A red-black tree node holds the value, three pointers and the color.
+	const size_t levelNodeBytes = sizeof(std::map<int, FreeLevel>::value_type) + 4 * sizeof(void *);
+
+	PackerMemoryUsage usage;
+	usage.freeListBytes = (freeRectangles.capacity() + quarantinedRectangles.capacity()) * sizeof(Rect3d);
+	usage.usedListBytes = usedRectangles.capacity() * sizeof(Rect3d);
+	usage.indexBytes = freeLevels.size() * levelNodeBytes + freeSpaceTree.MemoryBytes();
+	usage.scratchBytes = recentItems.capacity() * sizeof(RectSize3d) + shadowFreeRectangles.capacity() * sizeof(Rect3d);
+	return usage;
+}
+
+void GuillotineBinPack3d::SortFreeList()
+{
+	TraceScope trace(traceRecorder, "sort");
+	trace.SetArgs("free", freeRectangles.size());
+	std::sort(freeRectangles.begin(), freeRectangles.end(), FreeRectOrder);
+	RebuildFreeLevels();
+}
+
+float GuillotineBinPack3d::Fragmentation() const
+{
+	const unsigned long binVolume = (unsigned long)binWidth * binHeight * binDepth;
+	if (usedVolume >= binVolume)
+		return 0.f;
+
+	// Free rectangles per unit of free volume, scaled so that the empty bin scores 1.
+	const size_t numFree = freeRectangles.size() + quarantinedRectangles.size();
+	return (float)numFree * binVolume / (binVolume - usedVolume);
 }
 
 }
\ No newline at end of file
@@ -0,0 +1,130 @@
+/** @file HeightField2d.cpp
+	@brief A height field over the bin floor with logarithmic range updates and range maximum queries.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#include <algorithm>
+
+#include <cassert>
+
+#include "../include/HeightField2d.h"
+
+namespace rbp {
+
+using namespace std;
+
+HeightField2d::HeightField2d()
+:cellSize(1),
+numCellsX(0),
+numCellsY(0)
+{
+}
+
+void HeightField2d::Init(int width, int height, int cellSize_)
+{
+	assert(cellSize_ > 0);
+	cellSize = cellSize_;
+	numCellsX = max(1, (width + cellSize - 1) / cellSize);
+	numCellsY = max(1, (height + cellSize - 1) / cellSize);
+
+	Column flat;
+	flat.maxHeight.assign(4 * numCellsY, 0);
+	flat.coverHeight.assign(4 * numCellsY, 0);
+	maxColumns.assign(4 * numCellsX, flat);
+	coverColumns.assign(4 * numCellsX, flat);
+}
+
+size_t HeightField2d::MemoryBytes() const
+{
+	size_t bytes = (maxColumns.capacity() + coverColumns.capacity()) * sizeof(Column);
+	for(size_t i = 0; i < maxColumns.size(); ++i)
+		bytes += (maxColumns[i].maxHeight.capacity() + maxColumns[i].coverHeight.capacity()) * sizeof(int);
+	for(size_t i = 0; i < coverColumns.size(); ++i)
+		bytes += (coverColumns[i].maxHeight.capacity() + coverColumns[i].coverHeight.capacity()) * sizeof(int);
+	return bytes;
+}
+
+bool HeightField2d::ToCells(int x0, int x1, int cellSize, int numCells, int &c0, int &c1)
+{
+	if (x1 <= x0)
+		return false;
+	c0 = max(0, x0 >= 0 ? x0 / cellSize : 0);
+	c1 = min(numCells - 1, (x1 - 1) / cellSize);
+	return x1 > 0 && c0 <= c1;
+}
+
+void HeightField2d::RaiseColumn(Column &column, int node, int lo, int hi, int y0, int y1, int h)
+{
+	column.maxHeight[node] = max(column.maxHeight[node], h);
+	if (y0 <= lo && hi <= y1)
+	{
+		column.coverHeight[node] = max(column.coverHeight[node], h);
+		return;
+	}
+	int mid = (lo + hi) / 2;
+	if (y0 <= mid)
+		RaiseColumn(column, 2 * node, lo, mid, y0, y1, h);
+	if (y1 > mid)
+		RaiseColumn(column, 2 * node + 1, mid + 1, hi, y0, y1, h);
+}
+
+int HeightField2d::QueryColumn(const Column &column, int node, int lo, int hi, int y0, int y1) const
+{
+	if (y0 <= lo && hi <= y1)
+		return column.maxHeight[node];
+
+	// Whatever was set on this whole range also applies to the part that is queried.
+	int result = column.coverHeight[node];
+	int mid = (lo + hi) / 2;
+	if (y0 <= mid)
+		result = max(result, QueryColumn(column, 2 * node, lo, mid, y0, y1));
+	if (y1 > mid)
+		result = max(result, QueryColumn(column, 2 * node + 1, mid + 1, hi, y0, y1));
+	return result;
+}
+
+void HeightField2d::Raise(int node, int lo, int hi, int x0, int x1, int y0, int y1, int h)
+{
+	RaiseColumn(maxColumns[node], 1, 0, numCellsY - 1, y0, y1, h);
+	if (x0 <= lo && hi <= x1)
+	{
+		RaiseColumn(coverColumns[node], 1, 0, numCellsY - 1, y0, y1, h);
+		return;
+	}
+	int mid = (lo + hi) / 2;
+	if (x0 <= mid)
+		Raise(2 * node, lo, mid, x0, x1, y0, y1, h);
+	if (x1 > mid)
+		Raise(2 * node + 1, mid + 1, hi, x0, x1, y0, y1, h);
+}
+
+int HeightField2d::Query(int node, int lo, int hi, int x0, int x1, int y0, int y1) const
+{
+	if (x0 <= lo && hi <= x1)
+		return QueryColumn(maxColumns[node], 1, 0, numCellsY - 1, y0, y1);
+
+	int result = QueryColumn(coverColumns[node], 1, 0, numCellsY - 1, y0, y1);
+	int mid = (lo + hi) / 2;
+	if (x0 <= mid)
+		result = max(result, Query(2 * node, lo, mid, x0, x1, y0, y1));
+	if (x1 > mid)
+		result = max(result, Query(2 * node + 1, mid + 1, hi, x0, x1, y0, y1));
+	return result;
+}
+
+void HeightField2d::RaiseTo(int x0, int y0, int x1, int y1, int h)
+{
+	int cx0, cx1, cy0, cy1;
+	if (!ToCells(x0, x1, cellSize, numCellsX, cx0, cx1) || !ToCells(y0, y1, cellSize, numCellsY, cy0, cy1))
+		return;
+	Raise(1, 0, numCellsX - 1, cx0, cx1, cy0, cy1, h);
+}
+
+int HeightField2d::MaxHeight(int x0, int y0, int x1, int y1) const
+{
+	int cx0, cx1, cy0, cy1;
+	if (!ToCells(x0, x1, cellSize, numCellsX, cx0, cx1) || !ToCells(y0, y1, cellSize, numCellsY, cy0, cy1))
+		return 0;
+	return Query(1, 0, numCellsX - 1, cx0, cx1, cy0, cy1);
+}
+
+}
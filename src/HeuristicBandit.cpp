@@ -0,0 +1,94 @@
+/** @file HeuristicBandit.cpp
+	@brief Picks one of several packing heuristics online with a discounted UCB bandit.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#include <algorithm>
+
+#include <cassert>
+#include <cmath>
+
+#include "../include/HeuristicBandit.h"
+
+namespace rbp {
+
+using namespace std;
+
+HeuristicBandit::HeuristicBandit(int numArms)
+:totalPulls(0.f),
+discount(0.99f),
+exploration(0.5f)
+{
+	Reset(numArms);
+}
+
+void HeuristicBandit::Reset(int numArms)
+{
+	Arm empty;
+	empty.pulls = 0.f;
+	empty.rewardSum = 0.f;
+	arms.assign(numArms, empty);
+	totalPulls = 0.f;
+}
+
+void HeuristicBandit::SetParameters(float newDiscount, float newExploration)
+{
+	assert(newDiscount > 0.f && newDiscount <= 1.f);
+	discount = newDiscount;
+	exploration = newExploration;
+}
+
+void HeuristicBandit::Update(int arm, float reward)
+{
+	assert(arm >= 0 && arm < (int)arms.size());
+	for(size_t i = 0; i < arms.size(); ++i)
+	{
+		arms[i].pulls *= discount;
+		arms[i].rewardSum *= discount;
+	}
+	totalPulls = totalPulls * discount + 1.f;
+
+	arms[arm].pulls += 1.f;
+	arms[arm].rewardSum += reward;
+}
+
+float HeuristicBandit::Mean(int arm) const
+{
+	return arms[arm].pulls > 0.f ? arms[arm].rewardSum / arms[arm].pulls : 0.f;
+}
+
+int HeuristicBandit::SelectToExplore() const
+{
+	int bestArm = 0;
+	float bestBound = -1.f;
+	const float logTotal = log(max(totalPulls, 1.f));
+	for(int i = 0; i < (int)arms.size(); ++i)
+	{
+		// Discounting lets the pulls of an arm decay towards zero, which also brings back arms that have not
+		// been tried for a long time.
+		if (arms[i].pulls <= 0.f)
+			return i;
+
+		float bound = Mean(i) + exploration * sqrt(logTotal / arms[i].pulls);
+		if (bound > bestBound)
+		{
+			bestBound = bound;
+			bestArm = i;
+		}
+	}
+	return bestArm;
+}
+
+int HeuristicBandit::BestArm() const
+{
+	int bestArm = 0;
+	float bestMean = -1.f;
+	for(int i = 0; i < (int)arms.size(); ++i)
+		if (arms[i].pulls > 0.f && Mean(i) > bestMean)
+		{
+			bestMean = Mean(i);
+			bestArm = i;
+		}
+	return bestArm;
+}
+
+}
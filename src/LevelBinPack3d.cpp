@@ -0,0 +1,177 @@
+/** @file LevelBinPack3d.cpp
+	@brief Implements the layer/shelf/row bin packer, a very fast but wasteful baseline.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#include <algorithm>
+#include <utility>
+
+#include <cstring>
+
+#include "../include/LevelBinPack3d.h"
+
+namespace rbp {
+
+using namespace std;
+
+LevelBinPack3d::LevelBinPack3d()
+:binWidth(0),
+binHeight(0),
+binDepth(0),
+binAllowFlip(true),
+layerZ(0),
+layerDepth(0),
+shelfY(0),
+shelfHeight(0),
+rowX(0),
+usedVolume(0)
+{
+}
+
+LevelBinPack3d::LevelBinPack3d(int width, int height, int depth, bool allowFlip)
+{
+	Init(width, height, depth, allowFlip);
+}
+
+void LevelBinPack3d::Init(int width, int height, int depth, bool allowFlip)
+{
+	binWidth = width;
+	binHeight = height;
+	binDepth = depth;
+	binAllowFlip = allowFlip;
+
+	layerZ = 0;
+	layerDepth = 0;
+	shelfY = 0;
+	shelfHeight = 0;
+	rowX = 0;
+
+	usedVolume = 0;
+	usedRectangles.clear();
+}
+
+bool LevelBinPack3d::FitsOpenShelf(int width, int height, int depth) const
+{
+	// The open shelf and layer are the last ones, so they can grow up to the bin boundary.
+	return rowX + width <= binWidth &&
+		shelfY + height <= binHeight &&
+		layerZ + depth <= binDepth;
+}
+
+Rect3d LevelBinPack3d::PlaceInOpenShelf(int width, int height, int depth)
+{
+	Rect3d newNode;
+	newNode.x = rowX;
+	newNode.y = shelfY;
+	newNode.z = layerZ;
+	newNode.width = width;
+	newNode.height = height;
+	newNode.depth = depth;
+
+	rowX += width;
+	shelfHeight = max(shelfHeight, height);
+	layerDepth = max(layerDepth, depth);
+
+	usedVolume += (unsigned long)width * height * depth;
+	usedRectangles.push_back(newNode);
+	return newNode;
+}
+
+void LevelBinPack3d::OpenNewShelf()
+{
+	shelfY += shelfHeight;
+	shelfHeight = 0;
+	rowX = 0;
+}
+
+void LevelBinPack3d::OpenNewLayer(int z)
+{
+	layerZ = z;
+	layerDepth = 0;
+	shelfY = 0;
+	shelfHeight = 0;
+	rowX = 0;
+}
+
+Rect3d LevelBinPack3d::Insert(int width, int height, int depth)
+{
+	// Try the open shelf, then a new shelf in the open layer, then a new layer. In each stage, prefer the
+	// orientation that does not grow the shelf, and after that the one that uses up less of the row.
+	// Opening a shelf or layer closes the open one for good, so undo that if the box fits nowhere.
+	const int savedLayerZ = layerZ;
+	const int savedLayerDepth = layerDepth;
+	const int savedShelfY = shelfY;
+	const int savedShelfHeight = shelfHeight;
+	const int savedRowX = rowX;
+	for(int stage = 0; stage < 3; ++stage)
+	{
+		if (stage == 1)
+		{
+			if (shelfHeight == 0)
+				continue; // The open shelf is empty already.
+			OpenNewShelf();
+		}
+		else if (stage == 2)
+		{
+			if (layerDepth == 0)
+				break; // The open layer is empty already.
+			OpenNewLayer(layerZ + layerDepth);
+		}
+
+		bool uprightFits = FitsOpenShelf(width, height, depth);
+		bool flippedFits = binAllowFlip && FitsOpenShelf(height, width, depth);
+		if (uprightFits && flippedFits)
+		{
+			bool uprightGrows = height > shelfHeight;
+			bool flippedGrows = width > shelfHeight;
+			if (uprightGrows != flippedGrows)
+				flippedFits = uprightGrows;
+			else
+				flippedFits = height < width;
+			uprightFits = !flippedFits;
+		}
+
+		if (uprightFits)
+			return PlaceInOpenShelf(width, height, depth);
+		if (flippedFits)
+			return PlaceInOpenShelf(height, width, depth);
+	}
+
+	layerZ = savedLayerZ;
+	layerDepth = savedLayerDepth;
+	shelfY = savedShelfY;
+	shelfHeight = savedShelfHeight;
+	rowX = savedRowX;
+
+	Rect3d failed;
+	memset(&failed, 0, sizeof(Rect3d));
+	return failed;
+}
+
+bool LevelBinPack3d::NeedsNewLayer(int width, int height, int depth) const
+{
+	if (layerDepth == 0)
+		return false; // Insert does not open a layer above an empty one.
+	if (FitsOpenShelf(width, height, depth) || (binAllowFlip && FitsOpenShelf(height, width, depth)))
+		return false;
+	// A new shelf of the open layer starts at x = 0 right above the open one.
+	const int newShelfY = shelfY + shelfHeight;
+	const bool fitsNewShelf = shelfHeight > 0 && layerZ + depth <= binDepth &&
+		((width <= binWidth && newShelfY + height <= binHeight) ||
+		(binAllowFlip && height <= binWidth && newShelfY + width <= binHeight));
+	return !fitsNewShelf;
+}
+
+void LevelBinPack3d::MarkUsed(const Rect3d &rect)
+{
+	// Anything at or above the top of the region is guaranteed to be free of it.
+	int top = rect.z + rect.depth;
+	if (top > layerZ)
+		OpenNewLayer(max(top, layerZ + layerDepth));
+}
+
+float LevelBinPack3d::Occupancy() const
+{
+	return (float)usedVolume / ((unsigned long)binWidth * binHeight * binDepth);
+}
+
+}
@@ -20,6 +20,88 @@ namespace rbp {
 
 using namespace std;
 
+namespace {
+
+/// A free space ranked for eviction. Lower ranks are evicted first, ties broken by the list index so that
+/// the choice does not depend on the selection algorithm.
+struct EvictionRank
+{
+	double usefulness;
+	double volume;
+	size_t index;
+
+	bool operator<(const EvictionRank &other) const
+	{
+		if (usefulness != other.usefulness) return usefulness < other.usefulness;
+		if (volume != other.volume) return volume < other.volume;
+		return index < other.index;
+	}
+};
+
+/// TryInsertBatch matches tiles of this many boxes against blocks of this many free spaces, so that a block stays
+/// in L1 cache while all boxes of the tile are tested against it.
+const size_t batchTileBoxes = 16;
+const size_t batchBlockSpaces = 256;
+
+/// Below this many pairs of boxes and free spaces, TryInsertBatch does not wake up the thread pool.
+const size_t minParallelBatchPairs = 1 << 16;
+
+/// The free spaces in struct of arrays layout, with the extents a box placed at the support origin can use.
+struct FreeSpaceArrays
+{
+	std::vector<int> spanWidths;
+	std::vector<int> spanHeights;
+	std::vector<int> depths;
+	std::vector<int> supportWidths;
+	std::vector<int> supportHeights;
+};
+
+/// Sets fits[k] to 1 if a width x height x depth box passes the size and support tests of the bottom-left scan at
+/// free space k in either orientation, and to 0 otherwise. Branch free over flat arrays, so that the compiler
+/// vectorizes it.
+void FitBlock(const FreeSpaceArrays &spaces, size_t first, size_t count, int width, int height, int depth,
+	int supportTh, bool allowFlip, unsigned char *fits)
+{
+	const int *spanWidths = &spaces.spanWidths[first];
+	const int *spanHeights = &spaces.spanHeights[first];
+	const int *depths = &spaces.depths[first];
+	const int *supportWidths = &spaces.supportWidths[first];
+	const int *supportHeights = &spaces.supportHeights[first];
+	const int widthSupport = width * supportTh;
+	const int heightSupport = height * supportTh;
+	const int flip = allowFlip ? 1 : 0;
+	for(size_t k = 0; k < count; ++k)
+	{
+		const int upright = (width <= spanWidths[k]) & (height <= spanHeights[k]) &
+			(heightSupport <= supportHeights[k]) & (widthSupport <= supportWidths[k]);
+		const int flipped = flip & (height <= spanWidths[k]) & (width <= spanHeights[k]) &
+			(widthSupport <= supportHeights[k]) & (heightSupport <= supportWidths[k]);
+		fits[k] = (unsigned char)((depth <= depths[k]) & (upright | flipped));
+	}
+}
+
+long long FootprintArea(const FreeRect3d &r)
+{
+	return (long long)r.width * r.height;
+}
+
+/// @return True if a and b cover the same space. Their support areas may differ.
+bool SameSpace(const FreeRect3d &a, const FreeRect3d &b)
+{
+	return a.x == b.x && a.y == b.y && a.z == b.z && a.width == b.width && a.height == b.height && a.depth == b.depth;
+}
+
+size_t SpaceHash(const FreeRect3d &r)
+{
+	uint64_t hash = 14695981039346656037ull;
+	const int fields[6] = { r.x, r.y, r.z, r.width, r.height, r.depth };
+	for(int i = 0; i < 6; ++i)
+		hash = (hash ^ (uint32_t)fields[i]) * 1099511628211ull;
+	return (size_t)(hash ^ (hash >> 29));
+}
+
+}
+
 MaxRectsBinPack::MaxRectsBinPack()
 :binWidth(0),
 binHeight(0),
@@ -53,44 +135,575 @@ void MaxRectsBinPack::Init(int width, int height, int depth, bool allowFlip)
 
 	usedRectangles.clear();
 	freeRectangles.clear();
-	freeRectangles.push_back(n);
+	if (!normalPatterns || SnapToLattice(n))
+		freeRectangles.push_back(n);
+	quarantinedRectangles.clear();
+	RebuildFreeLevels();
+
+	if (clearanceEnabled)
+		heightField.Init(width, height, clearanceCellSize);
+}
+
+void MaxRectsBinPack::SetMinItemSize(int minWidth, int minHeight, int minDepth)
+{
+	minItemWidth = minWidth;
+	minItemHeight = minHeight;
+	minItemDepth = minDepth;
+	seenItemSize = false;
+	ReleaseQuarantine();
+}
+
+bool MaxRectsBinPack::CanHoldMinItem(const FreeRect3d &freeRect) const
+{
+	if (freeRect.depth < minItemDepth)
+		return false;
+	if (freeRect.width >= minItemWidth && freeRect.height >= minItemHeight)
+		return true;
+	return binAllowFlip && freeRect.width >= minItemHeight && freeRect.height >= minItemWidth;
+}
+
+void MaxRectsBinPack::AddFreeRect(const FreeRect3d &freeRect)
+{
+	if (normalPatterns)
+	{
+		FreeRect3d snapped = freeRect;
+		if (!SnapToLattice(snapped))
+			return;
+		if (CanHoldMinItem(snapped))
+			freeRectangles.push_back(snapped);
+		else if (learnMinItemSize)
+			quarantinedRectangles.push_back(snapped);
+		return;
+	}
+	if (CanHoldMinItem(freeRect))
+		freeRectangles.push_back(freeRect);
+	else if (learnMinItemSize)
+		quarantinedRectangles.push_back(freeRect);
+}
+
+void MaxRectsBinPack::SetNormalPatterns(const NormalPatternLattice *lattice)
+{
+	normalPatterns = lattice;
+	if (!normalPatterns)
+		return;
+
+	std::vector<FreeRect3d> spaces;
+	spaces.swap(freeRectangles);
+	for(size_t i = 0; i < spaces.size(); ++i)
+		AddFreeRect(spaces[i]);
+	size_t kept = 0;
+	for(size_t i = 0; i < quarantinedRectangles.size(); ++i)
+		if (SnapToLattice(quarantinedRectangles[i]))
+			quarantinedRectangles[kept++] = quarantinedRectangles[i];
+	quarantinedRectangles.resize(kept);
+
+	sortFreeSpace();
+	PruneFreeList();
+	RebuildFreeLevels();
+}
+
+bool MaxRectsBinPack::SnapToLattice(FreeRect3d &freeRect) const
+{
+	typedef NormalPatternLattice Lattice;
+	const int x1 = normalPatterns->SnapDown(Lattice::AxisX, freeRect.x + freeRect.width);
+	const int y1 = normalPatterns->SnapDown(Lattice::AxisY, freeRect.y + freeRect.height);
+	const int supportx0 = normalPatterns->SnapUp(Lattice::AxisX, freeRect.supportx0);
+	const int supporty0 = normalPatterns->SnapUp(Lattice::AxisY, freeRect.supporty0);
+	if (supportx0 >= x1 || supporty0 >= y1)
+		return false;
+	// A box moved past the end of its support would overhang.
+	if ((supportx0 != freeRect.supportx0 && supportx0 >= freeRect.supportx1) ||
+		(supporty0 != freeRect.supporty0 && supporty0 >= freeRect.supporty1))
+		return false;
+
+	// The corner of the space stays where it is: boxes go to the support origin anyway, and the pruning only
+	// compares corners, so moving them up would make it drop spaces with support origins of their own.
+	freeRect.width = x1 - freeRect.x;
+	freeRect.height = y1 - freeRect.y;
+	freeRect.supportx0 = supportx0;
+	freeRect.supporty0 = supporty0;
+
+	// Sums of sides only count up from a stack top on the lattice.
+	if (normalPatterns->IsReachable(Lattice::AxisZ, freeRect.z))
+	{
+		const int z1 = normalPatterns->SnapDown(Lattice::AxisZ, freeRect.z + freeRect.depth);
+		if (z1 <= freeRect.z)
+			return false;
+		freeRect.depth = z1 - freeRect.z;
+	}
+	return true;
+}
+
+void MaxRectsBinPack::ObserveItemSize(int width, int height, int depth)
+{
+	// With flipping allowed, keep the short side in minItemWidth.
+	if (binAllowFlip && width > height)
+		std::swap(width, height);
+
+	itemWidthSum += width;
+	itemHeightSum += height;
+	itemDepthSum += depth;
+	++numItemsSeen;
+
+	if (!learnMinItemSize)
+		return;
+
+	if (!seenItemSize)
+	{
+		// The first item replaces whatever was configured before.
+		seenItemSize = true;
+		minItemWidth = width;
+		minItemHeight = height;
+		minItemDepth = depth;
+		ReleaseQuarantine();
+		return;
+	}
+
+	if (width < minItemWidth || height < minItemHeight || depth < minItemDepth)
+	{
+		minItemWidth = min(minItemWidth, width);
+		minItemHeight = min(minItemHeight, height);
+		minItemDepth = min(minItemDepth, depth);
+		ReleaseQuarantine();
+	}
+}
+
+void MaxRectsBinPack::ReleaseQuarantine()
+{
+	std::vector<FreeRect3d> released;
+	size_t kept = 0;
+	for(size_t i = 0; i < quarantinedRectangles.size(); ++i)
+	{
+		if (CanHoldMinItem(quarantinedRectangles[i]))
+			released.push_back(quarantinedRectangles[i]);
+		else
+			quarantinedRectangles[kept++] = quarantinedRectangles[i];
+	}
+	quarantinedRectangles.resize(kept);
+	if (released.empty())
+		return;
+
+	// Quarantined spaces were not split by the placements made after they were quarantined, so catch up on that.
+	std::vector<FreeRect3d> pieces;
+	for(size_t j = 0; j < usedRectangles.size(); ++j)
+	{
+		pieces.clear();
+		for(size_t i = 0; i < released.size(); ++i)
+			if (!SplitFreeNodeInto(released[i], usedRectangles[j], pieces))
+				pieces.push_back(released[i]);
+		released.swap(pieces);
+	}
+
+	const size_t numSorted = freeRectangles.size();
+	for(size_t i = 0; i < released.size(); ++i)
+		AddFreeRect(released[i]);
+	MergeNewFreeRects(numSorted);
+	PruneFreeList();
+	EnforceFreeListCap();
+	RebuildFreeLevels();
 }
 
 Rect3d MaxRectsBinPack::Insert(int width, int height, int depth, FreeRectChoiceHeuristic method)
 {
+	// The heuristics other than bottom-left are not implemented, and leave the box unplaced.
 	Rect3d newNode;
+	memset(&newNode, 0, sizeof(Rect3d));
 	// Unused in this function. We don't need to know the score after finding the position.
 	int score1 = std::numeric_limits<int>::max();
 	int score2 = std::numeric_limits<int>::max();
 	int score3 = std::numeric_limits<int>::max();
-	this->sortFreeSpace();
+	ObserveItemSize(width, height, depth);
 	switch(method)
 	{
 		//case RectBestShortSideFit: newNode = FindPositionForNewNodeBestShortSideFit(width, height, score1, score2); break;
-		case RectBottomLeftRule: newNode = FindPositionForNewNodeBottomLeft(width, height, depth, score1, score2, score3); break;
+		case RectBottomLeftRule: newNode = FindPositionForNewNodeBottomLeft(width, height, depth, score1, score2, score3,
+			Clock::time_point::max()); break;
 		//case RectContactPointRule: newNode = FindPositionForNewNodeContactPoint(width, height, score1); break;
 		//case RectBestLongSideFit: newNode = FindPositionForNewNodeBestLongSideFit(width, height, score2, score1); break;
 		//case RectBestAreaFit: newNode = FindPositionForNewNodeBestAreaFit(width, height, score1, score2); break;
+		default: break;
 	}
 		
 	if (newNode.height == 0)
 		return newNode;
 
+	PlaceRect(newNode);
+	return newNode;
+}
+
+Rect3d MaxRectsBinPack::InsertWithDeadline(int width, int height, int depth, FreeRectChoiceHeuristic method,
+	Clock::time_point deadline)
+{
+	Rect3d newNode;
+	memset(&newNode, 0, sizeof(Rect3d));
+	int score1 = std::numeric_limits<int>::max();
+	int score2 = std::numeric_limits<int>::max();
+	int score3 = std::numeric_limits<int>::max();
+	ObserveItemSize(width, height, depth);
+	switch(method)
+	{
+		case RectBottomLeftRule: newNode = FindPositionForNewNodeBottomLeft(width, height, depth, score1, score2, score3,
+			deadline); break;
+		default: break;
+	}
+
+	if (newNode.height == 0)
+		return newNode;
+
+	// The split keeps the free list correct, the pruning only keeps it short. Still, redundant split products
+	// would be split again by every later placement and multiply, so those are pruned right away. The split also
+	// keeps the progress of the deferred pruning, so that it does not start over on every insert.
+	if (!pruneDeferred)
+		pruneCursor = freeRectangles.size();
+	SplitFreeList(newNode, true, &pruneCursor);
+	pruneDeferred = pruneCursor < freeRectangles.size();
+	EnforceFreeListCap();
+	RebuildFreeLevels();
+	AddUsedRect(newNode);
+	return newNode;
+}
+
+InsertToken MaxRectsBinPack::TryInsert(int width, int height, int depth, FreeRectChoiceHeuristic method) const
+{
+	InsertToken token;
+	memset(&token, 0, sizeof(InsertToken));
+	token.packer = this;
+	token.version = freeListVersion;
+	token.score = std::numeric_limits<int>::max();
+	int bestY = std::numeric_limits<int>::max();
+	int bestX = std::numeric_limits<int>::max();
+	int bestZ = std::numeric_limits<int>::max();
+	switch(method)
+	{
+		case RectBottomLeftRule: token.placement = FindPositionForNewNodeBottomLeft(width, height, depth, bestY, bestX,
+			bestZ, Clock::time_point::max()); break;
+		default: break;
+	}
+	if (token.placement.height != 0)
+		token.score = bestY;
+	return token;
+}
+
+void MaxRectsBinPack::TryInsertBatch(const std::vector<RectSize3d> &boxes, FreeRectChoiceHeuristic method,
+	std::vector<InsertToken> &tokens, ThreadPool *pool) const
+{
+	TraceScope trace(traceRecorder, "batch scan");
+	trace.SetArgs("boxes", boxes.size(), "free", freeRectangles.size());
+	InsertToken noFit;
+	memset(&noFit, 0, sizeof(InsertToken));
+	noFit.packer = this;
+	noFit.version = freeListVersion;
+	noFit.score = std::numeric_limits<int>::max();
+	tokens.assign(boxes.size(), noFit);
+	if (method != RectBottomLeftRule)
+		return;
+
+	// The bottom-left scan takes the first valid placement in list order, so that is the one to find here too.
+	const size_t numFree = freeRectangles.size();
+	FreeSpaceArrays spaces;
+	spaces.spanWidths.resize(numFree);
+	spaces.spanHeights.resize(numFree);
+	spaces.depths.resize(numFree);
+	spaces.supportWidths.resize(numFree);
+	spaces.supportHeights.resize(numFree);
+	for(size_t i = 0; i < numFree; ++i)
+	{
+		const FreeRect3d &r = freeRectangles[i];
+		spaces.spanWidths[i] = r.x + r.width - r.supportx0;
+		spaces.spanHeights[i] = r.y + r.height - r.supporty0;
+		spaces.depths[i] = r.depth;
+		spaces.supportWidths[i] = r.supportx1 - r.supportx0;
+		spaces.supportHeights[i] = r.supporty1 - r.supporty0;
+	}
+
+	const size_t numTiles = (boxes.size() + batchTileBoxes - 1) / batchTileBoxes;
+	auto scanTile = [&](int tile, int)
+	{
+		const size_t begin = tile * batchTileBoxes;
+		const size_t end = min(begin + batchTileBoxes, boxes.size());
+		bool found[batchTileBoxes] = {};
+		size_t numOpen = end - begin;
+		unsigned char fits[batchBlockSpaces];
+		for(size_t block = 0; block < numFree && numOpen > 0; block += batchBlockSpaces)
+		{
+			const size_t count = min(batchBlockSpaces, numFree - block);
+			for(size_t b = begin; b < end; ++b)
+			{
+				const RectSize3d &box = boxes[b];
+				if (found[b - begin])
+					continue;
+				FitBlock(spaces, block, count, box.width, box.height, box.depth, supportTh, binAllowFlip, fits);
+				// The gripper clearance is only checked on the spaces that pass the fit test.
+				InsertToken &token = tokens[b];
+				const unsigned char *hit = fits;
+				while((hit = (const unsigned char *)memchr(hit, 1, count - (hit - fits))) != 0)
+				{
+					if (PlaceAtFreeSpace(block + (hit - fits), box.width, box.height, box.depth, token.placement))
+					{
+						token.score = token.placement.y + token.placement.height;
+						found[b - begin] = true;
+						--numOpen;
+						break;
+					}
+					++hit;
+				}
+			}
+		}
+	};
+	if (pool && pool->NumThreads() > 1 && numTiles > 1 && boxes.size() * numFree >= minParallelBatchPairs)
+		pool->ParallelFor((int)numTiles, scanTile);
+	else
+		for(size_t tile = 0; tile < numTiles; ++tile)
+			scanTile((int)tile, 0);
+}
+
+bool MaxRectsBinPack::PlaceAtFreeSpace(size_t i, int width, int height, int depth, Rect3d &node) const
+{
+	const FreeRect3d &r = freeRectangles[i];
+	const int supportWidth = r.supportx1 - r.supportx0;
+	const int supportHeight = r.supporty1 - r.supporty0;
+	const int spanWidth = r.x + r.width - r.supportx0;
+	const int spanHeight = r.y + r.height - r.supporty0;
+	node.x = r.supportx0;
+	node.y = r.supporty0;
+	node.z = r.z;
+	node.depth = depth;
+	if (r.depth < depth)
+		return false;
+	if (spanWidth >= width && spanHeight >= height && supportHeight >= height * supportTh && supportWidth >= width * supportTh)
+	{
+		node.width = width;
+		node.height = height;
+		if (!IsPlacementBlocked(node, uprightClearance))
+			return true;
+	}
+	if (binAllowFlip && spanWidth >= height && spanHeight >= width && supportHeight >= width * supportTh && supportWidth >= height * supportTh)
+	{
+		node.width = height;
+		node.height = width;
+		if (!IsPlacementBlocked(node, flippedClearance))
+			return true;
+	}
+	memset(&node, 0, sizeof(Rect3d));
+	return false;
+}
+
+bool MaxRectsBinPack::Commit(const InsertToken &token)
+{
+	if (token.packer != this || token.version != freeListVersion || token.placement.height == 0)
+		return false;
+
+	PlaceRect(token.placement);
+	// Learning from the box after placing it is fine, since the quarantined spaces it releases only add room.
+	ObserveItemSize(token.placement.width, token.placement.height, token.placement.depth);
+	return true;
+}
+
+bool MaxRectsBinPack::DoIdleWork(Clock::time_point deadline)
+{
+	if (!pruneDeferred)
+		return true;
+	bool done = PruneFreeListUntil(deadline);
+	RebuildFreeLevels();
+	return done;
+}
+
+void MaxRectsBinPack::PlaceRect(const Rect3d &rect)
+{
+	// With a cap, the products are pruned against the list as they come in, which leaves nothing for the full
+	// prune to remove. The cap can then be enforced before the quadratic prune instead of after it.
+	const bool capped = maxFreeRectangles != 0;
+	SplitFreeList(rect, capped);
+	if (capped)
+		EnforceFreeListCap();
+	PruneFreeList();
+	EnforceFreeListCap();
+	RebuildFreeLevels();
+	AddUsedRect(rect);
+}
+
+void MaxRectsBinPack::SplitFreeList(const Rect3d &rect, bool pruneProducts, size_t *cursor)
+{
+	TraceScope trace(traceRecorder, "split");
+	// Split spaces are dropped and the unsplit ones compacted in place. The spaces produced by the splits are
+	// appended behind them and merged into the sorted order afterwards.
 	size_t numRectanglesToProcess = freeRectangles.size();
+	size_t kept = 0;
+	size_t numChecked = 0;
 	for(size_t i = 0; i < numRectanglesToProcess; ++i)
+		if (!SplitFreeNode(freeRectangles[i], rect))
+		{
+			if (cursor && i < *cursor)
+				++numChecked;
+			freeRectangles[kept++] = freeRectangles[i];
+		}
+	RemoveDuplicateProducts(numRectanglesToProcess);
+	freeRectangles.erase(freeRectangles.begin() + kept, freeRectangles.begin() + numRectanglesToProcess);
+	if (pruneProducts)
+		PruneNewFreeRects(kept);
+	if (cursor)
 	{
-		if (SplitFreeNode(freeRectangles[i], newNode))
+		// The pieces did not exist when the spaces before the cursor were checked. With both directions checked
+		// now, the pieces need no further checks wherever they are merged to, and the spaces before the cursor
+		// stay checked. The merge only moves the unchecked spaces further back, so the count is a safe cursor.
+		assert(pruneProducts);
+		kept = DropSpacesInsideNewFreeRects(kept, numChecked);
+		*cursor = numChecked;
+	}
+	trace.SetArgs("free", freeRectangles.size(), "products", freeRectangles.size() - kept);
+	MergeNewFreeRects(kept);
+}
+
+void MaxRectsBinPack::RemoveDuplicateProducts(size_t firstNew)
+{
+	const size_t numProducts = freeRectangles.size() - firstNew;
+	if (numProducts < 2)
+		return;
+
+	// At most half full, so that probe sequences stay short.
+	size_t numSlots = 4;
+	while(numSlots < 2 * numProducts)
+		numSlots *= 2;
+	productSlots.assign(numSlots, 0);
+	const size_t mask = numSlots - 1;
+
+	bool foundDuplicate = false;
+	for(size_t i = firstNew; i < freeRectangles.size(); ++i)
+	{
+		FreeRect3d &r = freeRectangles[i];
+		size_t slot = SpaceHash(r) & mask;
+		while(productSlots[slot] != 0)
 		{
-			freeRectangles.erase(freeRectangles.begin() + i);
-			--i;
-			--numRectanglesToProcess;
+			FreeRect3d &other = freeRectangles[productSlots[slot] - 1];
+			if (SameSpace(r, other))
+			{
+				// The later one takes over the slot, the earlier one is dropped below.
+				other.width = 0;
+				foundDuplicate = true;
+				break;
+			}
+			slot = (slot + 1) & mask;
 		}
+		productSlots[slot] = (uint32_t)(i + 1);
 	}
+	if (!foundDuplicate)
+		return;
 
-	PruneFreeList();
+	size_t kept = firstNew;
+	for(size_t i = firstNew; i < freeRectangles.size(); ++i)
+		if (freeRectangles[i].width != 0)
+			freeRectangles[kept++] = freeRectangles[i];
+	freeRectangles.resize(kept);
+}
 
-	usedRectangles.push_back(newNode);
-	return newNode;
+void MaxRectsBinPack::PruneNewFreeRects(size_t firstNew)
+{
+	for(size_t i = firstNew; i < freeRectangles.size(); )
+	{
+		bool redundant = false;
+		for(size_t j = 0; j < freeRectangles.size() && !redundant; ++j)
+			redundant = j != i && IsContainedInFree3d(freeRectangles[i], freeRectangles[j]);
+		if (redundant)
+			freeRectangles.erase(freeRectangles.begin() + i);
+		else
+			++i;
+	}
+}
+
+size_t MaxRectsBinPack::DropSpacesInsideNewFreeRects(size_t firstNew, size_t &numChecked)
+{
+	size_t kept = 0;
+	size_t numCheckedKept = 0;
+	for(size_t i = 0; i < firstNew; ++i)
+	{
+		bool redundant = false;
+		for(size_t j = firstNew; j < freeRectangles.size() && !redundant; ++j)
+			redundant = IsContainedInFree3d(freeRectangles[i], freeRectangles[j]);
+		if (redundant)
+			continue;
+		if (i < numChecked)
+			++numCheckedKept;
+		freeRectangles[kept++] = freeRectangles[i];
+	}
+	if (kept == firstNew)
+		return firstNew;
+	freeRectangles.erase(freeRectangles.begin() + kept, freeRectangles.begin() + firstNew);
+	numChecked = numCheckedKept;
+	return kept;
+}
+
+void MaxRectsBinPack::SetFreeListCap(size_t maxFreeRectangles_, EvictionPolicy policy)
+{
+	maxFreeRectangles = maxFreeRectangles_;
+	evictionPolicy = policy;
+	EnforceFreeListCap();
+	RebuildFreeLevels();
+}
+
+double MaxRectsBinPack::AverageItemsHeld(const FreeRect3d &freeRect) const
+{
+	const double width = itemWidthSum / numItemsSeen;
+	const double height = itemHeightSum / numItemsSeen;
+	const double depth = itemDepthSum / numItemsSeen;
+
+	double perLayer = floor(freeRect.width / width) * floor(freeRect.height / height);
+	if (binAllowFlip)
+		perLayer = max(perLayer, floor(freeRect.width / height) * floor(freeRect.height / width));
+	return perLayer * floor(freeRect.depth / depth);
+}
+
+void MaxRectsBinPack::EnforceFreeListCap()
+{
+	if (maxFreeRectangles == 0 || freeRectangles.size() <= maxFreeRectangles)
+		return;
+
+	TraceScope trace(traceRecorder, "evict");
+	const size_t numBefore = freeRectangles.size();
+	const size_t numKept = max<size_t>(maxFreeRectangles - maxFreeRectangles / 4, 1);
+	const size_t numEvicted = numBefore - numKept;
+
+	const bool rankByUse = evictionPolicy == EvictLeastUseful && numItemsSeen > 0;
+	std::vector<EvictionRank> ranks(numBefore);
+	for(size_t i = 0; i < numBefore; ++i)
+	{
+		const FreeRect3d &r = freeRectangles[i];
+		ranks[i].usefulness = rankByUse ? AverageItemsHeld(r) : 0.0;
+		ranks[i].volume = (double)r.width * r.height * r.depth;
+		ranks[i].index = i;
+	}
+	std::nth_element(ranks.begin(), ranks.begin() + numEvicted, ranks.end());
+
+	std::vector<char> evicted(numBefore, 0);
+	for(size_t i = 0; i < numEvicted; ++i)
+		evicted[ranks[i].index] = 1;
+	size_t kept = 0;
+	for(size_t i = 0; i < numBefore; ++i)
+		if (!evicted[i])
+			freeRectangles[kept++] = freeRectangles[i];
+	freeRectangles.resize(kept);
+
+	// The deferred pruning walks the list by index, so restart it on the compacted list.
+	pruneCursor = 0;
+	++numEvictions;
+	numEvictedRectangles += numEvicted;
+	trace.SetArgs("before", numBefore, "after", freeRectangles.size());
+}
+
+PackerMemoryUsage MaxRectsBinPack::GetMemoryUsage() const
+{
+	PackerMemoryUsage usage;
+	usage.freeListBytes = (freeRectangles.capacity() + quarantinedRectangles.capacity()) * sizeof(FreeRect3d);
+	usage.usedListBytes = usedRectangles.capacity() * sizeof(Rect3d);
+	usage.indexBytes = freeLevels.capacity() * sizeof(FreeLevel) + heightField.MemoryBytes();
+	usage.scratchBytes = splitProducts.capacity() * sizeof(FreeRect3d);
+	return usage;
+}
+
+void MaxRectsBinPack::AddUsedRect(const Rect3d &rect)
+{
+	usedRectangles.push_back(rect);
+	if (clearanceEnabled)
+		heightField.RaiseTo(rect.x, rect.y, rect.x + rect.width, rect.y + rect.height, rect.z + rect.depth);
 }
 
 
@@ -105,19 +718,48 @@ float MaxRectsBinPack::Occupancy() const
 	return (float)usedSurfaceArea / (binWidth * binHeight);
 }
 
+bool MaxRectsBinPack::FreeSpaceOrder(const FreeRect3d &r1, const FreeRect3d &r2)
+{
+	if (r1.y != r2.y) return r1.y < r2.y;
+	if (r1.z != r2.z) return r1.z < r2.z;
+	return r1.x < r2.x;
+}
+
 void MaxRectsBinPack::sortFreeSpace(){
-	std::sort(freeRectangles.begin(), freeRectangles.end(), [](FreeRect3d& r1, FreeRect3d& r2)->bool{
-		if(r1.y < r2.y){
-			return true;
-		}
-		if(r1.y == r2.y && r1.z < r2.z){
-			return true;
-		}
-		if(r1.y == r2.y && r1.z == r2.z && r1.x < r2.x){
-			return true;
+	std::stable_sort(freeRectangles.begin(), freeRectangles.end(), FreeSpaceOrder);
+	RebuildFreeLevels();
+}
+
+void MaxRectsBinPack::MergeNewFreeRects(size_t numSorted)
+{
+	TraceScope trace(traceRecorder, "sort");
+	trace.SetArgs("free", freeRectangles.size(), "new", freeRectangles.size() - numSorted);
+	std::vector<FreeRect3d>::iterator middle = freeRectangles.begin() + numSorted;
+	std::stable_sort(middle, freeRectangles.end(), FreeSpaceOrder);
+	std::inplace_merge(freeRectangles.begin(), middle, freeRectangles.end(), FreeSpaceOrder);
+}
+
+void MaxRectsBinPack::RebuildFreeLevels()
+{
+	++freeListVersion;
+	freeLevels.clear();
+	for(size_t i = 0; i < freeRectangles.size(); ++i)
+	{
+		const FreeRect3d &r = freeRectangles[i];
+		if (freeLevels.empty() || freeLevels.back().y != r.y)
+		{
+			FreeLevel level;
+			memset(&level, 0, sizeof(FreeLevel));
+			level.y = r.y;
+			level.begin = i;
+			freeLevels.push_back(level);
 		}
-		return false;
-	});
+		FreeLevel &level = freeLevels.back();
+		level.end = i + 1;
+		level.maxSpanWidth = max(level.maxSpanWidth, r.x + r.width - r.supportx0);
+		level.maxSpanHeight = max(level.maxSpanHeight, r.y + r.height - r.supporty0);
+		level.maxDepth = max(level.maxDepth, r.depth);
+	}
 }
 
 bool MaxRectsBinPack::isBlocked(const Rect3d& usedRect, const Rect3d& newNode) const{
@@ -128,8 +770,64 @@ bool MaxRectsBinPack::isBlocked(const Rect3d& usedRect, const Rect3d& newNode) c
 	return false;
 }
 
-Rect3d MaxRectsBinPack::FindPositionForNewNodeBottomLeft(int width, int height, int depth, int &bestY, int &bestX, int& bestZ) const
+void MaxRectsBinPack::SetGripperClearance(const ClearanceEnvelope &upright, const ClearanceEnvelope &flipped,
+	int cellSize, bool binHasWalls)
+{
+	clearanceEnabled = true;
+	uprightClearance = upright;
+	flippedClearance = flipped;
+	clearanceCellSize = cellSize;
+	clearanceBinHasWalls = binHasWalls;
+	++freeListVersion;
+
+	// Catch up on the boxes packed so far.
+	heightField.Init(binWidth, binHeight, clearanceCellSize);
+	for(size_t i = 0; i < usedRectangles.size(); ++i)
+	{
+		const Rect3d &r = usedRectangles[i];
+		heightField.RaiseTo(r.x, r.y, r.x + r.width, r.y + r.height, r.z + r.depth);
+	}
+}
+
+bool MaxRectsBinPack::HasClearance(const Rect3d &rect, const ClearanceEnvelope &envelope) const
+{
+	const int x0 = rect.x - envelope.marginXNeg;
+	const int x1 = rect.x + rect.width + envelope.marginXPos;
+	const int y0 = rect.y - envelope.marginYNeg;
+	const int y1 = rect.y + rect.height + envelope.marginYPos;
+	if (clearanceBinHasWalls && (x0 < 0 || y0 < 0 || x1 > binWidth || y1 > binHeight))
+		return false;
+
+	// The gripper reaches down to fingerDepth below the top of the box, and nothing may stick out above that
+	// level around the box. The box itself rests at rect.z, which is fine as long as fingerDepth <= depth.
+	return heightField.MaxHeight(x0, y0, x1, y1) <= rect.z + rect.depth - envelope.fingerDepth;
+}
+
+bool MaxRectsBinPack::IsPlacementBlocked(const Rect3d &rect, const ClearanceEnvelope &envelope) const
+{
+	TraceScope trace(traceRecorder, "blocked");
+	// The clearance check is logarithmic, so it goes before the scan over the packed boxes.
+	bool blocked = clearanceEnabled && !HasClearance(rect, envelope);
+	if (!blocked)
+		blocked = IsBlocked(rect);
+	trace.SetArgs("used", usedRectangles.size(), "blocked", blocked);
+	return blocked;
+}
+
+bool MaxRectsBinPack::IsBlocked(const Rect3d &rect) const
+{
+	for(size_t j = 0; j < usedRectangles.size(); ++j)
+		if (isBlocked(usedRectangles[j], rect))
+			return true;
+	return false;
+}
+
+Rect3d MaxRectsBinPack::FindPositionForNewNodeBottomLeft(int width, int height, int depth, int &bestY, int &bestX, int& bestZ,
+	Clock::time_point deadline) const
 {
+	TraceScope trace(traceRecorder, "scan");
+	trace.SetArgs("free", freeRectangles.size(), "levels", freeLevels.size());
+	const bool checkDeadline = deadline != Clock::time_point::max();
 	Rect3d bestNode;
 	memset(&bestNode, 0, sizeof(Rect3d));
 
@@ -138,53 +836,67 @@ Rect3d MaxRectsBinPack::FindPositionForNewNodeBottomLeft(int width, int height,
 	bestZ = std::numeric_limits<int>::max();	
 
     bool blocked = false;
-	for(size_t i = 0; i < freeRectangles.size(); ++i)
-	{	
-		int supportWidth = freeRectangles[i].supportx1 - freeRectangles[i].supportx0;		
-		int supportHeight = freeRectangles[i].supporty1 - freeRectangles[i].supporty0;
-		printFreeRect(std::string("free space:")+std::to_string(i), freeRectangles[i]);
-		// Try to place the rectangle in upright (non-flipped) orientation.
-		if (freeRectangles[i].width >= width && freeRectangles[i].height >= height && freeRectangles[i].depth >= depth && supportHeight >= height * supportTh && supportWidth >= width*supportTh)
-		{
-			bestNode.x = freeRectangles[i].supportx0;
-			bestNode.y = freeRectangles[i].supporty0;
-			bestNode.z = freeRectangles[i].z;
-			bestNode.width = width;
-			bestNode.height = height;
-			bestNode.depth = depth;
-			bestY = bestNode.y + height;
-			bestX = bestNode.x;
-			bestZ = bestNode.z;			
-			for(size_t j = 0; j < usedRectangles.size(); ++j){
-				if(isBlocked(usedRectangles[j], bestNode)){
-					blocked = true;
-					break;
-				}
-			}
-			if(blocked == false){
-				return bestNode;
-			}
-		}
-		if (binAllowFlip && freeRectangles[i].width >= height && freeRectangles[i].height >= width && freeRectangles[i].depth >= depth && supportHeight >= width * supportTh && supportWidth >= height*supportTh)
+	for(size_t l = 0; l < freeLevels.size(); ++l)
+	{
+		// Skip the whole level if none of its spaces is large enough for the box in either orientation.
+		const FreeLevel &level = freeLevels[l];
+		if (depth > level.maxDepth ||
+			!((width <= level.maxSpanWidth && height <= level.maxSpanHeight) ||
+			(binAllowFlip && height <= level.maxSpanWidth && width <= level.maxSpanHeight)))
+			continue;
+		for(size_t i = level.begin; i < level.end; ++i)
 		{	
-			bestNode.x = freeRectangles[i].supportx0;
-			bestNode.y = freeRectangles[i].supporty0;
-			bestNode.z = freeRectangles[i].z;
-			bestNode.width = height;
-			bestNode.height = width;
-			bestNode.depth = depth;
-			bestY = bestNode.y + width;
-			bestX = bestNode.x;
-			bestZ = bestNode.z;
-			blocked = false;
-			for(size_t j = 0; j < usedRectangles.size(); ++j){
-				if(isBlocked(usedRectangles[j], bestNode)){
-					blocked = true;
-					break;
+			int supportWidth = freeRectangles[i].supportx1 - freeRectangles[i].supportx0;		
+			int supportHeight = freeRectangles[i].supporty1 - freeRectangles[i].supporty0;
+			// The box goes to the support origin, so that is where the free space has to be large enough.
+			int spanWidth = freeRectangles[i].x + freeRectangles[i].width - freeRectangles[i].supportx0;
+			int spanHeight = freeRectangles[i].y + freeRectangles[i].height - freeRectangles[i].supporty0;
+#ifdef DEBUG_BIN_PACK
+			printFreeRect(std::string("free space:")+std::to_string(i), freeRectangles[i]);
+#endif
+			// Try to place the rectangle in upright (non-flipped) orientation.
+			if (spanWidth >= width && spanHeight >= height && freeRectangles[i].depth >= depth && supportHeight >= height * supportTh && supportWidth >= width*supportTh)
+			{
+				bestNode.x = freeRectangles[i].supportx0;
+				bestNode.y = freeRectangles[i].supporty0;
+				bestNode.z = freeRectangles[i].z;
+				bestNode.width = width;
+				bestNode.height = height;
+				bestNode.depth = depth;
+				bestY = bestNode.y + height;
+				bestX = bestNode.x;
+				bestZ = bestNode.z;			
+				// The validity checks are the expensive part of the scan, so this is where the time runs out.
+				if (checkDeadline && Clock::now() >= deadline)
+				{
+					memset(&bestNode, 0, sizeof(Rect3d));
+					return bestNode;
+				}
+				blocked = IsPlacementBlocked(bestNode, uprightClearance);
+				if(blocked == false){
+					return bestNode;
 				}
 			}
-			if(blocked == false){
-				return bestNode;
+			if (binAllowFlip && spanWidth >= height && spanHeight >= width && freeRectangles[i].depth >= depth && supportHeight >= width * supportTh && supportWidth >= height*supportTh)
+			{	
+				bestNode.x = freeRectangles[i].supportx0;
+				bestNode.y = freeRectangles[i].supporty0;
+				bestNode.z = freeRectangles[i].z;
+				bestNode.width = height;
+				bestNode.height = width;
+				bestNode.depth = depth;
+				bestY = bestNode.y + width;
+				bestX = bestNode.x;
+				bestZ = bestNode.z;
+				if (checkDeadline && Clock::now() >= deadline)
+				{
+					memset(&bestNode, 0, sizeof(Rect3d));
+					return bestNode;
+				}
+				blocked = IsPlacementBlocked(bestNode, flippedClearance);
+				if(blocked == false){
+					return bestNode;
+				}
 			}
 		}
 	}
@@ -411,6 +1123,17 @@ int CommonIntervalLength(int i1start, int i1end, int i2start, int i2end)
 // }
 
 bool MaxRectsBinPack::SplitFreeNode(FreeRect3d freeNode, const Rect3d& usedNode)
+{
+	splitProducts.clear();
+	if (!SplitFreeNodeInto(freeNode, usedNode, splitProducts))
+		return false;
+
+	for(size_t i = 0; i < splitProducts.size(); ++i)
+		AddFreeRect(splitProducts[i]);
+	return true;
+}
+
+bool MaxRectsBinPack::SplitFreeNodeInto(const FreeRect3d &freeNode, const Rect3d& usedNode, std::vector<FreeRect3d> &out) const
 {	
 	printFreeRect("freeNode:",freeNode);	
 	printRect("usedNode:", usedNode);
@@ -433,7 +1156,7 @@ bool MaxRectsBinPack::SplitFreeNode(FreeRect3d freeNode, const Rect3d& usedNode)
 		
 		printFreeRect("cut space along xoz....................",newNode);
 
-		freeRectangles.push_back(newNode);
+		out.push_back(newNode);
 	}
     
 	// New node at the bottom side of the used node. cut space along xoz plane
@@ -446,7 +1169,7 @@ bool MaxRectsBinPack::SplitFreeNode(FreeRect3d freeNode, const Rect3d& usedNode)
 
 		printFreeRect("cut space along xoz................", newNode);        
 		
-		freeRectangles.push_back(newNode);
+		out.push_back(newNode);
 		
 	}
     
@@ -459,7 +1182,7 @@ bool MaxRectsBinPack::SplitFreeNode(FreeRect3d freeNode, const Rect3d& usedNode)
     
  		printFreeRect("cut space along yoz...............", newNode);
 
-		freeRectangles.push_back(newNode);
+		out.push_back(newNode);
 	}    
 	
 	// New node at the right side of the used node. cut space along zoy plane
@@ -472,7 +1195,7 @@ bool MaxRectsBinPack::SplitFreeNode(FreeRect3d freeNode, const Rect3d& usedNode)
         
 		printFreeRect("cut space along yoz............", newNode);
 
-		freeRectangles.push_back(newNode);
+		out.push_back(newNode);
 	}
     
 	// New node at bottom of the used node. cut space along xoy plane
@@ -482,7 +1205,7 @@ bool MaxRectsBinPack::SplitFreeNode(FreeRect3d freeNode, const Rect3d& usedNode)
 		
 		printFreeRect("cut space along xoy...........", newNode);
 
-		freeRectangles.push_back(newNode);
+		out.push_back(newNode);
 	}
 
 	// New node at top of the used node. cut space along xoy plane
@@ -495,7 +1218,7 @@ bool MaxRectsBinPack::SplitFreeNode(FreeRect3d freeNode, const Rect3d& usedNode)
 		newNode.supporty0 = usedNode.y;
 		newNode.supporty1 = usedNode.y + usedNode.height;				
 		printFreeRect("cut space along xoy.................",newNode);
-		freeRectangles.push_back(newNode);
+		out.push_back(newNode);
 	}	
 	return true;
 }
@@ -522,21 +1245,140 @@ void MaxRectsBinPack::PruneFreeList()
 	*/
 
 	/// Go through each pair and remove any rectangle that is redundant.
-	for(size_t i = 0; i < freeRectangles.size(); ++i)
-		for(size_t j = i+1; j < freeRectangles.size(); ++j)
+	pruneCursor = 0;
+	if (prunePool && freeRectangles.size() >= minParallelPruneSize)
+	{
+		TraceScope trace(traceRecorder, "prune");
+		const size_t numBefore = freeRectangles.size();
+		PruneFreeSpacesParallel(freeRectangles, prunePool);
+		pruneDeferred = false;
+		trace.SetArgs("before", numBefore, "after", freeRectangles.size());
+		return;
+	}
+	PruneFreeListUntil(Clock::time_point::max());
+}
+
+bool MaxRectsBinPack::PruneFreeListUntil(Clock::time_point deadline)
+{
+	TraceScope trace(traceRecorder, "prune");
+	const size_t numBefore = freeRectangles.size();
+	bool done = PruneFreeSpaces(freeRectangles, pruneCursor, deadline);
+	trace.SetArgs("before", numBefore, "after", freeRectangles.size());
+	if (!done)
+		return false;
+	pruneDeferred = false;
+	return true;
+}
+
+bool MaxRectsBinPack::PruneFreeSpaces(std::vector<FreeRect3d> &spaces, size_t &cursor, Clock::time_point deadline)
+{
+	const bool checkDeadline = deadline != Clock::time_point::max();
+	while(cursor < spaces.size())
+	{
+		if (checkDeadline && Clock::now() >= deadline)
+			return false;
+
+		const size_t i = cursor;
+		bool redundant = false;
+		for(size_t j = i+1; j < spaces.size(); ++j)
 		{
-			if (IsContainedInFree3d(freeRectangles[i], freeRectangles[j]))
+			if (IsContainedInFree3d(spaces[i], spaces[j]))
 			{
-				freeRectangles.erase(freeRectangles.begin()+i);
-				--i;
+				spaces.erase(spaces.begin()+i);
+				redundant = true;
 				break;
 			}
-			if (IsContainedInFree3d(freeRectangles[j], freeRectangles[i]))
+			if (IsContainedInFree3d(spaces[j], spaces[i]))
 			{
-				freeRectangles.erase(freeRectangles.begin()+j);
+				spaces.erase(spaces.begin()+j);
 				--j;
 			}
 		}
+		if (!redundant)
+			++cursor;
+	}
+	return true;
+}
+
+void MaxRectsBinPack::PruneFreeSpacesParallel(std::vector<FreeRect3d> &spaces, ThreadPool *pool)
+{
+	const size_t numSpaces = spaces.size();
+
+	// A space can only be contained in the spaces that start at or below it in y, and in those with at least its
+	// footprint. Keep copies of the list in both orders, so that each space picks the shorter candidate prefix.
+	std::vector<size_t> byY(numSpaces);
+	std::vector<size_t> byArea(numSpaces);
+	for(size_t i = 0; i < numSpaces; ++i)
+		byY[i] = byArea[i] = i;
+	std::stable_sort(byY.begin(), byY.end(), [&](size_t a, size_t b) { return spaces[a].y < spaces[b].y; });
+	std::stable_sort(byArea.begin(), byArea.end(), [&](size_t a, size_t b)
+		{ return FootprintArea(spaces[a]) > FootprintArea(spaces[b]); });
+
+	std::vector<FreeRect3d> spacesByY(numSpaces);
+	std::vector<FreeRect3d> spacesByArea(numSpaces);
+	std::vector<int> sortedY(numSpaces);
+	std::vector<long long> sortedNegativeArea(numSpaces);
+	for(size_t k = 0; k < numSpaces; ++k)
+	{
+		spacesByY[k] = spaces[byY[k]];
+		sortedY[k] = spacesByY[k].y;
+		spacesByArea[k] = spaces[byArea[k]];
+		sortedNegativeArea[k] = -FootprintArea(spacesByArea[k]);
+	}
+
+	// Every chunk writes the flags of its own spaces only.
+	std::vector<char> keep(numSpaces, 0);
+	const size_t numChunks = (pool && pool->NumThreads() > 1) ? min<size_t>(numSpaces, pool->NumThreads() * 8) : 1;
+	auto testChunk = [&](int chunk, int)
+	{
+		const size_t begin = numSpaces * chunk / numChunks;
+		const size_t end = numSpaces * (chunk + 1) / numChunks;
+		for(size_t i = begin; i < end; ++i)
+		{
+			const FreeRect3d &space = spaces[i];
+			const size_t numBelow = upper_bound(sortedY.begin(), sortedY.end(), space.y) - sortedY.begin();
+			const size_t numLarger = upper_bound(sortedNegativeArea.begin(), sortedNegativeArea.end(),
+				-FootprintArea(space)) - sortedNegativeArea.begin();
+			const bool useY = numBelow < numLarger;
+			const FreeRect3d *candidates = useY ? &spacesByY[0] : &spacesByArea[0];
+			const size_t *indices = useY ? &byY[0] : &byArea[0];
+			const size_t numCandidates = useY ? numBelow : numLarger;
+
+			bool redundant = false;
+			for(size_t k = 0; k < numCandidates && !redundant; ++k)
+			{
+				if (!IsContainedInFree3d(space, candidates[k]) || indices[k] == i)
+					continue;
+				// Of equal spaces, PruneFreeSpaces keeps the last one.
+				redundant = !IsContainedInFree3d(candidates[k], space) || indices[k] > i;
+			}
+			keep[i] = !redundant;
+		}
+	};
+	if (numChunks > 1)
+		pool->ParallelFor((int)numChunks, testChunk);
+	else if (numSpaces > 0)
+		testChunk(0, 0);
+
+	size_t kept = 0;
+	for(size_t i = 0; i < numSpaces; ++i)
+		if (keep[i])
+			spaces[kept++] = spaces[i];
+	spaces.resize(kept);
+}
+
+void MaxRectsBinPack::PublishPrunedFreeList(const std::vector<FreeRect3d> &pruned,
+	const std::vector<Rect3d> &placedSince)
+{
+	freeRectangles = pruned;
+	// The products are pruned as they are added, and the spaces of the copy are already pruned, so the result
+	// needs no further pruning.
+	for(size_t i = 0; i < placedSince.size(); ++i)
+		SplitFreeList(placedSince[i], true);
+	pruneDeferred = false;
+	pruneCursor = 0;
+	EnforceFreeListCap();
+	RebuildFreeLevels();
 }
 
 }
@@ -0,0 +1,151 @@
+/** @file NormalPatternLattice.cpp
+	@brief The coordinates along each axis of a bin that a known set of box sizes can reach (normal patterns).
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#include <algorithm>
+
+#include "../include/NormalPatternLattice.h"
+
+namespace rbp {
+
+using namespace std;
+
+namespace {
+
+typedef unsigned long long Word;
+const int wordBits = 64;
+
+/// bits |= bits << shift, for a bitset of numBits bits.
+void ShiftOr(vector<Word> &bits, int shift, int numBits)
+{
+	const int wordShift = shift / wordBits;
+	const int bitShift = shift % wordBits;
+	// Going down from the top word only reads words that have not been updated yet.
+	for(int i = (int)bits.size() - 1; i >= wordShift; --i)
+	{
+		Word shifted = bits[i - wordShift] << bitShift;
+		if (bitShift != 0 && i - wordShift - 1 >= 0)
+			shifted |= bits[i - wordShift - 1] >> (wordBits - bitShift);
+		bits[i] |= shifted;
+	}
+	if (numBits % wordBits != 0)
+		bits.back() &= (Word(1) << (numBits % wordBits)) - 1;
+}
+
+bool TestBit(const vector<Word> &bits, int bit)
+{
+	return (bits[bit / wordBits] >> (bit % wordBits)) & 1;
+}
+
+}
+
+NormalPatternLattice::NormalPatternLattice()
+{
+	for(int i = 0; i < 3; ++i)
+		BuildAxis(axes[i], 0, vector<int>());
+}
+
+void NormalPatternLattice::Build(const std::vector<RectSize3d> &sizes, int binWidth, int binHeight, int binDepth,
+	bool allowFlip)
+{
+	vector<int> widths, heights, depths;
+	for(size_t i = 0; i < sizes.size(); ++i)
+	{
+		widths.push_back(sizes[i].width);
+		heights.push_back(sizes[i].height);
+		depths.push_back(sizes[i].depth);
+		if (allowFlip)
+		{
+			widths.push_back(sizes[i].height);
+			heights.push_back(sizes[i].width);
+		}
+	}
+	BuildAxis(axes[AxisX], binWidth, widths);
+	BuildAxis(axes[AxisY], binHeight, heights);
+	BuildAxis(axes[AxisZ], binDepth, depths);
+}
+
+void NormalPatternLattice::BuildAxis(AxisLattice &lattice, int size, std::vector<int> sides)
+{
+	size = max(size, 0);
+	lattice.size = size;
+	sort(sides.begin(), sides.end());
+	sides.erase(unique(sides.begin(), sides.end()), sides.end());
+	sides.erase(remove_if(sides.begin(), sides.end(), [size](int side) { return side <= 0 || side > size; }),
+		sides.end());
+
+	// Unbounded subset sums: after the shifts by side, 2*side, 4*side, ... every sum may use up to 1, 3, 7, ...
+	// copies of side, which covers all the copies that fit into the bin.
+	const int numBits = size + 1;
+	lattice.reachable.assign((numBits + wordBits - 1) / wordBits, 0);
+	lattice.reachable[0] = 1;
+	for(size_t i = 0; i < sides.size(); ++i)
+		for(long long shift = sides[i]; shift <= size; shift *= 2)
+			ShiftOr(lattice.reachable, (int)shift, numBits);
+
+	// A box can only start where the smallest side still fits.
+	const int lastStart = sides.empty() ? -1 : size - sides[0];
+	lattice.positions.clear();
+	lattice.down.resize(numBits);
+	int last = 0;
+	for(int c = 0; c <= size; ++c)
+	{
+		if (TestBit(lattice.reachable, c))
+		{
+			last = c;
+			if (c <= lastStart)
+				lattice.positions.push_back(c);
+		}
+		lattice.down[c] = last;
+	}
+	lattice.up.resize(numBits);
+	int next = size;
+	for(int c = size; c >= 0; --c)
+	{
+		if (c <= lastStart && TestBit(lattice.reachable, c))
+			next = c;
+		lattice.up[c] = next;
+	}
+}
+
+bool NormalPatternLattice::IsReachable(Axis axis, int coordinate) const
+{
+	const AxisLattice &lattice = axes[axis];
+	return coordinate >= 0 && coordinate <= lattice.size && TestBit(lattice.reachable, coordinate);
+}
+
+int NormalPatternLattice::SnapUp(Axis axis, int coordinate) const
+{
+	const AxisLattice &lattice = axes[axis];
+	if (coordinate > lattice.size)
+		return lattice.size;
+	return lattice.up[max(coordinate, 0)];
+}
+
+int NormalPatternLattice::SnapDown(Axis axis, int coordinate) const
+{
+	const AxisLattice &lattice = axes[axis];
+	if (coordinate < 0)
+		return coordinate;
+	return lattice.down[min(coordinate, lattice.size)];
+}
+
+int NormalPatternLattice::IndexOf(Axis axis, int coordinate) const
+{
+	const vector<int> &positions = axes[axis].positions;
+	vector<int>::const_iterator it = lower_bound(positions.begin(), positions.end(), coordinate);
+	if (it == positions.end() || *it != coordinate)
+		return -1;
+	return (int)(it - positions.begin());
+}
+
+size_t NormalPatternLattice::MemoryBytes() const
+{
+	size_t bytes = 0;
+	for(int i = 0; i < 3; ++i)
+		bytes += axes[i].reachable.capacity() * sizeof(Word) + (axes[i].positions.capacity() +
+			axes[i].up.capacity() + axes[i].down.capacity()) * sizeof(int);
+	return bytes;
+}
+
+}
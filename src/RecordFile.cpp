@@ -0,0 +1,203 @@
+/** @file RecordFile.cpp
+	@brief Fixed-record binary files for bulk replays: box manifests in, Rect3d placements out.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#include <algorithm>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/RecordFile.h"
+
+namespace rbp {
+
+using namespace std;
+
+static_assert(sizeof(RecordFileHeader) == 32, "the record file header must not be padded");
+static_assert(sizeof(ManifestRecord) == 16, "manifest records must not be padded");
+static_assert(sizeof(Rect3d) == 24, "placement records must not be padded");
+
+const char RecordFileReader::manifestMagic[8] = { 'R', 'B', 'P', 'M', 'A', 'N', 'I', '1' };
+const char RecordFileReader::placementMagic[8] = { 'R', 'B', 'P', 'P', 'L', 'A', 'C', '1' };
+
+RecordFileReader::RecordFileReader()
+:data(0),
+size(0)
+{
+	memset(&header, 0, sizeof(header));
+}
+
+RecordFileReader::~RecordFileReader()
+{
+	Close();
+}
+
+bool RecordFileReader::Open(const std::string &path, const char *magic, uint32_t recordSize)
+{
+	Close();
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		error = path + ": " + strerror(errno);
+		return false;
+	}
+	struct stat info;
+	if (fstat(fd, &info) < 0)
+	{
+		error = path + ": " + strerror(errno);
+		close(fd);
+		return false;
+	}
+	if ((size_t)info.st_size < sizeof(RecordFileHeader))
+	{
+		error = path + ": too short for a record file header";
+		close(fd);
+		return false;
+	}
+
+	void *mapped = mmap(0, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping keeps its own reference to the file.
+	close(fd);
+	if (mapped == MAP_FAILED)
+	{
+		error = path + ": " + strerror(errno);
+		return false;
+	}
+	madvise(mapped, (size_t)info.st_size, MADV_SEQUENTIAL);
+	data = (const char *)mapped;
+	size = (size_t)info.st_size;
+	memcpy(&header, data, sizeof(header));
+
+	const bool knownMagic = memcmp(header.magic, manifestMagic, 8) == 0 || memcmp(header.magic, placementMagic, 8) == 0;
+	if (magic ? memcmp(header.magic, magic, 8) != 0 : !knownMagic)
+		error = path + ": not a record file of the expected kind";
+	else if (header.recordSize != recordSize)
+		error = path + ": unexpected record size";
+	else if (header.count > (size - sizeof(RecordFileHeader)) / recordSize)
+		error = path + ": shorter than its record count";
+	else
+		return true;
+	Close();
+	return false;
+}
+
+void RecordFileReader::Close()
+{
+	if (data)
+		munmap((void *)data, size);
+	data = 0;
+	size = 0;
+	memset(&header, 0, sizeof(header));
+}
+
+bool RecordFileReader::IsManifest() const
+{
+	return memcmp(header.magic, manifestMagic, 8) == 0;
+}
+
+RecordFileWriter::RecordFileWriter()
+:fd(-1),
+failed(false),
+used(0)
+{
+	memset(&header, 0, sizeof(header));
+}
+
+RecordFileWriter::~RecordFileWriter()
+{
+	if (fd >= 0)
+		Close();
+}
+
+bool RecordFileWriter::Open(const std::string &path, const char *magic, uint32_t recordSize,
+	int binWidth, int binHeight, int binDepth)
+{
+	if (fd >= 0)
+		Close();
+
+	failed = false;
+	error.clear();
+	fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		failed = true;
+		error = path + ": " + strerror(errno);
+		return false;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, magic, 8);
+	header.recordSize = recordSize;
+	header.binWidth = binWidth;
+	header.binHeight = binHeight;
+	header.binDepth = binDepth;
+
+	// A whole number of records per megabyte or so, so that Append never splits a record.
+	buffer.resize(max<size_t>(1, (1 << 20) / recordSize) * recordSize);
+	used = 0;
+	return WriteAll((const char *)&header, sizeof(header));
+}
+
+bool RecordFileWriter::Append(const void *record)
+{
+	if (failed)
+		return false;
+	if (used == buffer.size() && !Flush())
+		return false;
+	memcpy(&buffer[used], record, header.recordSize);
+	used += header.recordSize;
+	++header.count;
+	return true;
+}
+
+bool RecordFileWriter::Flush()
+{
+	bool ok = WriteAll(&buffer[0], used);
+	used = 0;
+	return ok;
+}
+
+bool RecordFileWriter::WriteAll(const char *bytes, size_t length)
+{
+	while(length > 0 && !failed)
+	{
+		ssize_t written = write(fd, bytes, length);
+		if (written < 0)
+		{
+			if (errno != EINTR)
+				Fail("write");
+			continue;
+		}
+		bytes += written;
+		length -= (size_t)written;
+	}
+	return !failed;
+}
+
+void RecordFileWriter::Fail(const char *what)
+{
+	failed = true;
+	error = std::string(what) + ": " + strerror(errno);
+}
+
+bool RecordFileWriter::Close()
+{
+	if (fd < 0)
+		return !failed;
+	if (!failed)
+		Flush();
+	if (!failed && pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+		Fail("pwrite");
+	if (close(fd) < 0 && !failed)
+		Fail("close");
+	fd = -1;
+	return !failed;
+}
+
+}
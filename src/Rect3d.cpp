@@ -3,25 +3,37 @@
 	This work is released to Public Domain, do whatever you want with it.
 */
 #include <utility>
+#include <algorithm>
 
 #include "../include/Rect3d.h"
 
 namespace rbp {
 
-bool IsContainedIn3d(const Rect3d &a, const Rect3d &b)
+int CompareRectShortSide3d(const Rect3d &a, const Rect3d &b)
 {
-	return a.x >= b.x && a.y >= b.y 
-		&& a.x+a.width <= b.x+b.width 
-		&& a.y+a.height <= b.y+b.height
-		&& a.z + a.depth <= b.z + b.depth;
+	using namespace std;
+
+	int smallerSideA = min(min(a.width, a.height), a.depth);
+	int smallerSideB = min(min(b.width, b.height), b.depth);
+
+	if (smallerSideA != smallerSideB)
+		return (smallerSideA < smallerSideB) ? -1 : 1;
+
+	// Tie-break on the larger side.
+	int largerSideA = max(max(a.width, a.height), a.depth);
+	int largerSideB = max(max(b.width, b.height), b.depth);
+
+	if (largerSideA != largerSideB)
+		return (largerSideA < largerSideB) ? -1 : 1;
+	return 0;
 }
 
-bool IsContainedInFree3d(const FreeRect3d &a, const FreeRect3d &b)
+bool IsContainedIn3d(const Rect3d &a, const Rect3d &b)
 {
 	return a.x >= b.x && a.y >= b.y 
 		&& a.x+a.width <= b.x+b.width 
-		&& a.y+a.height <= b.y+b.height 
-		&& a.z >= b.z && a.z + a.depth >= b.z + b.depth;
+		&& a.y+a.height <= b.y+b.height
+		&& a.z + a.depth <= b.z + b.depth;
 }
 
 }
\ No newline at end of file
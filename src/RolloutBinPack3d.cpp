@@ -0,0 +1,133 @@
+/** @file RolloutBinPack3d.cpp
+	@brief Picks online placements by Monte-Carlo rollouts over the observed box distribution.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#include <chrono>
+#include <random>
+
+#include <cassert>
+#include <cstring>
+
+#include "../include/RolloutBinPack3d.h"
+
+namespace rbp {
+
+using namespace std;
+
+RolloutBinPack3d::RolloutBinPack3d(int width, int height, int depth, int numThreads)
+:mergePolicy(GuillotineBinPack3d::MergeLazy),
+splitMethod(GuillotineBinPack3d::SplitShorterLeftoverAxis),
+numCandidates(8),
+numRollouts(16),
+horizon(16),
+decisionBudget(50.0),
+rolloutSeed(1),
+lastNumRollouts(0),
+pool(new ThreadPool(numThreads))
+{
+	arenas.resize(pool->NumThreads());
+	Init(width, height, depth);
+}
+
+void RolloutBinPack3d::Init(int width, int height, int depth)
+{
+	packer.Init(width, height, depth);
+}
+
+void RolloutBinPack3d::SetRolloutParameters(int numCandidates_, int numRollouts_, int horizon_)
+{
+	assert(numCandidates_ > 0 && numRollouts_ >= 0 && horizon_ >= 0);
+	numCandidates = numCandidates_;
+	numRollouts = numRollouts_;
+	horizon = horizon_;
+}
+
+void RolloutBinPack3d::SetHeuristics(GuillotineBinPack3d::MergePolicy mergePolicy_,
+	GuillotineBinPack3d::GuillotineSplitHeuristic splitMethod_)
+{
+	mergePolicy = mergePolicy_;
+	splitMethod = splitMethod_;
+}
+
+double RolloutBinPack3d::Rollout(GuillotineBinPack3d &arena, const Rect3d &candidate, unsigned int seed) const
+{
+	// Assigning into the arena reuses the memory of its vectors.
+	arena = packer;
+	arena.InsertAt(candidate, GuillotineBinPack3d::MergeNever, splitMethod);
+	double filled = (double)candidate.width * candidate.height * candidate.depth;
+
+	// The cheap greedy packer: first fit, no merging.
+	std::mt19937 rng(seed);
+	for(int i = 0; i < horizon; ++i)
+	{
+		RectSize3d box = histogram.Sample(rng);
+		Rect3d placed = arena.Insert(box.width, box.height, box.depth, GuillotineBinPack3d::MergeNever,
+			GuillotineBinPack3d::RectBestShortSideFit, splitMethod);
+		filled += (double)placed.width * placed.height * placed.depth;
+	}
+	return filled;
+}
+
+Rect3d RolloutBinPack3d::Insert(int width, int height, int depth)
+{
+	typedef std::chrono::steady_clock Clock;
+	const Clock::time_point deadline = Clock::now() +
+		std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(decisionBudget));
+
+	histogram.Add(width, height, depth);
+	lastNumRollouts = 0;
+
+	Rect3d newNode;
+	memset(&newNode, 0, sizeof(Rect3d));
+	packer.FindCandidatePositions(width, height, depth, numCandidates, candidates);
+	if (candidates.empty())
+		return newNode;
+
+	size_t best = 0;
+	if (candidates.size() > 1 && numRollouts > 0)
+	{
+		histogram.Prepare();
+		const int numCandidatesFound = (int)candidates.size();
+		const int numTasks = numCandidatesFound * numRollouts;
+		rolloutFill.assign(numTasks, -1.0);
+
+		// Rollout r of every candidate comes before rollout r + 1 of any, so that a deadline cuts all candidates
+		// to about the same number of rollouts.
+		const unsigned int seed = rolloutSeed;
+		pool->ParallelFor(numTasks, [&](int task, int thread)
+		{
+			if (Clock::now() >= deadline)
+				return;
+			const int c = task % numCandidatesFound;
+			const int r = task / numCandidatesFound;
+			rolloutFill[task] = Rollout(arenas[thread], candidates[c], seed + 7919u * (unsigned int)r);
+		});
+		++rolloutSeed;
+
+		// Compare the candidates on the rollouts that finished for all of them.
+		int numComplete = numRollouts;
+		for(int task = 0; task < numTasks; ++task)
+			if (rolloutFill[task] < 0.0)
+				numComplete = min(numComplete, task / numCandidatesFound);
+
+		double bestFill = -1.0;
+		for(int c = 0; c < numCandidatesFound && numComplete > 0; ++c)
+		{
+			double fill = 0.0;
+			for(int r = 0; r < numComplete; ++r)
+				fill += rolloutFill[r * numCandidatesFound + c];
+			if (fill > bestFill)
+			{
+				bestFill = fill;
+				best = c;
+			}
+		}
+		lastNumRollouts = numComplete * numCandidatesFound;
+	}
+
+	newNode = candidates[best];
+	packer.InsertAt(newNode, mergePolicy, splitMethod);
+	return newNode;
+}
+
+}
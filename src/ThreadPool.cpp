@@ -0,0 +1,104 @@
+/** @file ThreadPool.cpp
+	@brief A fixed set of worker threads for data-parallel loops.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#include <algorithm>
+
+#include <cassert>
+
+#include "../include/ThreadPool.h"
+
+namespace rbp {
+
+using namespace std;
+
+ThreadPool::ThreadPool(int numThreads)
+:body(0),
+count(0),
+nextIndex(0),
+numPending(0),
+generation(0),
+stopping(false)
+{
+	if (numThreads <= 0)
+		numThreads = max(1, (int)std::thread::hardware_concurrency());
+
+	for(int i = 1; i < numThreads; ++i)
+		workers.push_back(std::thread(&ThreadPool::WorkerMain, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	workReady.notify_all();
+	for(size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+}
+
+void ThreadPool::RunIterations(const std::function<void(int, int)> &loopBody, int loopCount, int thread)
+{
+	for(int i = nextIndex.fetch_add(1); i < loopCount; i = nextIndex.fetch_add(1))
+		loopBody(i, thread);
+}
+
+void ThreadPool::WorkerMain(int thread)
+{
+	unsigned long seenGeneration = 0;
+	for(;;)
+	{
+		const std::function<void(int, int)> *loopBody;
+		int loopCount;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			while(!stopping && generation == seenGeneration)
+				workReady.wait(guard);
+			if (stopping)
+				return;
+			seenGeneration = generation;
+			loopBody = body;
+			loopCount = count;
+		}
+
+		RunIterations(*loopBody, loopCount, thread);
+
+		std::lock_guard<std::mutex> guard(lock);
+		if (--numPending == 0)
+			workDone.notify_all();
+	}
+}
+
+void ThreadPool::ParallelFor(int loopCount, const std::function<void(int index, int thread)> &loopBody)
+{
+	if (loopCount <= 0)
+		return;
+
+	if (workers.empty() || loopCount == 1)
+	{
+		for(int i = 0; i < loopCount; ++i)
+			loopBody(i, 0);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		body = &loopBody;
+		count = loopCount;
+		nextIndex.store(0);
+		numPending = (int)workers.size();
+		++generation;
+	}
+	workReady.notify_all();
+
+	RunIterations(loopBody, loopCount, 0);
+
+	// A worker that wakes up late finds no iterations left, but it still reads body, so every worker has to check
+	// in before body goes out of scope. This also keeps a worker from missing a generation.
+	std::unique_lock<std::mutex> guard(lock);
+	while(numPending > 0)
+		workDone.wait(guard);
+}
+
+}
@@ -0,0 +1,216 @@
+/** @file TieredBinPack3d.cpp
+	@brief Chains the packers from cheapest to most expensive behind a single Insert.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#include <chrono>
+
+#include <cstring>
+
+#include "../include/TieredBinPack3d.h"
+
+namespace rbp {
+
+using namespace std;
+
+namespace {
+
+/// Weight of the newest sample in the moving average of the tier latencies.
+const double latencySmoothing = 0.1;
+
+/// Number of attempts a tier gets before its budget is enforced.
+const unsigned long minAttemptsBeforeSkipping = 8;
+
+/// An over-budget tier is still tried for one box in this many, so that its average follows the latency of the
+/// tier as the bin fills up instead of being frozen at the value that got it skipped.
+const unsigned long probeInterval = 64;
+
+}
+
+TieredBinPack3d::TieredBinPack3d()
+:binWidth(0),
+binHeight(0),
+binDepth(0),
+levelTierMaxZ(0),
+escalateOnNewLayer(true),
+guillotineRectChoice(GuillotineBinPack3d::RectBestAreaFit),
+guillotineSplitMethod(GuillotineBinPack3d::SplitShorterLeftoverAxis),
+usedVolume(0)
+{
+	for(int i = 0; i < NumTiers; ++i)
+	{
+		tiers[i].enabled = true;
+		tiers[i].budgetMicroseconds = 0;
+	}
+	ResetStats();
+}
+
+TieredBinPack3d::TieredBinPack3d(int width, int height, int depth)
+:TieredBinPack3d()
+{
+	Init(width, height, depth);
+}
+
+void TieredBinPack3d::Init(int width, int height, int depth)
+{
+	binWidth = width;
+	binHeight = height;
+	binDepth = depth;
+	levelTierMaxZ = depth / 2;
+
+	levelPacker.Init(width, height, depth);
+	guillotinePacker.Init(width, height, depth);
+	maxRectsPacker.Init(width, height, depth);
+
+	pendingGuillotine.clear();
+	pendingMaxRects.clear();
+	usedRectangles.clear();
+	usedVolume = 0;
+
+	ResetStats();
+}
+
+void TieredBinPack3d::ResetStats()
+{
+	for(int i = 0; i < NumTiers; ++i)
+	{
+		memset(&tiers[i].stats, 0, sizeof(TierStats));
+		tiers[i].skipsSinceAttempt = 0;
+	}
+}
+
+bool TieredBinPack3d::ShouldTry(Tier tier)
+{
+	TierState &state = tiers[tier];
+	if (!state.enabled)
+		return false;
+
+	if (tier == TierLevel && levelPacker.GetOpenLayerZ() >= levelTierMaxZ)
+		return false;
+
+	if (state.budgetMicroseconds > 0 && state.stats.attempts >= minAttemptsBeforeSkipping &&
+		state.stats.averageMicroseconds > state.budgetMicroseconds &&
+		state.skipsSinceAttempt + 1 < probeInterval)
+	{
+		++state.skipsSinceAttempt;
+		++state.stats.skipped;
+		return false;
+	}
+	return true;
+}
+
+Rect3d TieredBinPack3d::TryTier(Tier tier, int width, int height, int depth)
+{
+	switch(tier)
+	{
+	case TierLevel:
+		return levelPacker.Insert(width, height, depth);
+
+	case TierGuillotine:
+	case TierGuillotineMerge:
+		for(size_t i = 0; i < pendingGuillotine.size(); ++i)
+			guillotinePacker.PlaceRect(pendingGuillotine[i]);
+		pendingGuillotine.clear();
+		if (tier == TierGuillotineMerge)
+			guillotinePacker.MergeFreeListFull();
+		return guillotinePacker.Insert(width, height, depth, GuillotineBinPack3d::MergeNever,
+			guillotineRectChoice, guillotineSplitMethod);
+
+	case TierMaxRects:
+		for(size_t i = 0; i < pendingMaxRects.size(); ++i)
+			maxRectsPacker.PlaceRect(pendingMaxRects[i]);
+		pendingMaxRects.clear();
+		return maxRectsPacker.Insert(width, height, depth, MaxRectsBinPack::RectBottomLeftRule);
+
+	default:
+		Rect3d failed;
+		memset(&failed, 0, sizeof(Rect3d));
+		return failed;
+	}
+}
+
+void TieredBinPack3d::Share(Tier placedBy, const Rect3d &rect)
+{
+	if (placedBy != TierLevel)
+		levelPacker.MarkUsed(rect);
+	if (placedBy != TierGuillotine && placedBy != TierGuillotineMerge)
+		pendingGuillotine.push_back(rect);
+	if (placedBy != TierMaxRects)
+		pendingMaxRects.push_back(rect);
+}
+
+Rect3d TieredBinPack3d::Attempt(Tier tier, int width, int height, int depth)
+{
+	typedef std::chrono::steady_clock Clock;
+
+	Clock::time_point start = Clock::now();
+	Rect3d newNode = TryTier(tier, width, height, depth);
+	double elapsed = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+
+	tiers[tier].skipsSinceAttempt = 0;
+	TierStats &stats = tiers[tier].stats;
+	stats.averageMicroseconds = stats.attempts == 0 ? elapsed :
+		(1.0 - latencySmoothing) * stats.averageMicroseconds + latencySmoothing * elapsed;
+	++stats.attempts;
+	stats.totalMicroseconds += elapsed;
+	if (tiers[tier].budgetMicroseconds > 0 && elapsed > tiers[tier].budgetMicroseconds)
+		++stats.overBudget;
+
+	if (newNode.height == 0)
+		return newNode;
+
+	++stats.hits;
+	Share(tier, newNode);
+	usedRectangles.push_back(newNode);
+	usedVolume += (unsigned long)newNode.width * newNode.height * newNode.depth;
+	return newNode;
+}
+
+Rect3d TieredBinPack3d::Insert(int width, int height, int depth, Tier *servedBy)
+{
+	bool levelDeferred = false;
+	for(int i = 0; i < NumTiers; ++i)
+	{
+		Tier tier = (Tier)i;
+		if (!ShouldTry(tier))
+			continue;
+
+		if (tier == TierLevel && escalateOnNewLayer && levelPacker.NeedsNewLayer(width, height, depth))
+		{
+			++tiers[tier].stats.escalated;
+			levelDeferred = true;
+			continue;
+		}
+
+		Rect3d newNode = Attempt(tier, width, height, depth);
+		if (newNode.height == 0)
+			continue;
+		if (servedBy)
+			*servedBy = tier;
+		return newNode;
+	}
+
+	// None of the later tiers could take the box, so it is worth a new layer after all.
+	if (levelDeferred)
+	{
+		Rect3d newNode = Attempt(TierLevel, width, height, depth);
+		if (newNode.height != 0)
+		{
+			if (servedBy)
+				*servedBy = TierLevel;
+			return newNode;
+		}
+	}
+
+	if (servedBy)
+		*servedBy = NumTiers;
+	Rect3d failed;
+	memset(&failed, 0, sizeof(Rect3d));
+	return failed;
+}
+
+float TieredBinPack3d::Occupancy() const
+{
+	return (float)usedVolume / ((unsigned long)binWidth * binHeight * binDepth);
+}
+
+}
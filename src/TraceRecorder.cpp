@@ -0,0 +1,116 @@
+/** @file TraceRecorder.cpp
+	@brief Records timed phases of the packers into a lock-free ring buffer and writes them as a Chrome trace.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#include <functional>
+#include <thread>
+
+#include <cassert>
+#include <cstdio>
+
+#include "../include/TraceRecorder.h"
+
+namespace rbp {
+
+using namespace std;
+
+TraceRecorder::TraceRecorder(size_t capacity)
+:mask(0),
+head(0),
+tail(0),
+wroteHeader(false),
+numDropped(0),
+origin(Clock::now())
+{
+	size_t size = 1;
+	while(size < capacity)
+		size *= 2;
+	mask = size - 1;
+
+	slots.reset(new Slot[size]);
+	for(size_t i = 0; i < size; ++i)
+		slots[i].sequence.store(0, memory_order_relaxed);
+}
+
+void TraceRecorder::Record(const char *name, Clock::time_point start, Clock::time_point end,
+	const char *argName0, int64_t arg0, const char *argName1, int64_t arg1)
+{
+	const uint64_t index = head.fetch_add(1, memory_order_relaxed);
+	Slot &slot = slots[index & mask];
+
+	// Mark the slot as being written before touching the payload, so that Flush discards a torn copy.
+	slot.sequence.store(0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	slot.name.store(name, memory_order_relaxed);
+	slot.start.store(std::chrono::duration_cast<std::chrono::nanoseconds>(start - origin).count(), memory_order_relaxed);
+	slot.duration.store(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(), memory_order_relaxed);
+	slot.thread.store((uint32_t)std::hash<std::thread::id>()(std::this_thread::get_id()), memory_order_relaxed);
+	slot.argNames[0].store(argName0, memory_order_relaxed);
+	slot.args[0].store(arg0, memory_order_relaxed);
+	slot.argNames[1].store(argName1, memory_order_relaxed);
+	slot.args[1].store(arg1, memory_order_relaxed);
+
+	slot.sequence.store(index + 1, memory_order_release);
+}
+
+size_t TraceRecorder::Flush(std::ostream &out)
+{
+	std::lock_guard<std::mutex> guard(flushLock);
+	if (!wroteHeader)
+	{
+		out << "[\n";
+		wroteHeader = true;
+	}
+
+	const uint64_t end = head.load(memory_order_acquire);
+	if (end - tail > mask + 1)
+	{
+		numDropped.fetch_add(end - tail - (mask + 1));
+		tail = end - (mask + 1);
+	}
+
+	size_t numWritten = 0;
+	char line[512];
+	for(; tail < end; ++tail)
+	{
+		Slot &slot = slots[tail & mask];
+		const uint64_t sequence = slot.sequence.load(memory_order_acquire);
+		if (sequence == 0 || sequence < tail + 1)
+			break; // Still being recorded, flush it next time.
+		if (sequence > tail + 1)
+		{
+			numDropped.fetch_add(1);
+			continue; // Overwritten by a later event.
+		}
+
+		const char *name = slot.name.load(memory_order_relaxed);
+		const int64_t start = slot.start.load(memory_order_relaxed);
+		const int64_t duration = slot.duration.load(memory_order_relaxed);
+		const uint32_t thread = slot.thread.load(memory_order_relaxed);
+		const char *argNames[2] = { slot.argNames[0].load(memory_order_relaxed), slot.argNames[1].load(memory_order_relaxed) };
+		const int64_t args[2] = { slot.args[0].load(memory_order_relaxed), slot.args[1].load(memory_order_relaxed) };
+
+		atomic_thread_fence(memory_order_acquire);
+		if (slot.sequence.load(memory_order_relaxed) != sequence)
+		{
+			numDropped.fetch_add(1);
+			continue;
+		}
+
+		// Timestamps are in microseconds.
+		int length = snprintf(line, sizeof(line),
+			"{\"name\":\"%s\",\"cat\":\"rbp\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+			name, thread, start / 1000.0, duration / 1000.0);
+		for(int i = 0; i < 2; ++i)
+			if (argNames[i] && length < (int)sizeof(line))
+				length += snprintf(line + length, sizeof(line) - length, "%s\"%s\":%lld", i > 0 && argNames[0] ? "," : "",
+					argNames[i], (long long)args[i]);
+		out << line << "}},\n";
+		++numWritten;
+	}
+	out.flush();
+	return numWritten;
+}
+
+}
@@ -0,0 +1,224 @@
+/** @file ZonedBinPack3d.cpp
+	@brief Shards a long bin into zones along the loading axis, each with its own MAXRECTS packer.
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#include <algorithm>
+
+#include <cassert>
+#include <cstring>
+
+#include "../include/ZonedBinPack3d.h"
+
+namespace rbp {
+
+using namespace std;
+
+namespace {
+
+/// Number of failed box sizes remembered to skip the seam pass for.
+const size_t maxSeamFailures = 16;
+
+}
+
+ZonedBinPack3d::ZonedBinPack3d(int width, int height, int depth, int numZones, bool allowFlip)
+:binWidth(width),
+binHeight(height),
+binDepth(depth),
+binAllowFlip(allowFlip),
+activeZone(0),
+closeAfterFailures(4),
+failuresInARow(0),
+seamPlacements(0),
+usedVolume(0)
+{
+	assert(numZones > 0);
+
+	zones.resize(numZones);
+	int x = 0;
+	for(int i = 0; i < numZones; ++i)
+	{
+		zones[i].x = x;
+		zones[i].width = width / numZones + (i < width % numZones ? 1 : 0);
+		zones[i].packer.Init(zones[i].width, height, depth, allowFlip);
+		x += zones[i].width;
+	}
+}
+
+void ZonedBinPack3d::AddUsed(const Rect3d &newNode)
+{
+	usedVolume += (unsigned long)newNode.width * newNode.height * newNode.depth;
+	usedRectangles.push_back(newNode);
+}
+
+Rect3d ZonedBinPack3d::Insert(int width, int height, int depth)
+{
+	Rect3d newNode;
+
+	// Route the box to the active zone first, then to the zones behind it.
+	for(int i = activeZone; i < (int)zones.size(); ++i)
+	{
+		newNode = zones[i].packer.Insert(width, height, depth, MaxRectsBinPack::RectBottomLeftRule);
+		if (newNode.height == 0)
+			continue;
+
+		newNode.x += zones[i].x;
+		AddUsed(newNode);
+		if (i == activeZone)
+			failuresInARow = 0;
+		else if (++failuresInARow >= closeAfterFailures)
+		{
+			activeZone = i;
+			failuresInARow = 0;
+		}
+		return newNode;
+	}
+
+	// The open zones are too fragmented for this box. Try the spaces across their borders, unless a box no larger
+	// than this one already failed there.
+	if (!SeamPassFailedFor(width, height, depth))
+	{
+		for(int i = activeZone; i + 1 < (int)zones.size(); ++i)
+			if (InsertAcrossSeam(i, width, height, depth, newNode))
+			{
+				AddUsed(newNode);
+				++seamPlacements;
+				return newNode;
+			}
+		if (seamFailures.size() < maxSeamFailures)
+		{
+			RectSize3d failed;
+			failed.width = width;
+			failed.height = height;
+			failed.depth = depth;
+			seamFailures.push_back(failed);
+		}
+	}
+
+	memset(&newNode, 0, sizeof(Rect3d));
+	return newNode;
+}
+
+bool ZonedBinPack3d::SeamPassFailedFor(int width, int height, int depth) const
+{
+	// Free space only shrinks, so a box containing a box that found no seam space finds none either.
+	for(size_t i = 0; i < seamFailures.size(); ++i)
+	{
+		const RectSize3d &f = seamFailures[i];
+		if (depth < f.depth)
+			continue;
+		if ((width >= f.width && height >= f.height) || (binAllowFlip && height >= f.width && width >= f.height))
+			return true;
+	}
+	return false;
+}
+
+bool ZonedBinPack3d::InsertAcrossSeam(int z, int width, int height, int depth, Rect3d &newNode)
+{
+	const Zone &left = zones[z];
+	const Zone &right = zones[z + 1];
+	const std::vector<FreeRect3d> &leftFree = left.packer.GetFreeRectangles();
+	const std::vector<FreeRect3d> &rightFree = right.packer.GetFreeRectangles();
+
+	// Only the free spaces whose floor support reaches the border can be joined across it.
+	std::vector<const FreeRect3d *> rightBorder;
+	for(size_t j = 0; j < rightFree.size(); ++j)
+		if (rightFree[j].x == 0 && rightFree[j].supportx0 == 0)
+			rightBorder.push_back(&rightFree[j]);
+
+	// Pair up the free spaces touching the border from both sides on the same floor. Their union restricted to the
+	// common y and z range is a single box straddling the border, and their supports join into one x range.
+	std::vector<FreeRect3d> seamSpaces;
+	for(size_t i = 0; i < leftFree.size() && !rightBorder.empty(); ++i)
+	{
+		const FreeRect3d &l = leftFree[i];
+		if (l.x + l.width != left.width || l.supportx1 != left.width)
+			continue;
+		for(size_t j = 0; j < rightBorder.size(); ++j)
+		{
+			const FreeRect3d &r = *rightBorder[j];
+			// A box resting on two floors of different height would float over the lower one.
+			if (r.z != l.z)
+				continue;
+
+			FreeRect3d s;
+			s.x = left.x + l.x;
+			s.width = l.width + r.width;
+			s.y = max(l.y, r.y);
+			s.height = min(l.y + l.height, r.y + r.height) - s.y;
+			s.z = l.z;
+			s.depth = min(l.depth, r.depth);
+			s.supportx0 = left.x + l.supportx0;
+			s.supportx1 = right.x + r.supportx1;
+			s.supporty0 = max(s.y, max(l.supporty0, r.supporty0));
+			s.supporty1 = min(l.supporty1, r.supporty1);
+			if (s.height <= 0 || s.supporty1 <= s.supporty0)
+				continue;
+			seamSpaces.push_back(s);
+		}
+	}
+
+	// Same deepest-bottom-left order as MaxRectsBinPack.
+	std::sort(seamSpaces.begin(), seamSpaces.end(), [](const FreeRect3d &a, const FreeRect3d &b)
+	{
+		if (a.y != b.y) return a.y < b.y;
+		if (a.z != b.z) return a.z < b.z;
+		return a.x < b.x;
+	});
+
+	for(size_t i = 0; i < seamSpaces.size(); ++i)
+	{
+		const FreeRect3d &s = seamSpaces[i];
+		const int spanWidth = s.x + s.width - s.supportx0;
+		const int spanHeight = s.y + s.height - s.supporty0;
+		for(int flip = 0; flip < (binAllowFlip ? 2 : 1); ++flip)
+		{
+			const int w = flip ? height : width;
+			const int h = flip ? width : height;
+			if (spanWidth < w || spanHeight < h || s.depth < depth)
+				continue;
+
+			newNode.x = s.supportx0;
+			newNode.y = s.supporty0;
+			newNode.z = s.z;
+			newNode.width = w;
+			newNode.height = h;
+			newNode.depth = depth;
+
+			// Only boxes that actually cross the border need both zones.
+			if (newNode.x + newNode.width <= right.x || newNode.x >= right.x)
+				continue;
+
+			Rect3d leftPart = newNode;
+			leftPart.x -= left.x;
+			Rect3d rightPart = newNode;
+			rightPart.x -= right.x;
+			if (left.packer.IsBlocked(leftPart) || right.packer.IsBlocked(rightPart))
+				continue;
+
+			PlaceAcrossSeam(z, newNode);
+			return true;
+		}
+	}
+	return false;
+}
+
+void ZonedBinPack3d::PlaceAcrossSeam(int z, const Rect3d &newNode)
+{
+	// Each zone keeps the part of the box inside it.
+	for(int k = z; k <= z + 1; ++k)
+	{
+		Zone &zone = zones[k];
+		Rect3d part = newNode;
+		part.x = max(newNode.x, zone.x);
+		part.width = min(newNode.x + newNode.width, zone.x + zone.width) - part.x;
+		part.x -= zone.x;
+		zone.packer.PlaceRect(part);
+	}
+}
+
+float ZonedBinPack3d::Occupancy() const
+{
+	return (float)usedVolume / ((unsigned long)binWidth * binHeight * binDepth);
+}
+
+}
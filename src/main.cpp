@@ -1,6 +1,18 @@
 #include "../include/GuillotineBinPack3d.h"
 #include "../include/MaxRectsBinPack.h"
+#include "../include/LevelBinPack3d.h"
+#include "../include/TieredBinPack3d.h"
+#include "../include/RolloutBinPack3d.h"
+#include "../include/ConcurrentBinPack3d.h"
+#include "../include/BackgroundBinPack3d.h"
+#ifdef RBP_HAVE_RECORD_FILE
+#include "../include/RecordFile.h"
+#endif
 #include <iostream>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <thread>
 
 
 void testGuillotineBinPack(){
@@ -61,8 +73,368 @@ void testMaxRectsBinPack(){
     }
 }
 
+// The boxes the demos pack: twelve 510x290x210 boxes, then ten 480x230x190 ones.
+std::vector<rbp::RectSize3d> demoBoxes(){
+    std::vector<rbp::RectSize3d> boxes;
+    for (int i = 0; i < 12; i++){
+        rbp::RectSize3d box = {510, 290, 210};
+        boxes.push_back(box);
+    }
+    for (int i = 0; i < 10; i++){
+        rbp::RectSize3d box = {480, 230, 190};
+        boxes.push_back(box);
+    }
+    return boxes;
+}
+
+void testGuillotineMaxFitting(){
+    int bin_width = 1500;
+    int bin_height = 1500;
+    int bin_depth = 800;
+
+    using rbp::GuillotineBinPack3d;
+
+    std::vector<rbp::RectSize3d> boxes = demoBoxes();
+
+    GuillotineBinPack3d gbp(bin_width, bin_height, bin_depth);
+    std::vector<rbp::Rect3d> packed;
+    gbp.InsertMaxFitting(boxes, packed, true);
+    for (size_t i = 0; i < packed.size(); i++){
+        const rbp::Rect3d &rect = packed[i];
+        std::cout << "x:" << rect.x << "\ty:" << rect.y << "\tz:" << rect.z << "\twidth:" << rect.width<< "\theight:" << rect.height << "\tdepth:" << rect.depth << std::endl;
+    }
+    std::cout << "packed " << packed.size() << " boxes, occupancy " << gbp.Occupancy() << std::endl;
+}
+
+void testLevelBinPack(){
+    int bin_width = 1500;
+    int bin_height = 1500;
+    int bin_depth = 800;
+
+    std::vector<rbp::RectSize3d> boxes = demoBoxes();
+
+    using rbp::LevelBinPack3d;
+
+    LevelBinPack3d lbp(bin_width, bin_height, bin_depth);
+    for (size_t i = 0; i < boxes.size(); i++){
+        auto rect = lbp.Insert(boxes[i].width, boxes[i].height, boxes[i].depth);
+        std::cout << "x:" << rect.x << "\ty:" << rect.y << "\tz:" << rect.z << "\twidth:" << rect.width<< "\theight:" << rect.height << "\tdepth:" << rect.depth << std::endl;
+    }
+    std::cout << "occupancy " << lbp.Occupancy() << std::endl;
+}
+
+void testTieredBinPack(){
+    int bin_width = 1500;
+    int bin_height = 1500;
+    int bin_depth = 800;
+
+    std::vector<rbp::RectSize3d> boxes = demoBoxes();
+
+    using rbp::TieredBinPack3d;
+
+    TieredBinPack3d tbp(bin_width, bin_height, bin_depth);
+    tbp.SetTierBudget(TieredBinPack3d::TierLevel, 5);
+    for (size_t i = 0; i < boxes.size(); i++){
+        TieredBinPack3d::Tier tier;
+        auto rect = tbp.Insert(boxes[i].width, boxes[i].height, boxes[i].depth, &tier);
+        std::cout << "x:" << rect.x << "\ty:" << rect.y << "\tz:" << rect.z << "\twidth:" << rect.width<< "\theight:" << rect.height << "\tdepth:" << rect.depth << "\ttier:" << tier << std::endl;
+    }
+    for (int i = 0; i < TieredBinPack3d::NumTiers; i++){
+        const TieredBinPack3d::TierStats &stats = tbp.GetTierStats((TieredBinPack3d::Tier)i);
+        std::cout << "tier " << i << ": " << stats.hits << "/" << stats.attempts << " hits, " << stats.escalated << " escalated, " << stats.totalMicroseconds << " us" << std::endl;
+    }
+}
+
+void testRolloutBinPack(){
+    int bin_width = 1500;
+    int bin_height = 1500;
+    int bin_depth = 800;
+
+    std::vector<rbp::RectSize3d> boxes = demoBoxes();
+
+    using rbp::RolloutBinPack3d;
+
+    RolloutBinPack3d rlbp(bin_width, bin_height, bin_depth);
+    rlbp.SetDecisionBudget(50.0);
+    for (size_t i = 0; i < boxes.size(); i++){
+        auto rect = rlbp.Insert(boxes[i].width, boxes[i].height, boxes[i].depth);
+        std::cout << "x:" << rect.x << "\ty:" << rect.y << "\tz:" << rect.z << "\twidth:" << rect.width<< "\theight:" << rect.height << "\tdepth:" << rect.depth << "\trollouts:" << rlbp.GetLastNumRollouts() << std::endl;
+    }
+    std::cout << "occupancy: " << rlbp.Occupancy() << std::endl;
+}
+
+void testConcurrentBinPack(){
+    int bin_width = 1500;
+    int bin_height = 1500;
+    int bin_depth = 800;
+
+    using rbp::ConcurrentBinPack3d;
+
+    // Two arms share a bin split into 2x2 regions. Each arm packs its own boxes, then both try a box larger
+    // than a region, which has to go across regions.
+    ConcurrentBinPack3d cbp(bin_width, bin_height, bin_depth, 2, 2);
+    std::vector<std::thread> arms;
+    for (int arm = 0; arm < 2; arm++){
+        arms.push_back(std::thread([&cbp, arm](){
+            for (int i = 0; i < 20; i++)
+                cbp.Insert(510, 290, 210, arm);
+            cbp.Insert(1000, 1000, 100, arm);
+        }));
+    }
+    for (size_t i = 0; i < arms.size(); i++)
+        arms[i].join();
+
+    std::vector<rbp::Rect3d> used = cbp.GetUsedRectangles();
+    for (size_t i = 0; i < used.size(); i++){
+        for (size_t j = i + 1; j < used.size(); j++){
+            if (!rbp::DisjointRectCollection3d::Disjoint(used[i], used[j]))
+                std::cout << "overlap: " << i << " " << j << std::endl;
+        }
+    }
+    std::cout << "placed " << used.size() << " boxes, occupancy " << cbp.Occupancy() << ", contentions "
+        << cbp.Contentions() << ", conflicts " << cbp.Conflicts() << std::endl;
+}
+
+void testBackgroundBinPack(){
+    int bin_width = 1500;
+    int bin_height = 1500;
+    int bin_depth = 800;
+
+    std::vector<rbp::RectSize3d> boxes = demoBoxes();
+
+    using rbp::BackgroundBinPack3d;
+
+    // The boxes arrive without waiting for the worker; boxes placed while it compacts are cut out of its result.
+    for (int backend = 0; backend < 2; backend++){
+        BackgroundBinPack3d bbp(bin_width, bin_height, bin_depth, (BackgroundBinPack3d::Backend)backend);
+        for (size_t i = 0; i < boxes.size(); i++){
+            auto rect = bbp.Insert(boxes[i].width, boxes[i].height, boxes[i].depth);
+            std::cout << "x:" << rect.x << "\ty:" << rect.y << "\tz:" << rect.z << "\twidth:" << rect.width<< "\theight:" << rect.height << "\tdepth:" << rect.depth << std::endl;
+        }
+        bbp.WaitForMaintenance();
+        std::cout << "backend " << backend << ": occupancy " << bbp.Occupancy() << ", published " << bbp.NumPublished()
+            << ", rebased " << bbp.NumRebased() << ", free " << bbp.NumFreeRectangles() << std::endl;
+    }
+}
+
+void testParallelPrune(){
+    int bin_width = 1500;
+    int bin_height = 1500;
+    int bin_depth = 800;
+
+    std::vector<rbp::RectSize3d> boxes = demoBoxes();
+
+    using rbp::MaxRectsBinPack;
+
+    // The same boxes packed with the prune on the calling thread and on a pool. A threshold of one space makes
+    // every prune of the small free list go through the pool; the placements must not change.
+    rbp::ThreadPool pool(4);
+    MaxRectsBinPack serial(bin_width, bin_height, bin_depth);
+    MaxRectsBinPack parallel(bin_width, bin_height, bin_depth);
+    parallel.SetPruneThreadPool(&pool, 1);
+    size_t num_different = 0;
+    for (size_t i = 0; i < boxes.size(); i++){
+        rbp::Rect3d a = serial.Insert(boxes[i].width, boxes[i].height, boxes[i].depth,
+            MaxRectsBinPack::RectBottomLeftRule);
+        rbp::Rect3d b = parallel.Insert(boxes[i].width, boxes[i].height, boxes[i].depth,
+            MaxRectsBinPack::RectBottomLeftRule);
+        if (a.x != b.x || a.y != b.y || a.z != b.z || a.width != b.width || a.height != b.height || a.depth != b.depth)
+            num_different++;
+    }
+    std::cout << "different placements " << num_different << ", free " << serial.GetFreeRectangles().size()
+        << " serial, " << parallel.GetFreeRectangles().size() << " parallel" << std::endl;
+}
+
+void testTryInsertBatch(){
+    int bin_width = 1500;
+    int bin_height = 1500;
+    int bin_depth = 800;
+
+    using rbp::GuillotineBinPack3d;
+    using rbp::MaxRectsBinPack;
+
+    // Candidate boxes scored against a half full bin, one at a time and as a batch on a pool. Both must give
+    // the same tokens, and the best one must commit.
+    std::vector<rbp::RectSize3d> boxes;
+    for (int i = 0; i < 200; i++){
+        rbp::RectSize3d box = {100 + (i * 37) % 500, 80 + (i * 53) % 400, 60 + (i * 29) % 300};
+        boxes.push_back(box);
+    }
+    GuillotineBinPack3d gbp(bin_width, bin_height, bin_depth);
+    MaxRectsBinPack mbp(bin_width, bin_height, bin_depth);
+    for (int i = 0; i < 12; i++){
+        gbp.Insert(510, 290, 210, GuillotineBinPack3d::MergeLazy, GuillotineBinPack3d::RectBestShortSideFit,
+            GuillotineBinPack3d::SplitShorterLeftoverAxis);
+        mbp.Insert(510, 290, 210, MaxRectsBinPack::RectBottomLeftRule);
+    }
+
+    rbp::ThreadPool pool(4);
+    std::vector<rbp::InsertToken> gbp_tokens, mbp_tokens;
+    gbp.TryInsertBatch(boxes, GuillotineBinPack3d::RectBestShortSideFit, gbp_tokens, &pool);
+    mbp.TryInsertBatch(boxes, MaxRectsBinPack::RectBottomLeftRule, mbp_tokens, &pool);
+    size_t num_different = 0;
+    size_t best = 0;
+    for (size_t i = 0; i < boxes.size(); i++){
+        rbp::InsertToken g = gbp.TryInsert(boxes[i].width, boxes[i].height, boxes[i].depth,
+            GuillotineBinPack3d::RectBestShortSideFit);
+        rbp::InsertToken m = mbp.TryInsert(boxes[i].width, boxes[i].height, boxes[i].depth,
+            MaxRectsBinPack::RectBottomLeftRule);
+        if (g.score != gbp_tokens[i].score || g.freeRectIndex != gbp_tokens[i].freeRectIndex)
+            num_different++;
+        if (m.score != mbp_tokens[i].score || m.freeRectIndex != mbp_tokens[i].freeRectIndex)
+            num_different++;
+        if (mbp_tokens[i].placement.height != 0 && (mbp_tokens[best].placement.height == 0
+            || mbp_tokens[i].score < mbp_tokens[best].score))
+            best = i;
+    }
+    std::cout << "different tokens " << num_different << ", committed box " << best << ": "
+        << (mbp.Commit(mbp_tokens[best]) ? "yes" : "no") << ", stale token committed: "
+        << (mbp.Commit(mbp_tokens[best]) ? "yes" : "no") << std::endl;
+}
+
+void testFreeSpaceTree(){
+    int bin_width = 1500;
+    int bin_height = 1500;
+    int bin_depth = 800;
+
+    using rbp::GuillotineBinPack3d;
+
+    // Mixed boxes packed with the free list scan and with the FreeSpaceTree3d backend, under every merge
+    // policy. Both backends find the same free rectangle, so the placements must match.
+    int num_different = 0;
+    for (int merge = GuillotineBinPack3d::MergeNever; merge <= GuillotineBinPack3d::MergeLazy; merge++){
+        GuillotineBinPack3d list(bin_width, bin_height, bin_depth);
+        GuillotineBinPack3d tree(bin_width, bin_height, bin_depth);
+        tree.SetFreeSpaceBackend(GuillotineBinPack3d::FreeSpaceTree);
+        for (int i = 0; i < 300; i++){
+            int width = 100 + (i * 37) % 500;
+            int height = 80 + (i * 53) % 400;
+            int depth = 60 + (i * 29) % 300;
+            rbp::Rect3d a = list.Insert(width, height, depth, (GuillotineBinPack3d::MergePolicy)merge,
+                GuillotineBinPack3d::RectBestShortSideFit, GuillotineBinPack3d::SplitShorterLeftoverAxis);
+            rbp::Rect3d b = tree.Insert(width, height, depth, (GuillotineBinPack3d::MergePolicy)merge,
+                GuillotineBinPack3d::RectBestShortSideFit, GuillotineBinPack3d::SplitShorterLeftoverAxis);
+            if (a.x != b.x || a.y != b.y || a.z != b.z || a.width != b.width || a.height != b.height || a.depth != b.depth)
+                num_different++;
+        }
+        std::cout << "merge policy " << merge << ": occupancy " << list.Occupancy() << " list, " << tree.Occupancy()
+            << " tree" << std::endl;
+    }
+    std::cout << "different placements " << num_different << std::endl;
+}
+
+#ifdef RBP_HAVE_RECORD_FILE
+// The packer a manifest is replayed with. A workload found by adversarialWorkload only reproduces with the
+// packer and heuristics it was searched for.
+struct ReplaySettings{
+    bool max_rects = false;
+    rbp::GuillotineBinPack3d::MergePolicy merge_policy = rbp::GuillotineBinPack3d::MergeLazy;
+    rbp::GuillotineBinPack3d::FreeRectChoiceHeuristic rect_choice = rbp::GuillotineBinPack3d::RectBestShortSideFit;
+    rbp::GuillotineBinPack3d::GuillotineSplitHeuristic split_method = rbp::GuillotineBinPack3d::SplitShorterLeftoverAxis;
+};
+
+// Packs every box of a binary manifest, starting a new bin whenever the order changes, and writes the placements
+// in the same order. Boxes that did not fit get a placement of zero size.
+int replayManifest(const char* manifest_path, const char* placement_path, const ReplaySettings& settings){
+    using rbp::GuillotineBinPack3d;
+    using rbp::MaxRectsBinPack;
+    using rbp::ManifestRecord;
+    using rbp::RecordFileReader;
+
+    RecordFileReader reader;
+    if (!reader.Open(manifest_path, RecordFileReader::manifestMagic, sizeof(ManifestRecord))){
+        std::cerr << reader.GetError() << "\n";
+        return 1;
+    }
+    const rbp::RecordFileHeader& header = reader.Header();
+    rbp::RecordFileWriter writer;
+    if (!writer.Open(placement_path, RecordFileReader::placementMagic, sizeof(rbp::Rect3d),
+        header.binWidth, header.binHeight, header.binDepth)){
+        std::cerr << writer.GetError() << "\n";
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    GuillotineBinPack3d gbp;
+    MaxRectsBinPack mrbp;
+    const ManifestRecord* records = reader.Records<ManifestRecord>();
+    uint64_t num_placed = 0;
+    for (uint64_t i = 0; i < reader.Count(); i++){
+        const ManifestRecord& box = records[i];
+        if (i == 0 || box.order != records[i - 1].order){
+            if (settings.max_rects)
+                mrbp.Init(header.binWidth, header.binHeight, header.binDepth);
+            else
+                gbp.Init(header.binWidth, header.binHeight, header.binDepth);
+        }
+        rbp::Rect3d rect;
+        if (settings.max_rects)
+            rect = mrbp.Insert(box.width, box.height, box.depth, MaxRectsBinPack::RectBottomLeftRule);
+        else
+            rect = gbp.Insert(box.width, box.height, box.depth, settings.merge_policy, settings.rect_choice,
+                settings.split_method);
+        if (rect.height != 0)
+            num_placed++;
+        if (!writer.Append(rect))
+            break;
+    }
+    if (!writer.Close()){
+        std::cerr << writer.GetError() << "\n";
+        return 1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "placed " << num_placed << " of " << reader.Count() << " boxes in " << seconds << " s\n";
+    return 0;
+}
+
+// testSkyline replay <manifest> <placements> [maxrects | guillotine [MERGE CHOICE SPLIT]]
+int replayMain(int argc, char* argv[]){
+    ReplaySettings settings;
+    if (argc >= 5)
+        settings.max_rects = strcmp(argv[4], "maxrects") == 0;
+    if (argc == 8 && !settings.max_rects){
+        int merge = atoi(argv[5]);
+        int choice = atoi(argv[6]);
+        int split = atoi(argv[7]);
+        if (merge < 0 || merge > 2 || choice < 0 || choice > 5 || split < 0 || split > 5){
+            std::cerr << "invalid heuristic\n";
+            return 2;
+        }
+        settings.merge_policy = (rbp::GuillotineBinPack3d::MergePolicy)merge;
+        settings.rect_choice = (rbp::GuillotineBinPack3d::FreeRectChoiceHeuristic)choice;
+        settings.split_method = (rbp::GuillotineBinPack3d::GuillotineSplitHeuristic)split;
+    }
+    else if (argc != 4 && argc != 5){
+        std::cerr << "usage: " << argv[0] << " replay <manifest> <placements> [maxrects | guillotine [MERGE CHOICE SPLIT]]\n";
+        return 2;
+    }
+    if (argc >= 5 && !settings.max_rects && strcmp(argv[4], "guillotine") != 0){
+        std::cerr << "unknown packer " << argv[4] << "\n";
+        return 2;
+    }
+    return replayManifest(argv[2], argv[3], settings);
+}
+#endif
+
 int main(int argc, char* argv[]){
+#ifdef RBP_HAVE_RECORD_FILE
+    if (argc >= 4 && strcmp(argv[1], "replay") == 0)
+        return replayMain(argc, argv);
+#else
+    (void)argc;
+    (void)argv;
+#endif
+
     //testMaxRectsBinPack();
+    //testGuillotineMaxFitting();
+    //testLevelBinPack();
+    //testTieredBinPack();
+    //testRolloutBinPack();
+    //testConcurrentBinPack();
+    //testBackgroundBinPack();
+    //testParallelPrune();
+    //testTryInsertBatch();
+    //testFreeSpaceTree();
     testGuillotineBinPack();
     return 0;    
 }
\ No newline at end of file
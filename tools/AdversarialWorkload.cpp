@@ -0,0 +1,302 @@
+/** @file AdversarialWorkload.cpp
+	@brief Searches for box sequences that blow up the free list of a packer, and saves them as manifests.
+	This work is released to Public Domain, do whatever you want with it.
+
+	adversarialWorkload <maxrects|guillotine> <out.bin> [options]
+		--seed N              Seed of the search (1). The search is deterministic for --objective free.
+		--boxes N             Length of the sequences (60).
+		--population N        Sequences kept per generation (16).
+		--generations N       Generations to evolve (200).
+		--bin W H D           Bin size (1200 1000 1500).
+		--sizes MIN MAX       Range of the box sides (50 400).
+		--objective free|time Maximize the peak free list size, or the slowest insert (free).
+		--merge N --choice N --split N
+		                      MergePolicy, FreeRectChoiceHeuristic and GuillotineSplitHeuristic of the
+		                      guillotine packer (2 0 0).
+
+	The worst sequence found is written as a manifest of a single order, to be replayed by testSkyline replay or
+	converted with recordFileConvert. The manifest only holds the boxes, so the tool prints the testSkyline replay
+	command line that packs them with the same packer and heuristics.
+*/
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "../include/GuillotineBinPack3d.h"
+#include "../include/MaxRectsBinPack.h"
+#include "../include/RecordFile.h"
+
+using namespace rbp;
+
+namespace {
+
+struct Settings
+{
+	bool maxRects;
+	const char *outPath;
+	unsigned int seed;
+	int numBoxes;
+	int populationSize;
+	int numGenerations;
+	int binWidth;
+	int binHeight;
+	int binDepth;
+	int minSide;
+	int maxSide;
+	bool timeObjective;
+	GuillotineBinPack3d::MergePolicy mergePolicy;
+	GuillotineBinPack3d::FreeRectChoiceHeuristic rectChoice;
+	GuillotineBinPack3d::GuillotineSplitHeuristic splitMethod;
+};
+
+typedef std::vector<RectSize3d> Sequence;
+
+struct Candidate
+{
+	Sequence boxes;
+	double score;
+	size_t peakFree; ///< The largest free list seen while packing boxes.
+	double slowestInsert; ///< Microseconds.
+};
+
+/// Packs the sequence into an empty bin and records the peak free list size and the slowest insert.
+void Evaluate(const Settings &settings, Candidate &candidate)
+{
+	typedef std::chrono::steady_clock Clock;
+	GuillotineBinPack3d guillotine;
+	MaxRectsBinPack maxRects;
+	candidate.peakFree = 0;
+	candidate.slowestInsert = 0.0;
+
+	// The slowest insert is the least noisy over a few repeats.
+	const int numRepeats = settings.timeObjective ? 3 : 1;
+	for(int repeat = 0; repeat < numRepeats; ++repeat)
+	{
+		if (settings.maxRects)
+			maxRects.Init(settings.binWidth, settings.binHeight, settings.binDepth);
+		else
+			guillotine.Init(settings.binWidth, settings.binHeight, settings.binDepth);
+
+		double slowest = 0.0;
+		for(size_t i = 0; i < candidate.boxes.size(); ++i)
+		{
+			const RectSize3d &box = candidate.boxes[i];
+			Clock::time_point start = Clock::now();
+			size_t numFree;
+			if (settings.maxRects)
+			{
+				maxRects.Insert(box.width, box.height, box.depth, MaxRectsBinPack::RectBottomLeftRule);
+				numFree = maxRects.GetFreeRectangles().size();
+			}
+			else
+			{
+				guillotine.Insert(box.width, box.height, box.depth, settings.mergePolicy, settings.rectChoice,
+					settings.splitMethod);
+				numFree = guillotine.GetFreeRectangles().size() + guillotine.GetQuarantinedRectangles().size();
+			}
+			slowest = std::max(slowest, std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+			candidate.peakFree = std::max(candidate.peakFree, numFree);
+		}
+		candidate.slowestInsert = repeat == 0 ? slowest : std::min(candidate.slowestInsert, slowest);
+	}
+	candidate.score = settings.timeObjective ? candidate.slowestInsert : (double)candidate.peakFree;
+}
+
+RectSize3d RandomBox(const Settings &settings, std::mt19937 &rng)
+{
+	std::uniform_int_distribution<int> side(settings.minSide, settings.maxSide);
+	RectSize3d box;
+	box.width = side(rng);
+	box.height = side(rng);
+	box.depth = side(rng);
+	return box;
+}
+
+/// Applies one random edit: a new box, a nudged side, a swap, a copy of another box, or a crossover with mate.
+void Mutate(const Settings &settings, Sequence &boxes, const Sequence &mate, std::mt19937 &rng)
+{
+	std::uniform_int_distribution<int> position(0, (int)boxes.size() - 1);
+	const int i = position(rng);
+	const int j = position(rng);
+	switch(rng() % 5)
+	{
+	case 0:
+		boxes[i] = RandomBox(settings, rng);
+		break;
+	case 1:
+	{
+		int *sides[3] = { &boxes[i].width, &boxes[i].height, &boxes[i].depth };
+		int &side = *sides[rng() % 3];
+		side = std::min(settings.maxSide, std::max(settings.minSide, side + (int)(rng() % 41) - 20));
+		break;
+	}
+	case 2:
+		std::swap(boxes[i], boxes[j]);
+		break;
+	case 3:
+		boxes[i] = boxes[j];
+		break;
+	default:
+		std::copy(mate.begin() + std::min(i, j), mate.begin() + std::max(i, j) + 1, boxes.begin() + std::min(i, j));
+		break;
+	}
+}
+
+bool BetterCandidate(const Candidate &a, const Candidate &b)
+{
+	return a.score > b.score;
+}
+
+int Search(const Settings &settings)
+{
+	std::mt19937 rng(settings.seed);
+	std::vector<Candidate> population(settings.populationSize);
+	for(size_t p = 0; p < population.size(); ++p)
+	{
+		for(int i = 0; i < settings.numBoxes; ++i)
+			population[p].boxes.push_back(RandomBox(settings, rng));
+		Evaluate(settings, population[p]);
+	}
+	std::stable_sort(population.begin(), population.end(), BetterCandidate);
+
+	// (mu + lambda): every generation breeds as many children as there are parents, and the best of both survive.
+	std::vector<Candidate> pool;
+	for(int generation = 0; generation < settings.numGenerations; ++generation)
+	{
+		const double bestBefore = population[0].score;
+		pool = population;
+		std::uniform_int_distribution<int> parent(0, settings.populationSize - 1);
+		for(int c = 0; c < settings.populationSize; ++c)
+		{
+			// Binary tournaments for both parents.
+			const int a = std::min(parent(rng), parent(rng));
+			const int b = std::min(parent(rng), parent(rng));
+			Candidate child;
+			child.boxes = population[a].boxes;
+			const int numEdits = 1 + (int)(rng() % 3);
+			for(int e = 0; e < numEdits; ++e)
+				Mutate(settings, child.boxes, population[b].boxes, rng);
+			Evaluate(settings, child);
+			pool.push_back(child);
+		}
+		std::stable_sort(pool.begin(), pool.end(), BetterCandidate);
+		population.assign(pool.begin(), pool.begin() + settings.populationSize);
+
+		if (population[0].score > bestBefore)
+			fprintf(stderr, "generation %d: peak free list %zu, slowest insert %.1f us\n", generation,
+				population[0].peakFree, population[0].slowestInsert);
+	}
+
+	const Candidate &worst = population[0];
+	RecordFileWriter writer;
+	if (writer.Open(settings.outPath, RecordFileReader::manifestMagic, sizeof(ManifestRecord),
+		settings.binWidth, settings.binHeight, settings.binDepth))
+		for(size_t i = 0; i < worst.boxes.size(); ++i)
+		{
+			ManifestRecord record = { 0, worst.boxes[i].width, worst.boxes[i].height, worst.boxes[i].depth };
+			writer.Append(record);
+		}
+	if (!writer.Close())
+	{
+		fprintf(stderr, "%s\n", writer.GetError().c_str());
+		return 1;
+	}
+	printf("worst sequence: peak free list %zu, slowest insert %.1f us, written to %s\n", worst.peakFree,
+		worst.slowestInsert, settings.outPath);
+	if (settings.maxRects)
+		printf("replay with: testSkyline replay %s <placements.bin> maxrects\n", settings.outPath);
+	else
+		printf("replay with: testSkyline replay %s <placements.bin> guillotine %d %d %d\n", settings.outPath,
+			(int)settings.mergePolicy, (int)settings.rectChoice, (int)settings.splitMethod);
+	return 0;
+}
+
+void PrintUsage(const char *program)
+{
+	fprintf(stderr, "usage: %s <maxrects|guillotine> <out.bin> [--seed N] [--boxes N] [--population N] "
+		"[--generations N]\n\t[--bin W H D] [--sizes MIN MAX] [--objective free|time] [--merge N] [--choice N] "
+		"[--split N]\n", program);
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3 || (strcmp(argv[1], "maxrects") != 0 && strcmp(argv[1], "guillotine") != 0))
+	{
+		PrintUsage(argv[0]);
+		return 2;
+	}
+
+	Settings settings;
+	settings.maxRects = strcmp(argv[1], "maxrects") == 0;
+	settings.outPath = argv[2];
+	settings.seed = 1;
+	settings.numBoxes = 60;
+	settings.populationSize = 16;
+	settings.numGenerations = 200;
+	settings.binWidth = 1200;
+	settings.binHeight = 1000;
+	settings.binDepth = 1500;
+	settings.minSide = 50;
+	settings.maxSide = 400;
+	settings.timeObjective = false;
+	settings.mergePolicy = GuillotineBinPack3d::MergeLazy;
+	settings.rectChoice = GuillotineBinPack3d::RectBestAreaFit;
+	settings.splitMethod = GuillotineBinPack3d::SplitShorterLeftoverAxis;
+
+	for(int i = 3; i < argc; ++i)
+	{
+		const char *option = argv[i];
+		const int numValues = argc - i - 1;
+		if (strcmp(option, "--seed") == 0 && numValues >= 1)
+			settings.seed = (unsigned int)strtoul(argv[++i], 0, 10);
+		else if (strcmp(option, "--boxes") == 0 && numValues >= 1)
+			settings.numBoxes = atoi(argv[++i]);
+		else if (strcmp(option, "--population") == 0 && numValues >= 1)
+			settings.populationSize = atoi(argv[++i]);
+		else if (strcmp(option, "--generations") == 0 && numValues >= 1)
+			settings.numGenerations = atoi(argv[++i]);
+		else if (strcmp(option, "--bin") == 0 && numValues >= 3)
+		{
+			settings.binWidth = atoi(argv[++i]);
+			settings.binHeight = atoi(argv[++i]);
+			settings.binDepth = atoi(argv[++i]);
+		}
+		else if (strcmp(option, "--sizes") == 0 && numValues >= 2)
+		{
+			settings.minSide = atoi(argv[++i]);
+			settings.maxSide = atoi(argv[++i]);
+		}
+		else if (strcmp(option, "--objective") == 0 && numValues >= 1)
+			settings.timeObjective = strcmp(argv[++i], "time") == 0;
+		else if (strcmp(option, "--merge") == 0 && numValues >= 1)
+			settings.mergePolicy = (GuillotineBinPack3d::MergePolicy)atoi(argv[++i]);
+		else if (strcmp(option, "--choice") == 0 && numValues >= 1)
+			settings.rectChoice = (GuillotineBinPack3d::FreeRectChoiceHeuristic)atoi(argv[++i]);
+		else if (strcmp(option, "--split") == 0 && numValues >= 1)
+			settings.splitMethod = (GuillotineBinPack3d::GuillotineSplitHeuristic)atoi(argv[++i]);
+		else
+		{
+			PrintUsage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (settings.numBoxes < 1 || settings.populationSize < 1 || settings.numGenerations < 0 ||
+		settings.binWidth < 1 || settings.binHeight < 1 || settings.binDepth < 1 ||
+		settings.minSide < 1 || settings.maxSide < settings.minSide ||
+		settings.mergePolicy < GuillotineBinPack3d::MergeNever || settings.mergePolicy > GuillotineBinPack3d::MergeLazy ||
+		settings.rectChoice < GuillotineBinPack3d::RectBestAreaFit || settings.rectChoice > GuillotineBinPack3d::RectWorstLongSideFit ||
+		settings.splitMethod < GuillotineBinPack3d::SplitShorterLeftoverAxis || settings.splitMethod > GuillotineBinPack3d::SplitLongerAxis)
+	{
+		fprintf(stderr, "invalid option value\n");
+		return 2;
+	}
+	return Search(settings);
+}
@@ -0,0 +1,179 @@
+/** @file RecordFileConvert.cpp
+	@brief Converts record files to and from CSV.
+	This work is released to Public Domain, do whatever you want with it.
+
+	recordFileConvert to-binary <in.csv> <out.bin> <binWidth> <binHeight> <binDepth>
+		Rows of four columns (order,width,height,depth) make a manifest, rows of six columns
+		(x,y,z,width,height,depth) a placement file. A first line that does not start with a number is a header.
+	recordFileConvert to-csv <in.bin> <out.csv>
+		Writes a manifest or a placement file as CSV with a header line.
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <string>
+
+#include "../include/RecordFile.h"
+
+using namespace rbp;
+
+namespace {
+
+/// Parses up to maxValues comma separated integers of line.
+/// @return The number of values parsed, or -1 if the line is malformed.
+int ParseRow(const char *line, int *values, int maxValues)
+{
+	int count = 0;
+	const char *p = line;
+	for(;;)
+	{
+		char *end;
+		long value = strtol(p, &end, 10);
+		if (end == p || count == maxValues)
+			return -1;
+		values[count++] = (int)value;
+		while(*end == ' ' || *end == '\t')
+			++end;
+		if (*end == ',')
+			p = end + 1;
+		else if (*end == '\0' || *end == '\n' || *end == '\r')
+			return count;
+		else
+			return -1;
+	}
+}
+
+int ToBinary(const char *inPath, const char *outPath, int binWidth, int binHeight, int binDepth)
+{
+	FILE *in = fopen(inPath, "r");
+	if (!in)
+	{
+		perror(inPath);
+		return 1;
+	}
+	static char inBuffer[1 << 20];
+	setvbuf(in, inBuffer, _IOFBF, sizeof(inBuffer));
+
+	RecordFileWriter writer;
+	int columns = 0;
+	char line[256];
+	unsigned long lineNumber = 0;
+	while(fgets(line, sizeof(line), in))
+	{
+		++lineNumber;
+		if (lineNumber == 1 && !isdigit((unsigned char)line[0]) && line[0] != '-')
+			continue;
+		if (line[0] == '\n' || line[0] == '\r')
+			continue;
+
+		int values[6];
+		int count = ParseRow(line, values, 6);
+		if (count != 4 && count != 6)
+		{
+			fprintf(stderr, "%s:%lu: expected 4 or 6 integer columns\n", inPath, lineNumber);
+			fclose(in);
+			return 1;
+		}
+		if (columns == 0)
+		{
+			columns = count;
+			bool opened = count == 4 ?
+				writer.Open(outPath, RecordFileReader::manifestMagic, sizeof(ManifestRecord), binWidth, binHeight, binDepth) :
+				writer.Open(outPath, RecordFileReader::placementMagic, sizeof(Rect3d), binWidth, binHeight, binDepth);
+			if (!opened)
+				break;
+		}
+		else if (count != columns)
+		{
+			fprintf(stderr, "%s:%lu: expected %d columns\n", inPath, lineNumber, columns);
+			fclose(in);
+			return 1;
+		}
+
+		bool ok;
+		if (count == 4)
+		{
+			ManifestRecord record = { values[0], values[1], values[2], values[3] };
+			ok = writer.Append(record);
+		}
+		else
+		{
+			Rect3d placement = { values[0], values[1], values[2], values[3], values[4], values[5] };
+			ok = writer.Append(placement);
+		}
+		if (!ok)
+			break;
+	}
+	fclose(in);
+
+	if (columns == 0 && !writer.Open(outPath, RecordFileReader::manifestMagic, sizeof(ManifestRecord),
+		binWidth, binHeight, binDepth))
+		columns = -1;
+	if (!writer.Close() || columns < 0)
+	{
+		fprintf(stderr, "%s\n", writer.GetError().c_str());
+		return 1;
+	}
+	return 0;
+}
+
+int ToCsv(const char *inPath, const char *outPath)
+{
+	RecordFileReader reader;
+	if (!reader.Open(inPath, RecordFileReader::manifestMagic, sizeof(ManifestRecord)) &&
+		!reader.Open(inPath, RecordFileReader::placementMagic, sizeof(Rect3d)))
+	{
+		fprintf(stderr, "%s\n", reader.GetError().c_str());
+		return 1;
+	}
+
+	FILE *out = fopen(outPath, "w");
+	if (!out)
+	{
+		perror(outPath);
+		return 1;
+	}
+	static char outBuffer[1 << 20];
+	setvbuf(out, outBuffer, _IOFBF, sizeof(outBuffer));
+
+	if (reader.IsManifest())
+	{
+		fputs("order,width,height,depth\n", out);
+		const ManifestRecord *records = reader.Records<ManifestRecord>();
+		for(uint64_t i = 0; i < reader.Count(); ++i)
+			fprintf(out, "%d,%d,%d,%d\n", records[i].order, records[i].width, records[i].height, records[i].depth);
+	}
+	else
+	{
+		fputs("x,y,z,width,height,depth\n", out);
+		const Rect3d *placements = reader.Records<Rect3d>();
+		for(uint64_t i = 0; i < reader.Count(); ++i)
+		{
+			const Rect3d &r = placements[i];
+			fprintf(out, "%d,%d,%d,%d,%d,%d\n", r.x, r.y, r.z, r.width, r.height, r.depth);
+		}
+	}
+
+	if (fclose(out) != 0)
+	{
+		perror(outPath);
+		return 1;
+	}
+	return 0;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc == 7 && strcmp(argv[1], "to-binary") == 0)
+		return ToBinary(argv[2], argv[3], atoi(argv[4]), atoi(argv[5]), atoi(argv[6]));
+	if (argc == 4 && strcmp(argv[1], "to-csv") == 0)
+		return ToCsv(argv[2], argv[3]);
+
+	fprintf(stderr,
+		"usage: %s to-binary <in.csv> <out.bin> <binWidth> <binHeight> <binDepth>\n"
+		"       %s to-csv <in.bin> <out.csv>\n", argv[0], argv[0]);
+	return 2;
+}